@@ -0,0 +1,38 @@
+#!/bin/sh
+# Compares cold startup with and without the .knc cache on generated
+# programs of 10k and 1M tokens. Each time is the median of RUNS runs;
+# "cached" runs find the image that an earlier run wrote.
+#
+#   bench/cache.sh [path/to/kinnie] [runs]
+
+kinnie=${1:-./kinnie}
+runs=${2:-5}
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+median() {
+    sort -n | awk '{ t[NR] = $1 } END { print (NR % 2) ? t[(NR + 1) / 2] : int((t[NR / 2] + t[NR / 2 + 1]) / 2) }'
+}
+
+time_runs() {
+    n=0
+    while [ "$n" -lt "$runs" ]; do
+        start=$(date +%s%N)
+        "$kinnie" "$@" > /dev/null || exit 1
+        end=$(date +%s%N)
+        echo $(((end - start) / 1000))
+        n=$((n + 1))
+    done | median
+}
+
+for size in 10000 1000000; do
+    program="$dir/large_$size.kn"
+    "$(dirname "$0")/gen_large.sh" "$size" > "$program"
+
+    uncached=$(time_runs --no-cache "$program")
+    "$kinnie" "$program" > /dev/null || exit 1
+    cached=$(time_runs "$program")
+
+    printf 'tokens=%-8s uncached %8d us  cached %8d us  image %d bytes\n' "$size" "$uncached" "$cached" \
+        "$(wc -c < "${program}c")"
+done
@@ -0,0 +1,28 @@
+#!/bin/sh
+# Writes a kinnie program of roughly TOKENS tokens to stdout.
+#
+#   bench/gen_large.sh 1000000 > large.kn
+#
+# The program is a long list of straight-line arithmetic functions that
+# main calls once each, so run time is dominated by loading the source.
+
+tokens=${1:-10000}
+
+awk -v target="$tokens" 'BEGIN {
+    statements = 40
+    per_function = statements * 8 + 20
+    count = int(target / per_function)
+    if (count < 1) count = 1
+
+    for (f = 0; f < count; f++) {
+        printf "fun f%d(a) {\n    var v0 = a\n", f
+        for (s = 1; s <= statements; s++)
+            printf "    var v%d = v%d + %d %% 7\n", s, s - 1, s + f
+        printf "    ret v%d\n}\n\n", statements
+    }
+
+    printf "fun main {\n    var total = 0\n"
+    for (f = 0; f < count; f++)
+        printf "    var r = f%d(%d)\n    total = total + r\n", f, f
+    printf "    out \"total {total}\\n\"\n}\n"
+}'
@@ -0,0 +1,20 @@
+#!/bin/sh
+# Times kinnie on generated programs of 10k and 1M tokens, without the
+# .knc cache, so every run tokenizes, parses and compiles the source.
+#
+#   bench/large.sh [path/to/kinnie]
+
+kinnie=${1:-./kinnie}
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+for size in 10000 1000000; do
+    "$(dirname "$0")/gen_large.sh" "$size" > "$dir/large_$size.kn"
+
+    for mode in "" --walk; do
+        start=$(date +%s%N)
+        "$kinnie" --no-cache $mode "$dir/large_$size.kn" > /dev/null || exit 1
+        end=$(date +%s%N)
+        printf '%-8s tokens=%-8s %6d ms\n' "${mode:-vm}" "$size" $(( (end - start) / 1000000 ))
+    done
+done
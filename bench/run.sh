@@ -0,0 +1,57 @@
+#!/bin/sh
+# Runs each bench/*.kn program, plus a generated source of about 1M tokens,
+# RUNS times in both execution modes and prints one CSV row per program and
+# mode to stdout:
+#
+#   program,mode,runs,median_ms,tokens,statements,tokens_per_sec,statements_per_sec
+#
+#   bench/run.sh [path/to/kinnie] [runs]
+#
+# Token and statement counts come from a separate --stats run, so the timed
+# runs are not slowed down by statement counting. All runs pass --no-cache,
+# so the times include loading the source.
+
+kinnie=${1:-./kinnie}
+runs=${2:-5}
+bench=$(dirname "$0")
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+"$bench/gen_large.sh" 1000000 > "$dir/large.kn"
+
+echo "program,mode,runs,median_ms,tokens,statements,tokens_per_sec,statements_per_sec"
+
+for program in "$bench"/*.kn "$dir/large.kn"; do
+    name=$(basename "$program" .kn)
+
+    for mode in vm walk; do
+        flag=--no-cache
+        [ "$mode" = walk ] && flag="--no-cache --walk"
+
+        stats=$("$kinnie" $flag --stats "$program" 2>&1 > /dev/null | tail -n 1)
+        case "$stats" in
+            tokens=*) ;;
+            *) echo "$name ($mode) failed: $stats" >&2; exit 1 ;;
+        esac
+
+        : > "$dir/times"
+        n=0
+        while [ "$n" -lt "$runs" ]; do
+            start=$(date +%s%N)
+            "$kinnie" $flag "$program" > /dev/null || exit 1
+            end=$(date +%s%N)
+            echo $((end - start)) >> "$dir/times"
+            n=$((n + 1))
+        done
+
+        sort -n "$dir/times" | awk -v name="$name" -v mode="$mode" -v runs="$runs" -v stats="$stats" '
+            { t[NR] = $1 }
+            END {
+                split(stats, kv, /[ =]/)
+                median = (NR % 2) ? t[(NR + 1) / 2] : (t[NR / 2] + t[NR / 2 + 1]) / 2
+                seconds = median / 1e9
+                printf "%s,%s,%d,%.3f,%d,%d,%.0f,%.0f\n", name, mode, runs, median / 1e6,
+                       kv[2], kv[4], kv[2] / seconds, kv[4] / seconds
+            }'
+    done
+done
@@ -1,15 +1,81 @@
 #include <stdio.h>
+#include <stddef.h>
 #include <stdlib.h>
+#include <limits.h>
 #include <string.h>
 #include <ctype.h>
+#include <math.h>
+#include <time.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <setjmp.h>
+#include "kinnie.h"
+#ifdef _WIN32
+#include <io.h>
+#include <process.h>
+#define isatty _isatty
+#define fileno _fileno
+#else
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <signal.h>
+#include <pthread.h>
+#define KINNIE_THREADS
+/* macOS names the nanosecond modification time differently. */
+#ifdef __APPLE__
+#define st_mtim st_mtimespec
+#endif
+#endif
+
+#if defined(__x86_64__) && defined(__linux__)
+#define KINNIE_JIT
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define KINNIE_SSE2
+#endif
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define KINNIE_AVX
+#endif
 
-#define MAX_TOKENS 256
-#define MAX_VARS   64
-#define MAX_FUNCTIONS 32
-#define MAX_SCOPE_DEPTH 16
-#define MAX_NAME_LEN 32
-#define MAX_STRING_LEN 128
 #define MAX_FUNC_PARAMS 8
+#define MAX_CALL_DEPTH 4096
+#define VM_CALL_DEPTH 1000000
+#define JIT_MAX_DEPTH 1024
+#define ARENA_BLOCK_SIZE 65536
+#define OUT_BUFFER_SIZE 65536
+#define SEGMENT_TEXT -1
+#define SEGMENT_UNKNOWN -2
+#define JIT_CALL_THRESHOLD 2
+#define JIT_LOOP_THRESHOLD 1000
+#define PREP_CHUNKS 256
+#define MAX_REDUCTIONS 8
+#define MEMO_SIZE 4096
+#define FAIL_MESSAGE_SIZE 256
+#define KNC_VERSION 4
+#define FRAME_MAX 0x40000000u
+#define ARRAY_ALIGN 64
+#define ARRAY_LANES 8
+#define MAP_GROUP 16
+#define MAP_EMPTY 0x80
+#define MAP_DELETED 0xFE
+#define MAP_MOVES 32
+#define VALUE_TAG_MASK 0xFFFF000000000000ULL
+#define VALUE_INT_TAG 0xFFF9000000000000ULL
+#define VALUE_STRING_TAG 0xFFFA000000000000ULL
+#define VALUE_ARRAY_TAG 0xFFFB000000000000ULL
+#define VALUE_MAP_TAG 0xFFFC000000000000ULL
+#define VALUE_PAYLOAD 0x0000FFFFFFFFFFFFULL
+#define VALUE_INT_MIN (-(1LL << 47))
+#define VALUE_INT_MAX ((1LL << 47) - 1)
 
 typedef enum {
     TOK_VAR,
@@ -17,6 +83,7 @@ typedef enum {
     TOK_PRINTL,
     TOK_IDENT,
     TOK_NUMBER,
+    TOK_INTEGER,
     TOK_STRING,
     TOK_ASSIGN,
     TOK_MORE,
@@ -42,880 +109,7177 @@ typedef enum {
     TOK_RBRACKET,
     TOK_COMMA,
     TOK_RETURN,
+    TOK_PREP_START,
+    TOK_PURE,
+    TOK_LSQUARE,
+    TOK_RSQUARE,
     TOK_UNKNOWN
 } TokenType;
 
 typedef enum {
-    VAR_DOUBLE,
-    VAR_STRING
-} VarType;
+    FLUSH_LINE,
+    FLUSH_FULL,
+    FLUSH_EXIT
+} FlushPolicy;
+
+/*
+ * Messages between --connect and --serve are frames: a kind byte, the
+ * length of the data as 4 bytes in host order, then the data. A request is
+ * a FRAME_DIRECTORY frame with the client's working directory, one
+ * FRAME_ARGUMENT frame per command line argument and an empty FRAME_RUN
+ * frame. The reply is the run's output as FRAME_STDOUT and FRAME_STDERR
+ * frames, then a FRAME_EXIT frame with the exit status in decimal.
+ */
+enum {
+    FRAME_DIRECTORY = 'd',
+    FRAME_ARGUMENT = 'a',
+    FRAME_RUN = 'r',
+    FRAME_STDOUT = 'o',
+    FRAME_STDERR = 'e',
+    FRAME_EXIT = 'x'
+};
 
+/*
+ * Identifiers carry their interned symbol, string literals an offset into
+ * string_pool and numbers their value, parsed once by tokenize. Number
+ * literals are TOK_INTEGER unless they do not fit in 64 bits, in which case
+ * they are a TOK_NUMBER double.
+ *
+ * jump is filled in by match_blocks: for '{' it is the distance to the
+ * matching '}', for 'if' the distance to its 'else' (0 when there is none),
+ * and for 'rep' it is 1 when the body never assigns the loop counter, so
+ * the counter can only ever step from 0 to the goal. Offsets are relative
+ * so they stay valid in the function body views made by parse_functions.
+ */
 typedef struct {
     TokenType type;
-    char text[MAX_STRING_LEN];
+    int jump;
+    union {
+        int symbol;
+        size_t string;
+        double number;
+        long long integer;
+    };
 } Token;
 
+/*
+ * A value is one NaN-boxed 64-bit word. A double is stored as itself; its
+ * NaNs are canonicalised, so no double has a tag in its top 16 bits.
+ * Integers are 48-bit and tagged VALUE_INT_TAG; results and literals outside
+ * that range become doubles, and so are rounded beyond 2^53. Strings are immutable and length-prefixed in string_pool,
+ * which lives as long as the program, so a string value is its offset
+ * there tagged VALUE_STRING_TAG and copying one is copying the word. An
+ * array value is a pointer to an Array tagged VALUE_ARRAY_TAG, and a map
+ * value a pointer to a Map tagged VALUE_MAP_TAG; copies share them.
+ */
+typedef unsigned long long Value;
+
+/* A variable of the token walker. Bytecode frames hold bare Values. */
 typedef struct {
-    char name[MAX_NAME_LEN];
-    VarType var_type;
-    union {
-        double double_value;
-        char string_value[MAX_STRING_LEN];
-    };
+    int name;
+    Value value;
 } Variable;
 
+/* A walker scope owns walker_vars[start, start + var_count). */
 typedef struct {
-    Variable vars[MAX_VARS];
+    size_t start;
     size_t var_count;
     int is_function_boundary;
 } Scope;
 
+/*
+ * Bump allocator for data that lives as long as the program: functions and
+ * their compiled code. Blocks are chained and never move, so pointers into
+ * an arena stay valid.
+ */
+typedef struct ArenaBlock {
+    struct ArenaBlock *next;
+    size_t used;
+    size_t size;
+    char data[];
+} ArenaBlock;
+
+typedef struct {
+    ArenaBlock *head;
+} Arena;
+
+typedef enum {
+    OP_PUSH_NUM,
+    OP_PUSH_STR,
+    OP_LOAD,
+    OP_LOAD_VALUE,
+    OP_INDEX,
+    OP_INDEX_VALUE,
+    OP_STORE_NUM,
+    OP_STORE_STR,
+    OP_STORE_RESULT,
+    OP_STORE_INDEX,
+    OP_PUSH_RESULT,
+    OP_PUSH_VALUE,
+    OP_UNKNOWN_VAR,
+    OP_UNKNOWN_COUNTER,
+    OP_ADD,
+    OP_SUB,
+    OP_MUL,
+    OP_DIV,
+    OP_MOD,
+    OP_EQUALS,
+    OP_NOT_EQUALS,
+    OP_MORE,
+    OP_LESS,
+    OP_MORE_EQUALS,
+    OP_LESS_EQUALS,
+    OP_NEGATE,
+    OP_JUMP,
+    OP_JUMP_IF_FALSE,
+    OP_REP_INIT,
+    OP_REP_TEST,
+    OP_REP_NEXT,
+    OP_REP_LOOP,
+    OP_PREP,
+    OP_PREP_END,
+    OP_POP,
+    OP_COUNT_STATEMENT,
+    OP_PROFILE_ENTER,
+    OP_PROFILE_ITERATION,
+    OP_PROFILE_LEAVE,
+    OP_CALL,
+    OP_TAIL_CALL,
+    OP_BUILTIN,
+    OP_PRINT_STR,
+    OP_PRINT_VAR,
+    OP_PRINT_NUM,
+    OP_RETURN_NUM,
+    OP_RETURN_STR,
+    OP_RETURN_RESULT,
+    OP_RETURN
+} OpCode;
+
+/*
+ * A piece of an 'out' string literal, split up by compile_interpolation.
+ * slot is a frame slot, SEGMENT_TEXT for literal text with escapes already
+ * decoded, or SEGMENT_UNKNOWN for a name that is not in scope. text and
+ * length locate the literal text, or the name, in string_pool.
+ */
+typedef struct {
+    int slot;
+    size_t text;
+    size_t length;
+} Segment;
+
+/*
+ * One bytecode instruction. Variables are referenced by frame slot, names
+ * and string literals by their index in the owning function's token array,
+ * numbers by their index in its constant table, calls by their index in its
+ * call site table and jumps by instruction index.
+ */
 typedef struct {
-    char name[MAX_NAME_LEN];
-    Token tokens[MAX_TOKENS];
+    OpCode op;
+    int a;
+    int b;
+} Instr;
+
+/*
+ * A call instruction's operand. link_call_sites points target at the
+ * callee when one exists that takes that many arguments, so calls go
+ * straight to it; otherwise target stays NULL and the call reports the
+ * error when it runs.
+ */
+typedef struct Function Function;
+
+typedef struct {
+    int name;
+    Function *target;
+} CallSite;
+
+typedef enum {
+    REDUCE_SUM,
+    REDUCE_MIN,
+    REDUCE_MAX,
+    REDUCE_COUNT
+} ReduceKind;
+
+/*
+ * A variable named in a prep header, as in 'prep n sum total'. slot is
+ * where the variable lives in the values each chunk starts from: a frame
+ * slot in bytecode, an index into the copied variables in the walker.
+ */
+typedef struct {
+    ReduceKind kind;
+    int name;
+    int slot;
+} Reduction;
+
+/*
+ * The operand of OP_PREP, whose body follows it up to an OP_PREP_END.
+ * counter is the counter's frame slot and name its token index.
+ */
+typedef struct {
+    int counter;
+    int name;
+    Reduction reductions[MAX_REDUCTIONS];
+    int reduction_count;
+} PrepLoop;
+
+/*
+ * tokens is a view of the function body inside the program's token array.
+ * code, constants, segments, call_sites and preps are allocated from the
+ * program's arena once the function has been compiled. The jit_ fields
+ * belong to --jit: jit_state is 0 until a compile is attempted, then 1 if
+ * jit_code holds the native version and -1 if the function stays
+ * interpreted.
+ * A function declared 'pure fun' has pure set and owns memo table number
+ * memo; memo_hits and memo_misses total its lookups for --stats.
+ */
+struct Function {
+    int name;
+    Token *tokens;
     size_t token_count;
-    char param_names[MAX_FUNC_PARAMS][MAX_NAME_LEN];
+    int param_names[MAX_FUNC_PARAMS];
     size_t param_count;
-} Function;
+    Instr *code;
+    size_t code_count;
+    Value *constants;
+    size_t constant_count;
+    Segment *segments;
+    size_t segment_count;
+    CallSite *call_sites;
+    size_t call_site_count;
+    PrepLoop *preps;
+    size_t prep_count;
+    size_t max_stack;
+    size_t slot_count;
+    int pure;
+    size_t memo;
+    size_t memo_hits;
+    size_t memo_misses;
+    size_t jit_calls;
+    size_t jit_loops;
+    int jit_state;
+    void *jit_code;
+    unsigned int *jit_offsets;
+};
+
+/* One pure function's memo table, on one thread; see memo_entry. */
+typedef struct {
+    Value *entries;
+    size_t hits;
+    size_t misses;
+} MemoTable;
 
-Function functions[MAX_FUNCTIONS];
-size_t function_count = 0;
+/*
+ * Everything loaded from one program: its strings, symbols, functions and
+ * tokens, with the source line of each token. A process can hold several
+ * programs, one per kinnie_ctx, and program is the one this thread runs.
+ * memo_tables holds memo_slots sets of memo_count tables, one set for each
+ * thread that can run a pure function of the program: the thread that
+ * runs it and every prep worker.
+ */
+typedef struct {
+    Arena arena;
+    char *string_pool;
+    size_t string_pool_size;
+    size_t string_pool_capacity;
+    size_t *symbol_names;
+    size_t symbol_count;
+    size_t symbol_capacity;
+    int *symbol_table;
+    size_t symbol_table_size;
+    Function **functions;
+    size_t function_count;
+    size_t function_capacity;
+    /* Functions indexed by the symbol of their name. */
+    Function **function_table;
+    size_t function_table_size;
+    Token *tokens;
+    size_t token_count;
+    int *token_lines;
+    int line_count;
+    /* A .knc image that tokens and token_lines point into, if loaded from one. */
+    const char *image;
+    size_t image_size;
+    size_t memo_count;
+    MemoTable **memo_tables;
+    size_t memo_slots;
+} Program;
 
-Scope scope_stack[MAX_SCOPE_DEPTH];
-size_t scope_depth = 0;
+_Thread_local Program *program = NULL;
 
-Variable return_value;
-int has_return_value = 0;
+/*
+ * Everything a running program changes is thread-local, so the workers of
+ * a prep loop, and programs run on different threads, each have their own
+ * output buffer, scopes, VM stacks and return value. A thread's output
+ * buffer is allocated on its first write.
+ */
+_Thread_local char *out_buffer = NULL;
+_Thread_local size_t out_length = 0;
+_Thread_local size_t out_capacity = 0;
+_Thread_local int out_newline = 0;
+_Thread_local FlushPolicy flush_policy = FLUSH_FULL;
 
-void push_scope(int is_function) {
-    if (scope_depth >= MAX_SCOPE_DEPTH) {
-        fprintf(stderr, "Scope depth exceeded\n");
-        exit(1);
+/*
+ * The --serve connection this thread's output goes to instead of stdout, or
+ * -1. out_client_gone is set once writing to it has failed.
+ */
+_Thread_local int out_client = -1;
+_Thread_local int out_client_gone = 0;
+
+_Thread_local Scope *scope_stack = NULL;
+_Thread_local size_t scope_depth = 0;
+_Thread_local size_t scope_capacity = 0;
+
+_Thread_local Variable *walker_vars = NULL;
+_Thread_local size_t walker_var_count = 0;
+_Thread_local size_t walker_var_capacity = 0;
+
+/*
+ * The token walker recurses in C for every call, so it stops at
+ * MAX_CALL_DEPTH. Bytecode calls only take heap memory, up to
+ * max_call_depth, which --max-depth sets.
+ */
+_Thread_local size_t call_depth = 0;
+size_t max_call_depth = VM_CALL_DEPTH;
+
+_Thread_local Value return_value;
+_Thread_local int has_return_value = 0;
+_Thread_local int is_returning = 0;
+
+int use_token_walker = 0;
+/* Native code is compiled against the main thread's state, so only it runs any. */
+_Thread_local int use_jit = 0;
+/* Native code calls recurse in C, so past JIT_MAX_DEPTH of them calls stay in the interpreter. */
+_Thread_local size_t jit_depth = 0;
+int dump_optimized = 0;
+int jit_check = 0;
+size_t jit_call_threshold = JIT_CALL_THRESHOLD;
+size_t jit_loop_threshold = JIT_LOOP_THRESHOLD;
+
+/*
+ * Statements executed so far, reported by --stats. The compiler only emits
+ * OP_COUNT_STATEMENT when count_statements is set, so bytecode pays nothing
+ * for it otherwise. --profile sets it too, to count line hits.
+ */
+_Thread_local size_t statement_count = 0;
+int count_statements = 0;
+int show_stats = 0;
+
+/*
+ * --profile state. Every function and rep block that runs gets a
+ * ProfileEntry holding its totals. ProfileNodes form the call tree, one
+ * node per distinct stack, which is what the collapsed-stack output needs.
+ * ProfileFrames are the activations currently running; frame 0 is the root.
+ * Times are in nanoseconds.
+ */
+typedef enum {
+    PROFILE_FUNCTION,
+    PROFILE_REP
+} ProfileKind;
+
+typedef struct {
+    ProfileKind kind;
+    int key;
+    int owner;
+    size_t count;
+    size_t iterations;
+    long long inclusive;
+    long long exclusive;
+    size_t active;
+} ProfileEntry;
+
+typedef struct {
+    int entry;
+    int first_child;
+    int next_sibling;
+    long long exclusive;
+} ProfileNode;
+
+typedef struct {
+    int node;
+    long long start;
+    long long children;
+} ProfileFrame;
+
+int profiling = 0;
+const char *profile_stacks_path = "kinnie.folded";
+
+ProfileEntry *profile_entries = NULL;
+size_t profile_entry_count = 0;
+size_t profile_entry_capacity = 0;
+
+ProfileNode *profile_nodes = NULL;
+size_t profile_node_count = 0;
+size_t profile_node_capacity = 0;
+
+ProfileFrame *profile_stack = NULL;
+size_t profile_depth = 0;
+size_t profile_stack_capacity = 0;
+
+size_t *line_hits = NULL;
+long long profile_left_at = 0;
+
+_Thread_local Value *vm_stack = NULL;
+_Thread_local size_t vm_sp = 0;
+_Thread_local size_t vm_stack_capacity = 0;
+
+_Thread_local Value *vm_frames = NULL;
+_Thread_local size_t vm_frame_top = 0;
+_Thread_local size_t vm_frame_capacity = 0;
+
+/*
+ * One activation on the VM's call stack. Calls between bytecode functions
+ * push a CallFrame instead of recursing in C, and a tail call reuses the
+ * caller's. pc is where the caller resumes. memo is nonzero for a call to a
+ * pure function, whose result goes to the memo table once it returns: it
+ * is one past the call's entry in memo_calls.
+ */
+typedef struct {
+    Function *func;
+    size_t pc;
+    size_t base_sp;
+    size_t base_frame;
+    size_t profile_mark;
+    size_t memo;
+} CallFrame;
+
+_Thread_local CallFrame *vm_calls = NULL;
+_Thread_local size_t vm_call_top = 0;
+_Thread_local size_t vm_call_capacity = 0;
+
+/* A running call to a pure function and the arguments it was called with. */
+typedef struct {
+    Function *func;
+    Value args[MAX_FUNC_PARAMS];
+} MemoCall;
+
+_Thread_local MemoCall *memo_calls = NULL;
+_Thread_local size_t memo_call_top = 0;
+_Thread_local size_t memo_call_capacity = 0;
+
+/*
+ * A tail call made by the walker or by native code, waiting for its
+ * caller's frame to be released.
+ */
+_Thread_local Function *tail_function = NULL;
+_Thread_local Value tail_args[MAX_FUNC_PARAMS];
+
+/*
+ * Errors end the program with a message on stderr, except during a call
+ * through the C API: that call sets fail_target, and the message is kept
+ * in fail_message for it to return instead.
+ */
+_Thread_local jmp_buf *fail_target = NULL;
+_Thread_local char fail_message[FAIL_MESSAGE_SIZE];
+
+_Noreturn void fail(const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+
+    if (fail_target) {
+        vsnprintf(fail_message, sizeof(fail_message), format, args);
+        va_end(args);
+        fail_message[strcspn(fail_message, "\n")] = '\0';
+        longjmp(*fail_target, 1);
     }
-    scope_stack[scope_depth].var_count = 0;
-    scope_stack[scope_depth].is_function_boundary = is_function;
-    scope_depth++;
+
+    vfprintf(stderr, format, args);
+    va_end(args);
+    exit(1);
 }
 
-void pop_scope() {
-    if (scope_depth == 0) {
-        fprintf(stderr, "Scope underflow\n");
-        exit(1);
+/* Fails with what and the reason errno gives, as perror would print them. */
+_Noreturn void fail_errno(const char *what) {
+    fail("%s: %s\n", what, strerror(errno));
+}
+
+/*
+ * Makes room for at least needed items, doubling the capacity so that
+ * filling an array one item at a time stays linear overall.
+ */
+void *grow_array(void *items, size_t *capacity, size_t needed, size_t item_size) {
+    if (needed <= *capacity) return items;
+
+    size_t grown = *capacity ? *capacity : 16;
+    while (grown < needed) grown *= 2;
+
+    items = realloc(items, grown * item_size);
+    if (!items) {
+        fail_errno("realloc");
     }
-    scope_depth--;
+    *capacity = grown;
+    return items;
 }
 
-Variable *get_var(const char *name) {
-    for (int i = scope_depth - 1; i >= 0; i--) {
-        for (size_t j = 0; j < scope_stack[i].var_count; j++) {
-            if (strcmp(scope_stack[i].vars[j].name, name) == 0)
-                return &scope_stack[i].vars[j];
+void *arena_alloc(Arena *arena, size_t size) {
+    size = (size + 15) & ~(size_t)15;
+
+    if (!arena->head || arena->head->used + size > arena->head->size) {
+        size_t block_size = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+        ArenaBlock *block = malloc(sizeof(ArenaBlock) + block_size);
+        if (!block) {
+            fail_errno("malloc");
         }
+        block->next = arena->head;
+        block->used = 0;
+        block->size = block_size;
+        arena->head = block;
+    }
 
-        if (scope_stack[i].is_function_boundary) break;
+    void *memory = arena->head->data + arena->head->used;
+    arena->head->used += size;
+    return memory;
+}
+
+void *arena_copy(Arena *arena, const void *data, size_t size) {
+    void *memory = arena_alloc(arena, size ? size : 1);
+    if (size) memcpy(memory, data, size);
+    return memory;
+}
+
+void arena_free(Arena *arena) {
+    while (arena->head) {
+        ArenaBlock *next = arena->head->next;
+        free(arena->head);
+        arena->head = next;
     }
-    return NULL;
 }
 
-void set_var_double(const char *name, double value) {
-    Variable *v = get_var(name);
-    if (v) {
-        v->var_type = VAR_DOUBLE;
-        v->double_value = value;
-        return;
+/*
+ * Adds a NUL-terminated copy of str to string_pool, preceded by its length,
+ * and returns the offset of the text.
+ */
+size_t pool_string(const char *str, size_t len) {
+    program->string_pool = grow_array(program->string_pool, &program->string_pool_capacity,
+                             program->string_pool_size + sizeof(size_t) + len + 1, 1);
+
+    memcpy(program->string_pool + program->string_pool_size, &len, sizeof(size_t));
+    size_t offset = program->string_pool_size + sizeof(size_t);
+    memcpy(program->string_pool + offset, str, len);
+    program->string_pool[offset + len] = 0;
+    program->string_pool_size = offset + len + 1;
+    return offset;
+}
+
+const char *pool_text(size_t offset) {
+    return program->string_pool + offset;
+}
+
+size_t pool_length(size_t offset) {
+    size_t len;
+    memcpy(&len, program->string_pool + offset - sizeof(size_t), sizeof(size_t));
+    return len;
+}
+
+const char *symbol_name(int symbol) {
+    return program->string_pool + program->symbol_names[symbol];
+}
+
+size_t hash_name(const char *str, size_t len) {
+    size_t hash = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        hash = (hash ^ (unsigned char)str[i]) * 16777619u;
     }
-    
-    Scope *current = &scope_stack[scope_depth - 1];
-    strncpy(current->vars[current->var_count].name, name, MAX_NAME_LEN - 1);
-    current->vars[current->var_count].var_type = VAR_DOUBLE;
-    current->vars[current->var_count].double_value = value;
-    current->var_count++;
+    return hash;
 }
 
-void set_var_string(const char *name, const char *value) {
-    Variable *v = get_var(name);
-    if (v) {
-        v->var_type = VAR_STRING;
-        strncpy(v->string_value, value, MAX_STRING_LEN - 1);
-        v->string_value[MAX_STRING_LEN - 1] = 0;
-        return;
+/*
+ * Returns the table slot holding str, or the empty slot where it belongs.
+ * Entries store symbol + 1 so that a zeroed table is empty.
+ */
+int *symbol_slot(const char *str, size_t len) {
+    size_t at = hash_name(str, len) & (program->symbol_table_size - 1);
+    while (program->symbol_table[at]) {
+        const char *name = symbol_name(program->symbol_table[at] - 1);
+        if (strncmp(name, str, len) == 0 && name[len] == 0)
+            break;
+        at = (at + 1) & (program->symbol_table_size - 1);
     }
-    
-    Scope *current = &scope_stack[scope_depth - 1];
-    strncpy(current->vars[current->var_count].name, name, MAX_NAME_LEN - 1);
-    current->vars[current->var_count].var_type = VAR_STRING;
-    strncpy(current->vars[current->var_count].string_value, value, MAX_STRING_LEN - 1);
-    current->vars[current->var_count].string_value[MAX_STRING_LEN - 1] = 0;
-    current->var_count++;
-}
-
-size_t tokenize(const char *src, Token tokens[]) {
-    size_t i = 0, t = 0;
-    while (src[i]) {
-        if (isspace(src[i])) {
-            i++;
-            continue;
-        }
-        if (src[i] == '"') {
-            i++;
-            size_t start = i;
-            while (src[i] && src[i] != '"') i++;
-
-            size_t len = i - start;
-            strncpy(tokens[t].text, src + start, len);
-            tokens[t].text[len] = 0;
-            tokens[t].type = TOK_STRING;
-            if (src[i] == '"') i++;
-            t++;
-            continue;
-        }
-        if (isdigit(src[i])) {
-            size_t start = i;
-            while (isdigit(src[i])) i++;
+    return &program->symbol_table[at];
+}
 
-            size_t len = i - start;
-            strncpy(tokens[t].text, src + start, len);
-            tokens[t].text[len] = 0;
-            tokens[t].type = TOK_NUMBER;
-            t++;
-            continue;
-        }
-        if (isalpha(src[i])) {
-            size_t start = i;
-            while (isalnum(src[i])) i++;
-
-            size_t len = i - start;
-            strncpy(tokens[t].text, src + start, len);
-            tokens[t].text[len] = 0;
-
-            if (strcmp(tokens[t].text, "var") == 0)
-                tokens[t].type = TOK_VAR;
-            else if (strcmp(tokens[t].text, "ret") == 0)
-                tokens[t].type = TOK_RETURN;
-            else if (strcmp(tokens[t].text, "out") == 0)
-                tokens[t].type = TOK_PRINT;
-            else if (strcmp(tokens[t].text, "rep") == 0)
-                tokens[t].type = TOK_LOOP_START;
-            else if (strcmp(tokens[t].text, "fun") == 0)
-                tokens[t].type = TOK_FUN_START;
-            else if (strcmp(tokens[t].text, "if") == 0)
-                tokens[t].type = TOK_IF_START;
-            else if (strcmp(tokens[t].text, "else") == 0)
-                tokens[t].type = TOK_ELSE;
-            else if (strcmp(tokens[t].text, "end") == 0)
-                tokens[t].type = TOK_END;
-            else
-                tokens[t].type = TOK_IDENT;
+int find_symbol(const char *str, size_t len) {
+    if (!program->symbol_table_size) return -1;
+    return *symbol_slot(str, len) - 1;
+}
 
-            t++;
-            continue;
-        }
-        if (src[i] == '{') {
-            tokens[t++].type = TOK_LBRACE;
-            i++;
-            continue;
-        }
-        if (src[i] == '}') {
-            tokens[t++].type = TOK_RBRACE;
-            i++;
-            continue;
-        }
-        if (src[i] == '(') {
-            tokens[t++].type = TOK_LBRACKET;
-            i++;
-            continue;
-        }
-        if (src[i] == ')') {
-            tokens[t++].type = TOK_RBRACKET;
-            i++;
-            continue;
-        }
-        if (src[i] == ',') {
-            tokens[t++].type = TOK_COMMA;
-            i++;
-            continue;
-        }
-        if (src[i] == '=') {
-            if (src[i + 1] == '=') {
-                tokens[t++].type = TOK_EQUALS;
-                i += 2;
-            } else {
-                tokens[t++].type = TOK_ASSIGN;
-                i++;
-            }
-            continue;
-        }
-        if (src[i] == '!') {
-            if (src[i + 1] == '=') {
-                tokens[t++].type = TOK_NOT_EQUALS;
-                i += 2;
-            } else {
-                tokens[t++].type = TOK_UNKNOWN;
-                i++;
-            }
-            continue;
-        }
-        if (src[i] == '>') {
-            if (src[i + 1] == '=') {
-                tokens[t++].type = TOK_MORE_EQUALS;
-                i += 2;
-            } else {
-                tokens[t++].type = TOK_MORE;
-                i++;
-            }
-            continue;
-        }
-        if (src[i] == '<') {
-            if (src[i + 1] == '=') {
-                tokens[t++].type = TOK_LESS_EQUALS;
-                i += 2;
-            } else {
-                tokens[t++].type = TOK_LESS;
-                i++;
-            }
-            continue;
-        }
-        switch (src[i]) {
-            case '+': tokens[t++].type = TOK_PLUS; break;
-            case '-': tokens[t++].type = TOK_MINUS; break;
-            case '*': tokens[t++].type = TOK_MUL; break;
-            case '/': tokens[t++].type = TOK_DIV; break;
-            case '%': tokens[t++].type = TOK_MOD; break;
-            default:  tokens[t++].type = TOK_UNKNOWN; break;
+/* Keeps the symbol table at most half full, rehashing into double the size. */
+void grow_symbol_table(void) {
+    if ((program->symbol_count + 1) * 2 <= program->symbol_table_size) return;
+
+    free(program->symbol_table);
+    program->symbol_table_size = program->symbol_table_size ? program->symbol_table_size * 2 : 256;
+    program->symbol_table = calloc(program->symbol_table_size, sizeof(int));
+    if (!program->symbol_table) {
+        fail_errno("calloc");
+    }
+
+    for (size_t i = 0; i < program->symbol_count; i++) {
+        const char *name = symbol_name(i);
+        *symbol_slot(name, strlen(name)) = i + 1;
+    }
+}
+
+int intern(const char *str, size_t len) {
+    grow_symbol_table();
+
+    int *slot = symbol_slot(str, len);
+    if (*slot) return *slot - 1;
+
+    program->symbol_names = grow_array(program->symbol_names, &program->symbol_capacity, program->symbol_count + 1, sizeof(size_t));
+    program->symbol_names[program->symbol_count] = pool_string(str, len);
+    *slot = ++program->symbol_count;
+    return *slot - 1;
+}
+
+Value make_double(double number) {
+    Value v;
+    memcpy(&v, &number, sizeof(v));
+    if (number != number) v = (v & 0x8000000000000000ULL) | 0x7FF8000000000000ULL;
+    return v;
+}
+
+Value make_int(long long number) {
+    if (number < VALUE_INT_MIN || number > VALUE_INT_MAX) return make_double((double)number);
+    return VALUE_INT_TAG | ((Value)number & VALUE_PAYLOAD);
+}
+
+Value make_string(size_t offset) {
+    return VALUE_STRING_TAG | offset;
+}
+
+int is_int(Value v) {
+    return (v & VALUE_TAG_MASK) == VALUE_INT_TAG;
+}
+
+int is_string(Value v) {
+    return (v & VALUE_TAG_MASK) == VALUE_STRING_TAG;
+}
+
+long long int_of(Value v) {
+    return (long long)(v << 16) >> 16;
+}
+
+double double_of(Value v) {
+    double number;
+    memcpy(&number, &v, sizeof(number));
+    return number;
+}
+
+size_t string_of(Value v) {
+    return v & VALUE_PAYLOAD;
+}
+
+/*
+ * A fixed number of doubles, stored contiguously after the header and
+ * aligned to ARRAY_ALIGN for the vector kernels. Values have no garbage
+ * collector, so an array lives until the run that made it ends: the
+ * program, a C API call, a --serve request, or the prep chunk it was made
+ * in, since nothing but numbers leaves a chunk. arrays lists the ones this
+ * thread made, newest first.
+ */
+typedef struct Array {
+    struct Array *next;
+    size_t length;
+    double *data;
+} Array;
+
+_Thread_local Array *arrays = NULL;
+
+Value make_array(Array *array) {
+    return VALUE_ARRAY_TAG | (Value)(size_t)array;
+}
+
+int is_array(Value v) {
+    return (v & VALUE_TAG_MASK) == VALUE_ARRAY_TAG;
+}
+
+Array *array_of(Value v) {
+    return (Array *)(size_t)(v & VALUE_PAYLOAD);
+}
+
+/*
+ * Keys and values, numbers or strings, with the keys in entries in the
+ * order they were added, except that deleting one moves the last entry
+ * into its place, so the i-th key is a plain lookup. index finds the entry
+ * of a key: an open-addressing table of slots in groups of MAP_GROUP, each
+ * slot with a control byte that is MAP_EMPTY, MAP_DELETED or the top seven
+ * bits of the key's hash, so a probe compares a whole group of control
+ * bytes at once and only looks at entries whose bits match. A full index
+ * is not rebuilt in one go: growing is filled MAP_MOVES entries per
+ * change while index still serves lookups. Maps live as long as arrays,
+ * and owner is the prep job that made them, the only one that may change
+ * them; maps lists the ones this thread made, newest first.
+ */
+typedef struct {
+    Value key;
+    Value value;
+    unsigned long long hash;
+} MapEntry;
+
+typedef struct {
+    unsigned char *control;
+    unsigned *entry;
+    size_t capacity;
+    size_t used;
+} MapIndex;
+
+typedef struct Map {
+    struct Map *next;
+    const void *owner;
+    MapEntry *entries;
+    size_t count;
+    size_t entry_capacity;
+    MapIndex index;
+    MapIndex growing;
+    size_t moved;
+} Map;
+
+_Thread_local Map *maps = NULL;
+_Thread_local const void *map_owner = NULL;
+
+Value make_map(Map *map) {
+    return VALUE_MAP_TAG | (Value)(size_t)map;
+}
+
+int is_map(Value v) {
+    return (v & VALUE_TAG_MASK) == VALUE_MAP_TAG;
+}
+
+Map *map_of(Value v) {
+    return (Map *)(size_t)(v & VALUE_PAYLOAD);
+}
+
+/* Integers and doubles; every other kind of value has a tag above VALUE_INT_TAG. */
+int is_number(Value v) {
+    return v < VALUE_STRING_TAG;
+}
+
+#ifdef KINNIE_THREADS
+int send_frame(int fd, int kind, const void *data, size_t length);
+#endif
+
+/* Writes output to stdout, or sends it to the --serve client that asked for it. */
+void out_emit(const char *data, size_t len) {
+#ifdef KINNIE_THREADS
+    if (out_client >= 0) {
+        if (out_client_gone) return;
+        if (!send_frame(out_client, FRAME_STDOUT, data, len)) {
+            out_client_gone = 1;
+            if (fail_target) fail("The client disconnected\n");
         }
-        i++;
+        return;
     }
-    tokens[t].type = TOK_EOF;
-    return t;
+#endif
+    fwrite(data, 1, len, stdout);
 }
 
-Function *get_function(const char *name) {
-    for (size_t i = 0; i < function_count; i++) {
-        if (strcmp(functions[i].name, name) == 0)
-            return &functions[i];
+void out_flush(void) {
+    if (out_length) {
+        out_emit(out_buffer, out_length);
+        out_length = 0;
     }
-    return NULL;
+    if (out_client < 0) fflush(stdout);
+    out_newline = 0;
 }
 
-double parse_value(Token *tok) {
-    if (tok->type == TOK_NUMBER)
-        return atof(tok->text);
-    if (tok->type == TOK_IDENT) {
-        Variable *v = get_var(tok->text);
-        if (!v) {
-            fprintf(stderr, "Unknown variable: %s\n", tok->text);
-            exit(1);
+/*
+ * All program output goes through out_buffer. With FLUSH_EXIT the buffer
+ * grows instead of being written out, so nothing reaches stdout before the
+ * program ends.
+ */
+void out_write(const char *data, size_t len) {
+    if (!out_buffer) {
+        out_buffer = malloc(OUT_BUFFER_SIZE);
+        if (!out_buffer) {
+            fail_errno("malloc");
         }
-        if (v->var_type != VAR_DOUBLE) {
-            fprintf(stderr, "Variable %s is not a number\n", tok->text);
-            exit(1);
+        out_capacity = OUT_BUFFER_SIZE;
+    }
+
+    if (out_length + len > out_capacity) {
+        if (flush_policy != FLUSH_EXIT) {
+            out_flush();
+            if (len > out_capacity) {
+                out_emit(data, len);
+                return;
+            }
+        } else {
+            size_t capacity = out_capacity * 2;
+            while (out_length + len > capacity) capacity *= 2;
+
+            char *grown = malloc(capacity);
+            if (!grown) {
+                fail_errno("malloc");
+            }
+            memcpy(grown, out_buffer, out_length);
+            free(out_buffer);
+            out_buffer = grown;
+            out_capacity = capacity;
         }
-        return v->double_value;
     }
-    fprintf(stderr, "Syntax error\n");
-    exit(1);
+    memcpy(out_buffer + out_length, data, len);
+    out_length += len;
 }
 
-double evaluate_expression(Token tokens[], size_t *idx) {
-    double result = parse_value(&tokens[*idx]);
-    (*idx)++;
+void out_char(char c) {
+    if (out_length == out_capacity) out_write(&c, 1);
+    else out_buffer[out_length++] = c;
+    if (c == '\n') out_newline = 1;
+}
 
-    while (tokens[*idx].type == TOK_PLUS ||
-        tokens[*idx].type == TOK_MINUS ||
-        tokens[*idx].type == TOK_MUL ||
-        tokens[*idx].type == TOK_DIV ||
-        tokens[*idx].type == TOK_MOD) {
+void out_text(const char *data, size_t len) {
+    out_write(data, len);
+    if (!out_newline && memchr(data, '\n', len)) out_newline = 1;
+}
 
-        TokenType op = tokens[*idx].type;
-        (*idx)++;
+/* Integers print like whole doubles do, with a trailing ".0". */
+void out_integer(long long whole) {
+    char digits[32];
+    unsigned long long magnitude = whole < 0 ? -(unsigned long long)whole : (unsigned long long)whole;
+    char *p = digits + sizeof(digits);
 
-        double rhs = parse_value(&tokens[*idx]);
-        (*idx)++;
+    *--p = '0';
+    *--p = '.';
+    do {
+        *--p = '0' + magnitude % 10;
+        magnitude /= 10;
+    } while (magnitude);
+    if (whole < 0) *--p = '-';
 
-        switch (op) {
-            case TOK_PLUS: result += rhs; break; 
-            case TOK_MINUS: result -= rhs; break;
-            case TOK_MUL: result *= rhs; break;
-            case TOK_DIV: result /= rhs; break;
-            case TOK_MOD: result = (double)((int)result % (int)rhs); break;
-            default: break;
-        }
-    }
-    return result;
+    out_write(p, digits + sizeof(digits) - p);
 }
 
-void interpret_tokens(Token tokens[], size_t token_count);
+/*
+ * Same output as printf("%.1lf"), without going through printf for the
+ * common case of whole numbers. The largest doubles have 309 digits before
+ * the point, so digits always has room.
+ */
+void out_number(double value) {
+    char digits[320];
+    int len;
 
-void call_function(const char *name, double *args, size_t arg_count) {
-    Function *func = get_function(name);
-    if (!func) {
-        fprintf(stderr, "Unknown function: %s\n", name);
-        exit(1);
+    if (value > -1e15 && value < 1e15 && value == (double)(long long)value &&
+        (value != 0 || !signbit(value))) {
+        out_integer((long long)value);
+        return;
     }
 
-    if (arg_count != func->param_count) {
-        fprintf(stderr, "The arguments do not match. Expected %zu, got %zu\n", 
-                func->param_count, arg_count);
-        exit(1);
+    len = snprintf(digits, sizeof(digits), "%.1lf", value);
+    out_write(digits, len);
+}
+
+/* An array prints as its elements in brackets, as in [1.0, 2.5]. */
+void out_array(const Array *array) {
+    out_char('[');
+    for (size_t i = 0; i < array->length; i++) {
+        if (i) out_write(", ", 2);
+        out_number(array->data[i]);
     }
+    out_char(']');
+}
 
-    has_return_value = 0;
+void out_map(const Map *map);
 
-    push_scope(1);
-    
-    for (size_t i = 0; i < func->param_count; i++) {
-        set_var_double(func->param_names[i], args[i]);
+void out_value(Value v) {
+    if (is_int(v))
+        out_integer(int_of(v));
+    else if (is_array(v))
+        out_array(array_of(v));
+    else if (is_map(v))
+        out_map(map_of(v));
+    else if (is_string(v))
+        out_text(pool_text(string_of(v)), pool_length(string_of(v)));
+    else
+        out_number(double_of(v));
+}
+
+/* A map prints as its entries in order, as in {apple: 3, 7: 2.5}; a map in a map prints as {...}. */
+void out_map(const Map *map) {
+    out_char('{');
+    for (size_t i = 0; i < map->count; i++) {
+        if (i) out_write(", ", 2);
+        out_value(map->entries[i].key);
+        out_write(": ", 2);
+        if (is_map(map->entries[i].value))
+            out_write("{...}", 5);
+        else
+            out_value(map->entries[i].value);
     }
-    
-    interpret_tokens(func->tokens, func->token_count);
-    pop_scope();
+    out_char('}');
 }
 
-void interpret_tokens(Token tokens[], size_t token_count) {
-    size_t i = 0;
-    while (i < token_count && tokens[i].type != TOK_EOF) {
-        if (tokens[i].type == TOK_VAR) {
-            char name[MAX_NAME_LEN];
-            strcpy(name, tokens[i + 1].text);
-            i += 3;
-            
-            if (tokens[i].type == TOK_IDENT && tokens[i + 1].type == TOK_LBRACKET) {
-                char func_name[MAX_NAME_LEN];
-                strcpy(func_name, tokens[i].text);
-                i += 2;
-                
-                double args[MAX_FUNC_PARAMS];
-                size_t arg_count = 0;
-                
-                while (tokens[i].type != TOK_RBRACKET && tokens[i].type != TOK_EOF) {
-                    args[arg_count++] = evaluate_expression(tokens, &i);
-                    if (tokens[i].type == TOK_COMMA) i++;
-                }
-                
-                if (tokens[i].type != TOK_RBRACKET) {
-                    fprintf(stderr, "Expected ')'\n");
-                    exit(1);
-                }
-                i++;
-                
-                call_function(func_name, args, arg_count);
-                
-                if (has_return_value) {
-                    if (return_value.var_type == VAR_DOUBLE) {
-                        set_var_double(name, return_value.double_value);
-                    } else if (return_value.var_type == VAR_STRING) {
-                        set_var_string(name, return_value.string_value);
-                    }
-                } else {
-                    fprintf(stderr, "Function %s did not return a value\n", func_name);
-                    exit(1);
+/* Called after every 'out' statement to apply the line flush policy. */
+void out_end(void) {
+    if (flush_policy == FLUSH_LINE && out_newline) out_flush();
+}
+
+double number_value(Value v) {
+    return is_int(v) ? (double)int_of(v) : double_of(v);
+}
+
+int is_true(Value v) {
+    return is_int(v) ? int_of(v) != 0 : double_of(v) != 0;
+}
+
+int mul_fits(long long a, long long b) {
+    if (a >= INT_MIN && a <= INT_MAX && b >= INT_MIN && b <= INT_MAX) return 1;
+    if (a > 0) return b > 0 ? a <= LLONG_MAX / b : b >= LLONG_MIN / a;
+    if (b > 0) return a >= LLONG_MIN / b;
+    return a == 0 || b >= LLONG_MAX / a;
+}
+
+/*
+ * '%' works on whole numbers, so a double operand is truncated towards zero
+ * first. Returns 0 for a double outside the 64-bit range, which '%' then
+ * handles as a double.
+ */
+int whole_number(Value v, long long *out) {
+    if (is_int(v)) {
+        *out = int_of(v);
+        return 1;
+    }
+    if (!(fabs(double_of(v)) < 9223372036854775808.0)) return 0;
+    *out = (long long)double_of(v);
+    return 1;
+}
+
+/* Whether '%' with rhs on the right would stop the program. */
+int is_zero_divisor(Value rhs) {
+    long long b;
+    return whole_number(rhs, &b) && b == 0;
+}
+
+/*
+ * Returns lhs op rhs for the arithmetic and comparison opcodes. Two integers
+ * give an integer unless the result does not fit, or a division leaves a
+ * remainder; then, and whenever a double is involved, the result is a
+ * double. Comparisons give integer 0 or 1. The walker, run_bytecode, the
+ * optimizer and the JIT all come here, so every mode agrees.
+ */
+Value arithmetic(OpCode op, Value lhs, Value rhs) {
+    if (is_int(lhs) && is_int(rhs)) {
+        long long a = int_of(lhs);
+        long long b = int_of(rhs);
+
+        switch (op) {
+            case OP_ADD: return make_int(a + b);
+            case OP_SUB: return make_int(a - b);
+            case OP_MUL: if (mul_fits(a, b)) return make_int(a * b); break;
+            case OP_DIV: if (b != 0 && a % b == 0) return make_int(a / b); break;
+            case OP_EQUALS: return make_int(a == b);
+            case OP_NOT_EQUALS: return make_int(a != b);
+            case OP_MORE: return make_int(a > b);
+            case OP_LESS: return make_int(a < b);
+            case OP_MORE_EQUALS: return make_int(a >= b);
+            case OP_LESS_EQUALS: return make_int(a <= b);
+            default: break;
+        }
+    }
+
+    if (op == OP_MOD) {
+        long long a, b;
+        if (is_zero_divisor(rhs)) {
+            fail("Modulo by zero\n");
+        }
+        if (whole_number(lhs, &a) && whole_number(rhs, &b))
+            return make_int(b == -1 ? 0 : a % b);
+        return make_double(fmod(trunc(number_value(lhs)), trunc(number_value(rhs))));
+    }
+
+    double a = number_value(lhs);
+    double b = number_value(rhs);
+    switch (op) {
+        case OP_ADD: return make_double(a + b);
+        case OP_SUB: return make_double(a - b);
+        case OP_MUL: return make_double(a * b);
+        case OP_DIV: return make_double(a / b);
+        case OP_EQUALS: return make_int(a == b);
+        case OP_NOT_EQUALS: return make_int(a != b);
+        case OP_MORE: return make_int(a > b);
+        case OP_LESS: return make_int(a < b);
+        case OP_MORE_EQUALS: return make_int(a >= b);
+        case OP_LESS_EQUALS: return make_int(a <= b);
+        default: return lhs;
+    }
+}
+
+Value negate(Value v) {
+    return is_int(v) ? make_int(-int_of(v)) : make_double(-double_of(v));
+}
+
+void number_error(int name) {
+    fail("Variable %s is not a number\n", symbol_name(name));
+}
+
+/*
+ * The result of a call made inside an expression, named name, which has to
+ * be a number.
+ */
+Value call_result(int name) {
+    if (!has_return_value) {
+        fail("Function %s did not return a value\n", symbol_name(name));
+    }
+    if (!is_number(return_value)) {
+        fail("Function %s did not return a number\n", symbol_name(name));
+    }
+    return return_value;
+}
+
+/* The same for a call that makes up a whole value, whose result can be anything. */
+Value call_value(int name) {
+    if (!has_return_value) {
+        fail("Function %s did not return a value\n", symbol_name(name));
+    }
+    return return_value;
+}
+
+/*
+ * Starts a rep loop on counter: checks that it is a number, resets it to 0
+ * and returns how many times the loop runs, as an integer value fixed
+ * before the body can change the counter.
+ */
+Value rep_start(Value *counter, int name) {
+    long long goal;
+
+    if (!is_number(*counter)) {
+        fail("Loop counter not found or not int: %s\n", symbol_name(name));
+    }
+    if (is_int(*counter))
+        goal = int_of(*counter) > 0 ? int_of(*counter) : 0;
+    else if (!(double_of(*counter) > 0))
+        goal = 0;
+    else
+        goal = double_of(*counter) < (double)VALUE_INT_MAX ? (long long)double_of(*counter) : VALUE_INT_MAX;
+
+    *counter = make_int(0);
+    return make_int(goal);
+}
+
+/* The body may have assigned the counter anything; anything but a number ends the loop. */
+int rep_continues(Value counter, Value goal) {
+    if (is_int(counter)) return int_of(counter) < int_of(goal);
+    if (!is_number(counter)) return 0;
+    return double_of(counter) < (double)int_of(goal);
+}
+
+void rep_step(Value *counter) {
+    if (is_int(*counter))
+        *counter = make_int(int_of(*counter) + 1);
+    else if (is_number(*counter))
+        *counter = make_double(double_of(*counter) + 1);
+}
+
+/*
+ * Whether v is a whole number small enough to count elements with, and if
+ * so, what it is. Doubles qualify when they have no fractional part.
+ */
+int whole_count(Value v, long long *out) {
+    if (is_int(v)) {
+        *out = int_of(v);
+        return 1;
+    }
+    double d = double_of(v);
+    if (!(fabs(d) < 9007199254740992.0) || d != trunc(d)) return 0;
+    *out = (long long)d;
+    return 1;
+}
+
+/* A new array of length zeroed elements, added to this thread's arrays. */
+Array *new_array(size_t length) {
+    if (length > ((size_t)-1 - sizeof(Array) - ARRAY_ALIGN) / sizeof(double)) {
+        fail("Array too large\n");
+    }
+
+    Array *array = calloc(1, sizeof(Array) + ARRAY_ALIGN + length * sizeof(double));
+    if (!array) {
+        fail_errno("calloc");
+    }
+    if ((size_t)array > VALUE_PAYLOAD) {
+        free(array);
+        fail("Array address does not fit in a value\n");
+    }
+
+    array->data = (double *)(((size_t)(array + 1) + ARRAY_ALIGN - 1) & ~(size_t)(ARRAY_ALIGN - 1));
+    array->length = length;
+    array->next = arrays;
+    arrays = array;
+    return array;
+}
+
+/* Frees the arrays this thread made since keep was the newest. */
+void free_arrays(Array *keep) {
+    while (arrays != keep) {
+        Array *next = arrays->next;
+        free(arrays);
+        arrays = next;
+    }
+}
+
+unsigned long long hash_source(const char *data, size_t size);
+
+/* Spreads every bit of h over the whole word; probes use both the low and the top bits. */
+unsigned long long mix_hash(unsigned long long h) {
+    h ^= h >> 33;
+    h *= 0xFF51AFD7ED558CCDULL;
+    h ^= h >> 33;
+    h *= 0xC4CEB9FE1A85EC53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+/*
+ * The form key is stored in, with its hash. Whole numbers become integers,
+ * so 2 and 4 / 2 are the same key, and strings are compared by their text.
+ */
+Value map_key(Value key, unsigned long long *hash) {
+    if (is_string(key)) {
+        *hash = mix_hash(hash_source(pool_text(string_of(key)), pool_length(string_of(key))));
+        return key;
+    }
+    if (!is_number(key)) {
+        fail("Map keys have to be numbers or strings\n");
+    }
+    double d = number_value(key);
+    if (d != d) {
+        fail("A map key cannot be NaN\n");
+    }
+    if (fabs(d) <= (double)VALUE_INT_MAX && d == trunc(d)) key = make_int((long long)d);
+    *hash = mix_hash(key);
+    return key;
+}
+
+int same_key(Value a, Value b) {
+    if (a == b) return 1;
+    if (!is_string(a) || !is_string(b)) return 0;
+    size_t length = pool_length(string_of(a));
+    return length == pool_length(string_of(b)) &&
+           memcmp(pool_text(string_of(a)), pool_text(string_of(b)), length) == 0;
+}
+
+/* Bit i is set for each byte of group[0, MAP_GROUP) that equals byte. */
+unsigned group_match(const unsigned char *group, unsigned char byte) {
+#ifdef KINNIE_SSE2
+    __m128i bytes = _mm_loadu_si128((const __m128i *)group);
+    return (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(bytes, _mm_set1_epi8((char)byte)));
+#else
+    unsigned bits = 0;
+    for (int i = 0; i < MAP_GROUP; i++) bits |= (unsigned)(group[i] == byte) << i;
+    return bits;
+#endif
+}
+
+/* Bit i is set for each slot of the group that is empty or deleted, the control bytes with their top bit set. */
+unsigned group_free(const unsigned char *group) {
+#ifdef KINNIE_SSE2
+    return (unsigned)_mm_movemask_epi8(_mm_loadu_si128((const __m128i *)group));
+#else
+    unsigned bits = 0;
+    for (int i = 0; i < MAP_GROUP; i++) bits |= (unsigned)(group[i] >> 7) << i;
+    return bits;
+#endif
+}
+
+int lowest_bit(unsigned bits) {
+#ifdef __GNUC__
+    return __builtin_ctz(bits);
+#else
+    int i = 0;
+    while (!(bits & 1)) {
+        bits >>= 1;
+        i++;
+    }
+    return i;
+#endif
+}
+
+void index_init(MapIndex *index, size_t capacity) {
+    index->control = malloc(capacity);
+    index->entry = malloc(capacity * sizeof(unsigned));
+    if (!index->control || !index->entry) {
+        fail_errno("malloc");
+    }
+    memset(index->control, MAP_EMPTY, capacity);
+    index->capacity = capacity;
+    index->used = 0;
+}
+
+/*
+ * The slot of index holding key, or -1. Groups are probed in triangular
+ * steps, which visit every group of a power-of-two table, and the first
+ * group with an empty slot ends the search.
+ */
+long index_find(const Map *map, const MapIndex *index, Value key, unsigned long long hash) {
+    size_t mask = index->capacity / MAP_GROUP - 1;
+    size_t group = hash & mask;
+
+    for (size_t step = 1;; step++) {
+        const unsigned char *control = index->control + group * MAP_GROUP;
+        for (unsigned bits = group_match(control, hash >> 57); bits; bits &= bits - 1) {
+            size_t slot = group * MAP_GROUP + lowest_bit(bits);
+            const MapEntry *entry = &map->entries[index->entry[slot]];
+            if (entry->hash == hash && same_key(entry->key, key)) return (long)slot;
+        }
+        if (group_match(control, MAP_EMPTY)) return -1;
+        group = (group + step) & mask;
+    }
+}
+
+/* Puts entries[entry] in the first free slot along its probe sequence; its key is not in index yet. */
+void index_place(MapIndex *index, unsigned long long hash, size_t entry) {
+    size_t mask = index->capacity / MAP_GROUP - 1;
+    size_t group = hash & mask;
+
+    for (size_t step = 1;; step++) {
+        unsigned bits = group_free(index->control + group * MAP_GROUP);
+        if (bits) {
+            size_t slot = group * MAP_GROUP + lowest_bit(bits);
+            if (index->control[slot] == MAP_EMPTY) index->used++;
+            index->control[slot] = (unsigned char)(hash >> 57);
+            index->entry[slot] = (unsigned)entry;
+            return;
+        }
+        group = (group + step) & mask;
+    }
+}
+
+/* Points the slot of entries[entry]'s key at it, adding one if index has none. */
+void index_set(const Map *map, MapIndex *index, size_t entry) {
+    const MapEntry *e = &map->entries[entry];
+    long slot = index_find(map, index, e->key, e->hash);
+    if (slot >= 0)
+        index->entry[slot] = (unsigned)entry;
+    else
+        index_place(index, e->hash, entry);
+}
+
+/*
+ * Removes key from index. A probe stops at a group with an empty slot, so
+ * none ever went past this one if it has one, and the slot can be empty
+ * again rather than deleted.
+ */
+void index_remove(const Map *map, MapIndex *index, Value key, unsigned long long hash) {
+    long slot = index_find(map, index, key, hash);
+    if (slot < 0) return;
+    if (group_match(index->control + slot / MAP_GROUP * MAP_GROUP, MAP_EMPTY)) {
+        index->control[slot] = MAP_EMPTY;
+        index->used--;
+    } else {
+        index->control[slot] = MAP_DELETED;
+    }
+}
+
+/* A new empty map, added to this thread's maps. */
+Map *new_map(void) {
+    Map *map = calloc(1, sizeof(Map));
+    if (!map) {
+        fail_errno("calloc");
+    }
+    if ((size_t)map > VALUE_PAYLOAD) {
+        free(map);
+        fail("Map address does not fit in a value\n");
+    }
+
+    map->owner = map_owner;
+    map->next = maps;
+    maps = map;
+    index_init(&map->index, MAP_GROUP);
+    return map;
+}
+
+/* Frees the maps this thread made since keep was the newest. */
+void free_maps(Map *keep) {
+    while (maps != keep) {
+        Map *next = maps->next;
+        free(maps->entries);
+        free(maps->index.control);
+        free(maps->index.entry);
+        free(maps->growing.control);
+        free(maps->growing.entry);
+        free(maps);
+        maps = next;
+    }
+}
+
+/*
+ * Moves the next MAP_MOVES entries into the growing index, and switches
+ * to it once it has them all. Changes made meanwhile go to both indexes.
+ */
+void map_grow_step(Map *map) {
+    if (!map->growing.capacity) return;
+
+    for (int n = 0; n < MAP_MOVES && map->moved < map->count; n++) {
+        index_set(map, &map->growing, map->moved++);
+    }
+    if (map->moved < map->count) return;
+
+    free(map->index.control);
+    free(map->index.entry);
+    map->index = map->growing;
+    memset(&map->growing, 0, sizeof(map->growing));
+}
+
+/*
+ * Makes room for one more key. Growing starts once index is three quarters
+ * used, counting deleted slots, into an index twice the number of keys;
+ * that is done well before index is seven eighths used, which is only a
+ * safeguard.
+ */
+void map_reserve(Map *map) {
+    if (map->count >= (unsigned)-1) {
+        fail("Map too large\n");
+    }
+    if (map->growing.capacity) {
+        while (map->growing.capacity && map->index.used >= map->index.capacity / 8 * 7) map_grow_step(map);
+        return;
+    }
+    if (map->index.used < map->index.capacity / 4 * 3) return;
+
+    size_t capacity = MAP_GROUP;
+    while (capacity < 2 * (map->count + 1)) capacity *= 2;
+    index_init(&map->growing, capacity);
+    map->moved = 0;
+}
+
+/* The entry of key in map, or NULL if it has none. */
+MapEntry *map_entry(const Map *map, Value key) {
+    unsigned long long hash;
+    key = map_key(key, &hash);
+    long slot = index_find(map, &map->index, key, hash);
+    return slot < 0 ? NULL : &map->entries[map->index.entry[slot]];
+}
+
+/* Only the prep job that made a map can change it, so maps from outside a prep body are read-only in it. */
+void map_writable(const Map *map) {
+    if (map->owner != map_owner) {
+        fail("A map made outside a prep loop cannot be changed inside it\n");
+    }
+}
+
+void map_set(Map *map, Value key, Value value) {
+    unsigned long long hash;
+    map_writable(map);
+    key = map_key(key, &hash);
+
+    long slot = index_find(map, &map->index, key, hash);
+    if (slot >= 0) {
+        map->entries[map->index.entry[slot]].value = value;
+        return;
+    }
+
+    map_reserve(map);
+    map->entries = grow_array(map->entries, &map->entry_capacity, map->count + 1, sizeof(MapEntry));
+    MapEntry *entry = &map->entries[map->count];
+    entry->key = key;
+    entry->value = value;
+    entry->hash = hash;
+    index_place(&map->index, hash, map->count);
+    if (map->growing.capacity) index_place(&map->growing, hash, map->count);
+    map->count++;
+    map_grow_step(map);
+}
+
+/* Deletes key from map, moving the last entry into its place. Returns whether it was there. */
+int map_delete(Map *map, Value key) {
+    unsigned long long hash;
+    map_writable(map);
+    key = map_key(key, &hash);
+
+    long slot = index_find(map, &map->index, key, hash);
+    if (slot < 0) return 0;
+
+    size_t at = map->index.entry[slot];
+    size_t last = map->count - 1;
+    index_remove(map, &map->index, key, hash);
+    if (map->growing.capacity) index_remove(map, &map->growing, key, hash);
+    if (at != last) {
+        map->entries[at] = map->entries[last];
+        index_set(map, &map->index, at);
+        if (map->growing.capacity) index_set(map, &map->growing, at);
+    }
+    map->count = last;
+    if (map->moved > map->count) map->moved = map->count;
+    map_grow_step(map);
+    return 1;
+}
+
+/* The element a[index] refers to, where a is the variable name holding array. */
+double *array_element(Value array, Value index, int name) {
+    long long i;
+
+    if (!is_array(array)) {
+        fail("Variable %s is not an array or a map\n", symbol_name(name));
+    }
+    if (!is_number(index)) {
+        fail("Index for %s is not a number\n", symbol_name(name));
+    }
+    Array *a = array_of(array);
+    if (!whole_count(index, &i) || i < 0 || (unsigned long long)i >= a->length) {
+        fail("Index %g is out of range for %s, which has %zu elements\n",
+             number_value(index), symbol_name(name), a->length);
+    }
+    return &a->data[i];
+}
+
+/* container[index] as it is, where name is the variable holding container. */
+Value index_value(Value container, Value index, int name) {
+    if (is_map(container)) {
+        MapEntry *entry = map_entry(map_of(container), index);
+        if (entry) return entry->value;
+        if (is_string(index)) {
+            fail("Key %s is not in %s\n", pool_text(string_of(index)), symbol_name(name));
+        }
+        fail("Key %g is not in %s\n", number_value(index), symbol_name(name));
+    }
+    return make_double(*array_element(container, index, name));
+}
+
+/* container[index] inside an expression, which needs a number. */
+Value index_number(Value container, Value index, int name) {
+    Value value = index_value(container, index, name);
+    if (!is_number(value)) {
+        fail("The value at that key of %s is not a number\n", symbol_name(name));
+    }
+    return value;
+}
+
+void store_index(Value container, Value index, Value value, int name) {
+    if (is_map(container)) {
+        map_set(map_of(container), index, value);
+        return;
+    }
+    double *element = array_element(container, index, name);
+    if (!is_number(value)) {
+        fail("Elements of %s have to be numbers\n", symbol_name(name));
+    }
+    *element = number_value(value);
+}
+
+/*
+ * Vector kernels for the array built-ins. Each one works through whole
+ * vectors and returns how many elements it did; array_reduce and
+ * array_map do the rest in plain C, which is all of it without SSE2. AVX
+ * is used where the CPU has it. A reduction keeps ARRAY_LANES partial
+ * results, element i going to lane i % ARRAY_LANES whichever code handles
+ * it, and the lanes are combined in a fixed order, so sum, dot, min and
+ * max give the same result with AVX, SSE2 or neither. op is OP_ADD for
+ * sum, OP_MUL for dot, OP_LESS for min and OP_MORE for max; min and max
+ * keep the lane when it compares below (or above) the element, as MINPD
+ * and MAXPD do.
+ */
+#ifdef KINNIE_SSE2
+size_t reduce_sse2(OpCode op, const double *x, const double *y, size_t n, double *lanes) {
+    __m128d a0 = _mm_loadu_pd(lanes);
+    __m128d a1 = _mm_loadu_pd(lanes + 2);
+    __m128d a2 = _mm_loadu_pd(lanes + 4);
+    __m128d a3 = _mm_loadu_pd(lanes + 6);
+    size_t i = 0;
+
+    switch (op) {
+        case OP_ADD:
+            for (; i + ARRAY_LANES <= n; i += ARRAY_LANES) {
+                a0 = _mm_add_pd(a0, _mm_loadu_pd(x + i));
+                a1 = _mm_add_pd(a1, _mm_loadu_pd(x + i + 2));
+                a2 = _mm_add_pd(a2, _mm_loadu_pd(x + i + 4));
+                a3 = _mm_add_pd(a3, _mm_loadu_pd(x + i + 6));
+            }
+            break;
+        case OP_MUL:
+            for (; i + ARRAY_LANES <= n; i += ARRAY_LANES) {
+                a0 = _mm_add_pd(a0, _mm_mul_pd(_mm_loadu_pd(x + i), _mm_loadu_pd(y + i)));
+                a1 = _mm_add_pd(a1, _mm_mul_pd(_mm_loadu_pd(x + i + 2), _mm_loadu_pd(y + i + 2)));
+                a2 = _mm_add_pd(a2, _mm_mul_pd(_mm_loadu_pd(x + i + 4), _mm_loadu_pd(y + i + 4)));
+                a3 = _mm_add_pd(a3, _mm_mul_pd(_mm_loadu_pd(x + i + 6), _mm_loadu_pd(y + i + 6)));
+            }
+            break;
+        case OP_LESS:
+            for (; i + ARRAY_LANES <= n; i += ARRAY_LANES) {
+                a0 = _mm_min_pd(a0, _mm_loadu_pd(x + i));
+                a1 = _mm_min_pd(a1, _mm_loadu_pd(x + i + 2));
+                a2 = _mm_min_pd(a2, _mm_loadu_pd(x + i + 4));
+                a3 = _mm_min_pd(a3, _mm_loadu_pd(x + i + 6));
+            }
+            break;
+        default:
+            for (; i + ARRAY_LANES <= n; i += ARRAY_LANES) {
+                a0 = _mm_max_pd(a0, _mm_loadu_pd(x + i));
+                a1 = _mm_max_pd(a1, _mm_loadu_pd(x + i + 2));
+                a2 = _mm_max_pd(a2, _mm_loadu_pd(x + i + 4));
+                a3 = _mm_max_pd(a3, _mm_loadu_pd(x + i + 6));
+            }
+            break;
+    }
+
+    _mm_storeu_pd(lanes, a0);
+    _mm_storeu_pd(lanes + 2, a1);
+    _mm_storeu_pd(lanes + 4, a2);
+    _mm_storeu_pd(lanes + 6, a3);
+    return i;
+}
+
+/* x[i] = x[i] op y[i], or x[i] op scalar when y is NULL; any other op stores the operand. */
+size_t map_sse2(OpCode op, double *x, const double *y, double scalar, size_t n) {
+    __m128d s = _mm_set1_pd(scalar);
+    size_t i = 0;
+
+    switch (op) {
+        case OP_ADD:
+            for (; i + 2 <= n; i += 2)
+                _mm_storeu_pd(x + i, _mm_add_pd(_mm_loadu_pd(x + i), y ? _mm_loadu_pd(y + i) : s));
+            break;
+        case OP_SUB:
+            for (; i + 2 <= n; i += 2)
+                _mm_storeu_pd(x + i, _mm_sub_pd(_mm_loadu_pd(x + i), y ? _mm_loadu_pd(y + i) : s));
+            break;
+        case OP_MUL:
+            for (; i + 2 <= n; i += 2)
+                _mm_storeu_pd(x + i, _mm_mul_pd(_mm_loadu_pd(x + i), y ? _mm_loadu_pd(y + i) : s));
+            break;
+        case OP_DIV:
+            for (; i + 2 <= n; i += 2)
+                _mm_storeu_pd(x + i, _mm_div_pd(_mm_loadu_pd(x + i), y ? _mm_loadu_pd(y + i) : s));
+            break;
+        default:
+            for (; i + 2 <= n; i += 2)
+                _mm_storeu_pd(x + i, y ? _mm_loadu_pd(y + i) : s);
+            break;
+    }
+    return i;
+}
+#endif
+
+#ifdef KINNIE_AVX
+__attribute__((target("avx")))
+size_t reduce_avx(OpCode op, const double *x, const double *y, size_t n, double *lanes) {
+    __m256d a0 = _mm256_loadu_pd(lanes);
+    __m256d a1 = _mm256_loadu_pd(lanes + 4);
+    size_t i = 0;
+
+    switch (op) {
+        case OP_ADD:
+            for (; i + ARRAY_LANES <= n; i += ARRAY_LANES) {
+                a0 = _mm256_add_pd(a0, _mm256_loadu_pd(x + i));
+                a1 = _mm256_add_pd(a1, _mm256_loadu_pd(x + i + 4));
+            }
+            break;
+        case OP_MUL:
+            for (; i + ARRAY_LANES <= n; i += ARRAY_LANES) {
+                a0 = _mm256_add_pd(a0, _mm256_mul_pd(_mm256_loadu_pd(x + i), _mm256_loadu_pd(y + i)));
+                a1 = _mm256_add_pd(a1, _mm256_mul_pd(_mm256_loadu_pd(x + i + 4), _mm256_loadu_pd(y + i + 4)));
+            }
+            break;
+        case OP_LESS:
+            for (; i + ARRAY_LANES <= n; i += ARRAY_LANES) {
+                a0 = _mm256_min_pd(a0, _mm256_loadu_pd(x + i));
+                a1 = _mm256_min_pd(a1, _mm256_loadu_pd(x + i + 4));
+            }
+            break;
+        default:
+            for (; i + ARRAY_LANES <= n; i += ARRAY_LANES) {
+                a0 = _mm256_max_pd(a0, _mm256_loadu_pd(x + i));
+                a1 = _mm256_max_pd(a1, _mm256_loadu_pd(x + i + 4));
+            }
+            break;
+    }
+
+    _mm256_storeu_pd(lanes, a0);
+    _mm256_storeu_pd(lanes + 4, a1);
+    return i;
+}
+
+__attribute__((target("avx")))
+size_t map_avx(OpCode op, double *x, const double *y, double scalar, size_t n) {
+    __m256d s = _mm256_set1_pd(scalar);
+    size_t i = 0;
+
+    switch (op) {
+        case OP_ADD:
+            for (; i + 4 <= n; i += 4)
+                _mm256_storeu_pd(x + i, _mm256_add_pd(_mm256_loadu_pd(x + i), y ? _mm256_loadu_pd(y + i) : s));
+            break;
+        case OP_SUB:
+            for (; i + 4 <= n; i += 4)
+                _mm256_storeu_pd(x + i, _mm256_sub_pd(_mm256_loadu_pd(x + i), y ? _mm256_loadu_pd(y + i) : s));
+            break;
+        case OP_MUL:
+            for (; i + 4 <= n; i += 4)
+                _mm256_storeu_pd(x + i, _mm256_mul_pd(_mm256_loadu_pd(x + i), y ? _mm256_loadu_pd(y + i) : s));
+            break;
+        case OP_DIV:
+            for (; i + 4 <= n; i += 4)
+                _mm256_storeu_pd(x + i, _mm256_div_pd(_mm256_loadu_pd(x + i), y ? _mm256_loadu_pd(y + i) : s));
+            break;
+        default:
+            for (; i + 4 <= n; i += 4)
+                _mm256_storeu_pd(x + i, y ? _mm256_loadu_pd(y + i) : s);
+            break;
+    }
+    return i;
+}
+#endif
+
+/* One step of a reduction, matching the vector instructions. */
+double reduce_step(OpCode op, double lane, double value) {
+    switch (op) {
+        case OP_LESS: return lane < value ? lane : value;
+        case OP_MORE: return lane > value ? lane : value;
+        default: return lane + value;
+    }
+}
+
+/* sum, dot, min or max of x[0, n), with y the other array for dot. */
+double array_reduce(OpCode op, const double *x, const double *y, size_t n) {
+    double lanes[ARRAY_LANES];
+    size_t i = 0;
+
+    for (size_t k = 0; k < ARRAY_LANES; k++) {
+        lanes[k] = op == OP_LESS ? INFINITY : op == OP_MORE ? -INFINITY : 0;
+    }
+
+#if defined(KINNIE_AVX)
+    i = __builtin_cpu_supports("avx") ? reduce_avx(op, x, y, n, lanes) : reduce_sse2(op, x, y, n, lanes);
+#elif defined(KINNIE_SSE2)
+    i = reduce_sse2(op, x, y, n, lanes);
+#endif
+
+    for (; i < n; i++) {
+        double value = op == OP_MUL ? x[i] * y[i] : x[i];
+        lanes[i % ARRAY_LANES] = reduce_step(op, lanes[i % ARRAY_LANES], value);
+    }
+    for (size_t width = ARRAY_LANES / 2; width; width /= 2) {
+        for (size_t k = 0; k < width; k++) {
+            lanes[k] = reduce_step(op, lanes[k], lanes[k + width]);
+        }
+    }
+    return lanes[0];
+}
+
+/* x[i] = x[i] op y[i] for i < n, or x[i] op scalar when y is NULL; any other op stores the operand. */
+void array_map(OpCode op, double *x, const double *y, double scalar, size_t n) {
+    size_t i = 0;
+
+#if defined(KINNIE_AVX)
+    i = __builtin_cpu_supports("avx") ? map_avx(op, x, y, scalar, n) : map_sse2(op, x, y, scalar, n);
+#elif defined(KINNIE_SSE2)
+    i = map_sse2(op, x, y, scalar, n);
+#endif
+
+    for (; i < n; i++) {
+        double operand = y ? y[i] : scalar;
+        switch (op) {
+            case OP_ADD: x[i] += operand; break;
+            case OP_SUB: x[i] -= operand; break;
+            case OP_MUL: x[i] *= operand; break;
+            case OP_DIV: x[i] /= operand; break;
+            default: x[i] = operand; break;
+        }
+    }
+}
+
+/*
+ * Functions every program has, unless it defines one of the same name.
+ * They work on arrays: array(n) makes one of n zeros and copy(a) a copy
+ * of a; len, sum, min and max give a number about one, and dot(a, b) the
+ * dot product of two of the same length. fill, add, sub, mul and div(a, b)
+ * set each element of a to b, or to itself plus, minus, times or divided
+ * by b, where b is a number or an array of the same length whose element
+ * at the same index is used. These change a in place and return it.
+ * map() makes an empty map, for which copy and len work too. has(m, k)
+ * tells whether m has the key k, get(m, k, d) gives its value or d if it
+ * has none, del(m, k) deletes it, telling whether it was there, and
+ * key(m, i) gives the i-th key, counting from 0.
+ */
+typedef enum {
+    BUILTIN_ARRAY,
+    BUILTIN_COPY,
+    BUILTIN_LEN,
+    BUILTIN_SUM,
+    BUILTIN_MIN,
+    BUILTIN_MAX,
+    BUILTIN_DOT,
+    BUILTIN_FILL,
+    BUILTIN_ADD,
+    BUILTIN_SUB,
+    BUILTIN_MUL,
+    BUILTIN_DIV,
+    BUILTIN_MAP,
+    BUILTIN_HAS,
+    BUILTIN_GET,
+    BUILTIN_DEL,
+    BUILTIN_KEY,
+    BUILTIN_COUNT
+} Builtin;
+
+const char *builtin_names[] = {
+    "array", "copy", "len", "sum", "min", "max", "dot", "fill", "add", "sub", "mul", "div",
+    "map", "has", "get", "del", "key"
+};
+const size_t builtin_params[] = { 1, 1, 1, 1, 1, 1, 2, 2, 2, 2, 2, 2, 0, 2, 3, 2, 2 };
+
+Function *get_function(int name);
+
+/* The built-in a call to name runs, or -1 if the program defines name or there is none. */
+int find_builtin(int name) {
+    if (get_function(name)) return -1;
+
+    for (int b = 0; b < BUILTIN_COUNT; b++) {
+        if (strcmp(symbol_name(name), builtin_names[b]) == 0) return b;
+    }
+    return -1;
+}
+
+Array *array_argument(int builtin, const Value *args, int n) {
+    if (!is_array(args[n])) {
+        fail("Argument %d of %s is not an array\n", n + 1, builtin_names[builtin]);
+    }
+    return array_of(args[n]);
+}
+
+Map *map_argument(int builtin, const Value *args, int n) {
+    if (!is_map(args[n])) {
+        fail("Argument %d of %s is not a map\n", n + 1, builtin_names[builtin]);
+    }
+    return map_of(args[n]);
+}
+
+/* Checks that b, the second argument of builtin, has as many elements as a. */
+void same_length(int builtin, const Array *a, const Array *b) {
+    if (a->length != b->length) {
+        fail("The arrays given to %s have %zu and %zu elements\n", builtin_names[builtin], a->length, b->length);
+    }
+}
+
+/* Runs builtin with args and leaves its result in return_value, as a call would. */
+void call_builtin(int builtin, const Value *args, size_t arg_count) {
+    static const OpCode reductions[] = { OP_ADD, OP_LESS, OP_MORE };
+    static const OpCode operators[] = { OP_ADD, OP_SUB, OP_MUL, OP_DIV };
+    Value result;
+    long long length;
+
+    if (arg_count != builtin_params[builtin]) {
+        fail("The arguments do not match. Expected %zu, got %zu\n", builtin_params[builtin], arg_count);
+    }
+
+    switch (builtin) {
+        case BUILTIN_ARRAY:
+            if (!whole_count(args[0], &length) || length < 0) {
+                fail("Invalid array length\n");
+            }
+            result = make_array(new_array(length));
+            break;
+        case BUILTIN_COPY: {
+            if (is_map(args[0])) {
+                Map *from = map_of(args[0]);
+                Map *to = new_map();
+                for (size_t i = 0; i < from->count; i++) map_set(to, from->entries[i].key, from->entries[i].value);
+                result = make_map(to);
+                break;
+            }
+            Array *from = array_argument(builtin, args, 0);
+            Array *to = new_array(from->length);
+            memcpy(to->data, from->data, from->length * sizeof(double));
+            result = make_array(to);
+            break;
+        }
+        case BUILTIN_LEN:
+            if (is_map(args[0]))
+                result = make_int(map_of(args[0])->count);
+            else
+                result = make_int(array_argument(builtin, args, 0)->length);
+            break;
+        case BUILTIN_SUM:
+        case BUILTIN_MIN:
+        case BUILTIN_MAX: {
+            Array *a = array_argument(builtin, args, 0);
+            result = make_double(array_reduce(reductions[builtin - BUILTIN_SUM], a->data, NULL, a->length));
+            break;
+        }
+        case BUILTIN_DOT: {
+            Array *a = array_argument(builtin, args, 0);
+            Array *b = array_argument(builtin, args, 1);
+            same_length(builtin, a, b);
+            result = make_double(array_reduce(OP_MUL, a->data, b->data, a->length));
+            break;
+        }
+        case BUILTIN_MAP:
+            result = make_map(new_map());
+            break;
+        case BUILTIN_HAS:
+            result = make_int(map_entry(map_argument(builtin, args, 0), args[1]) != NULL);
+            break;
+        case BUILTIN_GET: {
+            MapEntry *entry = map_entry(map_argument(builtin, args, 0), args[1]);
+            result = entry ? entry->value : args[2];
+            break;
+        }
+        case BUILTIN_DEL:
+            result = make_int(map_delete(map_argument(builtin, args, 0), args[1]));
+            break;
+        case BUILTIN_KEY: {
+            Map *m = map_argument(builtin, args, 0);
+            if (!whole_count(args[1], &length) || length < 0 || (unsigned long long)length >= m->count) {
+                fail("Index %g is out of range for key, the map has %zu keys\n", number_value(args[1]), m->count);
+            }
+            result = m->entries[length].key;
+            break;
+        }
+        default: {
+            Array *a = array_argument(builtin, args, 0);
+            OpCode op = builtin == BUILTIN_FILL ? OP_STORE_NUM : operators[builtin - BUILTIN_ADD];
+            if (is_array(args[1])) {
+                Array *b = array_of(args[1]);
+                same_length(builtin, a, b);
+                array_map(op, a->data, b->data, 0, a->length);
+            } else if (!is_number(args[1])) {
+                fail("Argument 2 of %s is not a number or an array\n", builtin_names[builtin]);
+            } else {
+                array_map(op, a->data, NULL, number_value(args[1]), a->length);
+            }
+            result = args[0];
+            break;
+        }
+    }
+
+    return_value = result;
+    has_return_value = 1;
+}
+
+void push_scope(int is_function) {
+    scope_stack = grow_array(scope_stack, &scope_capacity, scope_depth + 1, sizeof(Scope));
+    scope_stack[scope_depth].start = walker_var_count;
+    scope_stack[scope_depth].var_count = 0;
+    scope_stack[scope_depth].is_function_boundary = is_function;
+    scope_depth++;
+}
+
+void pop_scope() {
+    if (scope_depth == 0) {
+        fail("Scope underflow\n");
+    }
+    scope_depth--;
+    walker_var_count = scope_stack[scope_depth].start;
+}
+
+/*
+ * Pointers returned by get_var are only valid until the next variable is
+ * declared, since walker_vars may move when it grows.
+ */
+Variable *get_var(int name) {
+    for (int i = scope_depth - 1; i >= 0; i--) {
+        Variable *vars = &walker_vars[scope_stack[i].start];
+        for (size_t j = 0; j < scope_stack[i].var_count; j++) {
+            if (vars[j].name == name)
+                return &vars[j];
+        }
+
+        if (scope_stack[i].is_function_boundary) break;
+    }
+    return NULL;
+}
+
+Variable *declare_var(int name) {
+    walker_vars = grow_array(walker_vars, &walker_var_capacity, walker_var_count + 1, sizeof(Variable));
+
+    Variable *v = &walker_vars[walker_var_count++];
+    v->name = name;
+    scope_stack[scope_depth - 1].var_count++;
+    return v;
+}
+
+void set_var_value(int name, Value value) {
+    Variable *v = get_var(name);
+    if (!v) v = declare_var(name);
+
+    v->value = value;
+}
+
+/*
+ * Whether anything between the rep counter at tokens[counter] and the end
+ * of its body may store to the counter: an assignment or 'var' naming it,
+ * or a nested rep or prep header naming it. Called functions cannot see the
+ * caller's variables, so only the body itself needs checking.
+ */
+int assigns_counter(Token tokens[], size_t counter, size_t end) {
+    if (tokens[counter].type != TOK_IDENT) return 1;
+
+    int name = tokens[counter].symbol;
+    for (size_t i = counter + 2; i < end; i++) {
+        if (tokens[i].type == TOK_PREP_START) {
+            for (i++; i < end && tokens[i].type == TOK_IDENT; i++) {
+                if (tokens[i].symbol == name) return 1;
+            }
+            continue;
+        }
+        if (tokens[i].type != TOK_IDENT || tokens[i].symbol != name) continue;
+        if (tokens[i + 1].type == TOK_ASSIGN) return 1;
+        if (tokens[i - 1].type == TOK_VAR || tokens[i - 1].type == TOK_LOOP_START) return 1;
+    }
+    return 0;
+}
+
+void match_blocks(Token tokens[], size_t token_count) {
+    size_t *open = malloc((token_count + 1) * sizeof(size_t));
+    int *owner = malloc((token_count + 1) * sizeof(int));
+    size_t depth = 0;
+    int pending_if = -1;
+
+    if (!open || !owner) {
+        fail_errno("malloc");
+    }
+
+    for (size_t i = 0; i <= token_count; i++) {
+        tokens[i].jump = 0;
+
+        if (tokens[i].type == TOK_IF_START) {
+            pending_if = i;
+        } else if (tokens[i].type == TOK_LBRACE) {
+            open[depth] = i;
+            owner[depth] = pending_if;
+            depth++;
+            pending_if = -1;
+        } else if (tokens[i].type == TOK_RBRACE && depth > 0) {
+            depth--;
+            tokens[open[depth]].jump = i - open[depth];
+            if (owner[depth] >= 0 && tokens[i + 1].type == TOK_ELSE)
+                tokens[owner[depth]].jump = i + 1 - owner[depth];
+            if (open[depth] >= 2 && tokens[open[depth] - 2].type == TOK_LOOP_START)
+                tokens[open[depth] - 2].jump = !assigns_counter(tokens, open[depth] - 1, i);
+        }
+    }
+
+    while (depth > 0) {
+        depth--;
+        tokens[open[depth]].jump = token_count - open[depth];
+    }
+
+    free(open);
+    free(owner);
+}
+
+int is_word(const char *word, size_t len, const char *keyword) {
+    return strncmp(word, keyword, len) == 0 && keyword[len] == 0;
+}
+
+/*
+ * Incremental lexer over a source buffer that need not be NUL-terminated,
+ * such as a read-only file mapping. next_token produces one token per call.
+ */
+typedef struct {
+    const char *src;
+    size_t length;
+    size_t pos;
+    int line;
+    int token_line;
+} Lexer;
+
+int lexer_peek(Lexer *lex, size_t offset) {
+    size_t at = lex->pos + offset;
+    return at < lex->length ? (unsigned char)lex->src[at] : 0;
+}
+
+/* Reads the next token into tok. Returns 0 once the source is exhausted. */
+int next_token(Lexer *lex, Token *tok) {
+    const char *src = lex->src;
+    int c;
+
+    while ((c = lexer_peek(lex, 0)) && isspace(c)) {
+        if (c == '\n') lex->line++;
+        lex->pos++;
+    }
+    if (!c) return 0;
+
+    lex->token_line = lex->line;
+
+    if (c == '"') {
+        size_t start = ++lex->pos;
+        while ((c = lexer_peek(lex, 0)) && c != '"') {
+            if (c == '\n') lex->line++;
+            lex->pos++;
+        }
+
+        tok->string = pool_string(src + start, lex->pos - start);
+        tok->type = TOK_STRING;
+        if (lexer_peek(lex, 0) == '"') lex->pos++;
+        return 1;
+    }
+    if (isdigit(c)) {
+        long long value = 0;
+        double big = 0;
+        int fits = 1;
+        while (isdigit(c = lexer_peek(lex, 0))) {
+            if (value > (LLONG_MAX - (c - '0')) / 10) fits = 0;
+            if (fits) value = value * 10 + (c - '0');
+            big = big * 10 + (c - '0');
+            lex->pos++;
+        }
+
+        if (fits) {
+            tok->integer = value;
+            tok->type = TOK_INTEGER;
+        } else {
+            tok->number = big;
+            tok->type = TOK_NUMBER;
+        }
+        return 1;
+    }
+    if (isalpha(c)) {
+        size_t start = lex->pos;
+        while (isalnum(lexer_peek(lex, 0))) lex->pos++;
+
+        const char *word = src + start;
+        size_t len = lex->pos - start;
+
+        if (is_word(word, len, "var"))
+            tok->type = TOK_VAR;
+        else if (is_word(word, len, "ret"))
+            tok->type = TOK_RETURN;
+        else if (is_word(word, len, "out"))
+            tok->type = TOK_PRINT;
+        else if (is_word(word, len, "rep"))
+            tok->type = TOK_LOOP_START;
+        else if (is_word(word, len, "prep"))
+            tok->type = TOK_PREP_START;
+        else if (is_word(word, len, "pure"))
+            tok->type = TOK_PURE;
+        else if (is_word(word, len, "fun"))
+            tok->type = TOK_FUN_START;
+        else if (is_word(word, len, "if"))
+            tok->type = TOK_IF_START;
+        else if (is_word(word, len, "else"))
+            tok->type = TOK_ELSE;
+        else if (is_word(word, len, "end"))
+            tok->type = TOK_END;
+        else {
+            tok->type = TOK_IDENT;
+            tok->symbol = intern(word, len);
+        }
+        return 1;
+    }
+
+    int next = lexer_peek(lex, 1);
+    lex->pos++;
+    switch (c) {
+        case '{': tok->type = TOK_LBRACE; break;
+        case '}': tok->type = TOK_RBRACE; break;
+        case '(': tok->type = TOK_LBRACKET; break;
+        case ')': tok->type = TOK_RBRACKET; break;
+        case '[': tok->type = TOK_LSQUARE; break;
+        case ']': tok->type = TOK_RSQUARE; break;
+        case ',': tok->type = TOK_COMMA; break;
+        case '+': tok->type = TOK_PLUS; break;
+        case '-': tok->type = TOK_MINUS; break;
+        case '*': tok->type = TOK_MUL; break;
+        case '/': tok->type = TOK_DIV; break;
+        case '%': tok->type = TOK_MOD; break;
+        case '=': tok->type = next == '=' ? TOK_EQUALS : TOK_ASSIGN; break;
+        case '!': tok->type = next == '=' ? TOK_NOT_EQUALS : TOK_UNKNOWN; break;
+        case '>': tok->type = next == '=' ? TOK_MORE_EQUALS : TOK_MORE; break;
+        case '<': tok->type = next == '=' ? TOK_LESS_EQUALS : TOK_LESS; break;
+        default:  tok->type = TOK_UNKNOWN; break;
+    }
+    if (next == '=' && strchr("=!<>", c)) lex->pos++;
+    return 1;
+}
+
+/*
+ * Drains the lexer into a token array terminated by TOK_EOF. Functions can
+ * be called before they are defined, so the interpreter still needs every
+ * token before it runs; the source buffer can be released as soon as this
+ * returns, since all text has been copied into string_pool. The source line
+ * of every token goes to token_lines, kept apart so tokens stay small.
+ * The array is program->tokens all along, so a failure leaves nothing
+ * that free_program cannot free.
+ */
+size_t tokenize(const char *src, size_t length, Token **out) {
+    Lexer lex = { src, length, 0, 1, 1 };
+    Token *tokens = NULL;
+    size_t capacity = 0;
+    size_t line_capacity = 0;
+    size_t t = 0;
+
+    for (;;) {
+        tokens = program->tokens = grow_array(tokens, &capacity, t + 1, sizeof(Token));
+        program->token_lines = grow_array(program->token_lines, &line_capacity, t + 1, sizeof(int));
+        memset(&tokens[t], 0, sizeof(Token));
+        if (!next_token(&lex, &tokens[t])) break;
+        program->token_lines[t++] = lex.token_line;
+    }
+    tokens[t].type = TOK_EOF;
+    program->token_lines[t] = lex.line;
+    program->line_count = lex.line;
+    match_blocks(tokens, t);
+    *out = tokens;
+    return t;
+}
+
+Function *get_function(int name) {
+    if ((size_t)name >= program->function_table_size)
+        return NULL;
+    return program->function_table[name];
+}
+
+/*
+ * Adds func to the function table. The first definition of a name wins,
+ * as it always has.
+ */
+void register_function(Function *func) {
+    size_t old_size = program->function_table_size;
+    program->function_table = grow_array(program->function_table, &program->function_table_size, (size_t)func->name + 1, sizeof(Function *));
+    memset(program->function_table + old_size, 0, (program->function_table_size - old_size) * sizeof(Function *));
+
+    if (!program->function_table[func->name])
+        program->function_table[func->name] = func;
+}
+
+Function *resolve_function(int name, size_t arg_count) {
+    Function *func = get_function(name);
+    if (!func) {
+        fail("Unknown function: %s\n", symbol_name(name));
+    }
+
+    if (arg_count != func->param_count) {
+        fail("The arguments do not match. Expected %zu, got %zu\n",
+             func->param_count, arg_count);
+    }
+    return func;
+}
+
+int is_literal(TokenType type) {
+    return type == TOK_INTEGER || type == TOK_NUMBER;
+}
+
+Value literal_value(const Token *tok) {
+    if (tok->type == TOK_INTEGER)
+        return make_int(tok->integer);
+    return make_double(tok->number);
+}
+
+/* The opcode for an arithmetic or comparison token. */
+OpCode binary_op(TokenType type) {
+    switch (type) {
+        case TOK_PLUS: return OP_ADD;
+        case TOK_MINUS: return OP_SUB;
+        case TOK_MUL: return OP_MUL;
+        case TOK_DIV: return OP_DIV;
+        case TOK_MOD: return OP_MOD;
+        case TOK_EQUALS: return OP_EQUALS;
+        case TOK_NOT_EQUALS: return OP_NOT_EQUALS;
+        case TOK_MORE: return OP_MORE;
+        case TOK_LESS: return OP_LESS;
+        case TOK_MORE_EQUALS: return OP_MORE_EQUALS;
+        default: return OP_LESS_EQUALS;
+    }
+}
+
+/*
+ * How tightly a binary operator token binds, or 0 if it is not one:
+ * comparisons bind loosest, then + and -, then *, / and %. Unary minus
+ * binds tighter than any of them.
+ */
+int binary_precedence(TokenType type) {
+    switch (type) {
+        case TOK_MUL:
+        case TOK_DIV:
+        case TOK_MOD:
+            return 3;
+        case TOK_PLUS:
+        case TOK_MINUS:
+            return 2;
+        case TOK_EQUALS:
+        case TOK_NOT_EQUALS:
+        case TOK_MORE:
+        case TOK_LESS:
+        case TOK_MORE_EQUALS:
+        case TOK_LESS_EQUALS:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+/* Whether an identifier followed by next is a whole operand rather than the start of an expression. */
+int ends_operand(TokenType next) {
+    return binary_precedence(next) == 0 && next != TOK_LBRACKET && next != TOK_LSQUARE;
+}
+
+/* Whether the call starting at tokens[i] is followed by no operator, so it is a whole expression. */
+int is_whole_bracketed(Token tokens[], size_t i, TokenType open, TokenType close) {
+    if (tokens[i].type != TOK_IDENT || tokens[i + 1].type != open) return 0;
+
+    size_t depth = 0;
+    for (i++; tokens[i].type != TOK_EOF; i++) {
+        if (tokens[i].type == open) depth++;
+        else if (tokens[i].type == close && --depth == 0) break;
+    }
+    return tokens[i].type == TOK_EOF || binary_precedence(tokens[i + 1].type) == 0;
+}
+
+int is_whole_call(Token tokens[], size_t i) {
+    return is_whole_bracketed(tokens, i, TOK_LBRACKET, TOK_RBRACKET);
+}
+
+/* The same for an index such as m[k], whose value need not be a number. */
+int is_whole_index(Token tokens[], size_t i) {
+    return is_whole_bracketed(tokens, i, TOK_LSQUARE, TOK_RSQUARE);
+}
+
+Value parse_value(Token *tok) {
+    if (is_literal(tok->type))
+        return literal_value(tok);
+    if (tok->type == TOK_IDENT) {
+        Variable *v = get_var(tok->symbol);
+        if (!v) {
+            fail("Unknown variable: %s\n", symbol_name(tok->symbol));
+        }
+        if (!is_number(v->value)) {
+            fail("Variable %s is not a number\n", symbol_name(tok->symbol));
+        }
+        return v->value;
+    }
+    fail("Syntax error\n");
+}
+
+void call_function(Function *func, Value *args);
+Value evaluate_expression(Token tokens[], size_t *idx);
+
+/* Calls the function name, or the built-in of that name if the program has no such function. */
+void call_named(int name, Value *args, size_t arg_count) {
+    int builtin = find_builtin(name);
+    if (builtin >= 0)
+        call_builtin(builtin, args, arg_count);
+    else
+        call_function(resolve_function(name, arg_count), args);
+}
+
+Value evaluate_index(Token tokens[], size_t *idx);
+size_t evaluate_arguments(Token tokens[], size_t *idx, Value *args);
+
+/*
+ * An argument, the value of an assignment or a returned value, a map key
+ * or an element stored: a string, a variable, an index or a call on its own
+ * there can also be a string, an array or a map, anything else has to be a
+ * number.
+ */
+Value evaluate_value(Token tokens[], size_t *idx) {
+    if (tokens[*idx].type == TOK_STRING && ends_operand(tokens[*idx + 1].type)) {
+        return make_string(tokens[(*idx)++].string);
+    }
+    if (tokens[*idx].type == TOK_IDENT && ends_operand(tokens[*idx + 1].type)) {
+        Variable *v = get_var(tokens[*idx].symbol);
+        if (v) {
+            (*idx)++;
+            return v->value;
+        }
+    }
+    if (is_whole_index(tokens, *idx)) {
+        int name = tokens[*idx].symbol;
+        Value index = evaluate_index(tokens, idx);
+        return index_value(get_var(name)->value, index, name);
+    }
+    if (is_whole_call(tokens, *idx)) {
+        int name = tokens[*idx].symbol;
+        Value args[MAX_FUNC_PARAMS];
+        size_t arg_count = evaluate_arguments(tokens, idx, args);
+        call_named(name, args, arg_count);
+        return call_value(name);
+    }
+    return evaluate_expression(tokens, idx);
+}
+
+/*
+ * Evaluates the index between the brackets after the array or map variable
+ * at tokens[*idx], leaving *idx after the ']'. Returns the index, the
+ * variable itself being looked up again once the index, which may call
+ * functions, is known.
+ */
+Value evaluate_index(Token tokens[], size_t *idx) {
+    int name = tokens[*idx].symbol;
+    if (!get_var(name)) {
+        fail("Unknown variable: %s\n", symbol_name(name));
+    }
+    *idx += 2;
+
+    Value index = evaluate_value(tokens, idx);
+    if (tokens[*idx].type != TOK_RSQUARE) {
+        fail("Expected ']'\n");
+    }
+    (*idx)++;
+    return index;
+}
+
+/*
+ * Evaluates the arguments of the call whose name is at tokens[*idx] into
+ * args, leaving *idx after the closing ')'. Returns how many there are.
+ */
+size_t evaluate_arguments(Token tokens[], size_t *idx, Value *args) {
+    size_t arg_count = 0;
+    *idx += 2;
+
+    while (tokens[*idx].type != TOK_RBRACKET && tokens[*idx].type != TOK_EOF) {
+        if (arg_count >= MAX_FUNC_PARAMS) {
+            fail("Too many arguments\n");
+        }
+
+        args[arg_count++] = evaluate_value(tokens, idx);
+
+        if (tokens[*idx].type == TOK_COMMA) {
+            (*idx)++;
+        }
+    }
+
+    if (tokens[*idx].type != TOK_RBRACKET) {
+        fail("Expected ')'\n");
+    }
+    (*idx)++;
+    return arg_count;
+}
+
+/* Whether tokens[i] is a literal or a variable, the commonest operands. */
+int is_plain_operand(Token tokens[], size_t i) {
+    return is_literal(tokens[i].type) ||
+           (tokens[i].type == TOK_IDENT && tokens[i + 1].type != TOK_LBRACKET && tokens[i + 1].type != TOK_LSQUARE);
+}
+
+/* An operand with any unary minus in front of it. */
+Value evaluate_unary(Token tokens[], size_t *idx) {
+    Token *tok = &tokens[*idx];
+
+    if (is_plain_operand(tokens, *idx)) {
+        (*idx)++;
+        return parse_value(tok);
+    }
+
+    if (tok->type == TOK_MINUS) {
+        (*idx)++;
+        return negate(evaluate_unary(tokens, idx));
+    }
+
+    if (tok->type == TOK_LBRACKET) {
+        (*idx)++;
+        Value value = evaluate_expression(tokens, idx);
+        if (tokens[*idx].type != TOK_RBRACKET) {
+            fail("Expected ')'\n");
+        }
+        (*idx)++;
+        return value;
+    }
+
+    if (tok->type == TOK_IDENT && tokens[*idx + 1].type == TOK_LSQUARE) {
+        Value index = evaluate_index(tokens, idx);
+        return index_number(get_var(tok->symbol)->value, index, tok->symbol);
+    }
+
+    if (tok->type == TOK_IDENT) {
+        Value args[MAX_FUNC_PARAMS];
+        size_t arg_count = evaluate_arguments(tokens, idx, args);
+        call_named(tok->symbol, args, arg_count);
+        return call_result(tok->symbol);
+    }
+
+    fail("Syntax error\n");
+}
+
+/* Literals and variables are read here directly, the rest by evaluate_unary. */
+Value evaluate_operand(Token tokens[], size_t *idx) {
+    if (is_plain_operand(tokens, *idx))
+        return parse_value(&tokens[(*idx)++]);
+    return evaluate_unary(tokens, idx);
+}
+
+/*
+ * Precedence climbing: applies the operators that follow to result, as long
+ * as they bind at least as tightly as min_precedence. A right operand only
+ * recurses when the operator after it binds tighter still.
+ */
+Value evaluate_operators(Token tokens[], size_t *idx, Value result, int min_precedence) {
+    int precedence;
+
+    while ((precedence = binary_precedence(tokens[*idx].type)) >= min_precedence) {
+        TokenType op = tokens[*idx].type;
+        (*idx)++;
+
+        Value rhs = evaluate_operand(tokens, idx);
+        if (binary_precedence(tokens[*idx].type) > precedence)
+            rhs = evaluate_operators(tokens, idx, rhs, precedence + 1);
+        result = arithmetic(binary_op(op), result, rhs);
+    }
+    return result;
+}
+
+Value evaluate_expression(Token tokens[], size_t *idx) {
+    Value result = evaluate_operand(tokens, idx);
+    return evaluate_operators(tokens, idx, result, 1);
+}
+
+void print_text(const char *str, int interpolate) {
+    for (size_t j = 0; str[j] != '\0'; j++) {
+        if (str[j] == '\\' && str[j+1] == 'n') {
+            out_char('\n');
+            j++;
+        } else if (interpolate && str[j] == '{') {
+            size_t name_start = ++j;
+            while (str[j] != '}' && str[j] != '\0') j++;
+
+            if (str[j] != '}') {
+                fail("Missing closing '}' in string interpolation\n");
+            }
+
+            int name = find_symbol(str + name_start, j - name_start);
+            Variable *temp_var = name < 0 ? NULL : get_var(name);
+            if (!temp_var) {
+                fail("Variable not found: %.*s\n", (int)(j - name_start), str + name_start);
+            }
+
+            if (is_string(temp_var->value))
+                out_text(pool_text(string_of(temp_var->value)), pool_length(string_of(temp_var->value)));
+            else
+                out_value(temp_var->value);
+        } else {
+            out_char(str[j]);
+        }
+    }
+}
+
+long long profile_clock(void) {
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+void profile_start(void) {
+    profile_nodes = grow_array(profile_nodes, &profile_node_capacity, 1, sizeof(ProfileNode));
+    profile_nodes[0].entry = -1;
+    profile_nodes[0].first_child = -1;
+    profile_nodes[0].next_sibling = -1;
+    profile_nodes[0].exclusive = 0;
+    profile_node_count = 1;
+
+    profile_stack = grow_array(profile_stack, &profile_stack_capacity, 1, sizeof(ProfileFrame));
+    profile_stack[0].node = 0;
+    profile_stack[0].start = profile_clock();
+    profile_stack[0].children = 0;
+    profile_depth = 1;
+
+    line_hits = calloc(program->line_count + 1, sizeof(size_t));
+    if (!line_hits) {
+        fail_errno("calloc");
+    }
+}
+
+int profile_entry(ProfileKind kind, int key) {
+    for (size_t i = 0; i < profile_entry_count; i++) {
+        if (profile_entries[i].kind == kind && profile_entries[i].key == key)
+            return i;
+    }
+
+    /* A rep block belongs to the function running it. */
+    int owner = -1;
+    for (size_t d = profile_depth; d-- > 1;) {
+        ProfileEntry *e = &profile_entries[profile_nodes[profile_stack[d].node].entry];
+        if (e->kind == PROFILE_FUNCTION) {
+            owner = e->key;
+            break;
+        }
+    }
+
+    profile_entries = grow_array(profile_entries, &profile_entry_capacity, profile_entry_count + 1, sizeof(ProfileEntry));
+    ProfileEntry *e = &profile_entries[profile_entry_count];
+    memset(e, 0, sizeof(ProfileEntry));
+    e->kind = kind;
+    e->key = key;
+    e->owner = owner;
+    return profile_entry_count++;
+}
+
+/* Finds or adds the child of node for kind/key. */
+int profile_child(int node, ProfileKind kind, int key) {
+    int child;
+    for (child = profile_nodes[node].first_child; child >= 0; child = profile_nodes[child].next_sibling) {
+        ProfileEntry *e = &profile_entries[profile_nodes[child].entry];
+        if (e->kind == kind && e->key == key)
+            return child;
+    }
+
+    int entry = profile_entry(kind, key);
+    profile_nodes = grow_array(profile_nodes, &profile_node_capacity, profile_node_count + 1, sizeof(ProfileNode));
+    child = profile_node_count++;
+    profile_nodes[child].entry = entry;
+    profile_nodes[child].first_child = -1;
+    profile_nodes[child].next_sibling = profile_nodes[node].first_child;
+    profile_nodes[child].exclusive = 0;
+    profile_nodes[node].first_child = child;
+    return child;
+}
+
+/*
+ * Starts timing a function call (key is its name) or a rep block (key is
+ * the index of its 'rep' token in program->tokens). Returns the mark to pass
+ * to profile_leave.
+ */
+size_t profile_enter(ProfileKind kind, int key) {
+    int node = profile_child(profile_stack[profile_depth - 1].node, kind, key);
+    ProfileEntry *e = &profile_entries[profile_nodes[node].entry];
+    e->count++;
+    e->active++;
+
+    profile_stack = grow_array(profile_stack, &profile_stack_capacity, profile_depth + 1, sizeof(ProfileFrame));
+    profile_stack[profile_depth].node = node;
+    profile_stack[profile_depth].children = 0;
+    profile_stack[profile_depth].start = profile_clock();
+    return profile_depth++;
+}
+
+void profile_iteration(void) {
+    profile_entries[profile_nodes[profile_stack[profile_depth - 1].node].entry].iterations++;
+}
+
+/*
+ * Stops timing everything from mark upwards. A 'ret' inside a loop leaves
+ * the function without leaving the loop first, so a function's mark also
+ * closes any rep blocks still open inside it.
+ */
+void profile_leave(size_t mark) {
+    long long now = profile_clock();
+    profile_left_at = now;
+
+    while (profile_depth > mark) {
+        ProfileFrame *frame = &profile_stack[--profile_depth];
+        ProfileNode *node = &profile_nodes[frame->node];
+        ProfileEntry *e = &profile_entries[node->entry];
+        long long elapsed = now - frame->start;
+
+        node->exclusive += elapsed - frame->children;
+        e->exclusive += elapsed - frame->children;
+        if (--e->active == 0) e->inclusive += elapsed;
+        profile_stack[profile_depth - 1].children += elapsed;
+    }
+}
+
+/*
+ * Replaces everything from mark upwards with a call to name, for a tail
+ * call. The new call starts when the old one ended, so the time in between
+ * is not charged to the caller.
+ */
+size_t profile_replace(size_t mark, int name) {
+    profile_leave(mark);
+    size_t replaced = profile_enter(PROFILE_FUNCTION, name);
+    profile_stack[replaced].start = profile_left_at;
+    return replaced;
+}
+
+void profile_name(ProfileEntry *e, char *buffer, size_t size) {
+    if (e->kind == PROFILE_FUNCTION)
+        snprintf(buffer, size, "%s", symbol_name(e->key));
+    else
+        snprintf(buffer, size, "%s:rep@%d", e->owner < 0 ? "?" : symbol_name(e->owner), program->token_lines[e->key]);
+}
+
+int compare_exclusive(const void *a, const void *b) {
+    const ProfileEntry *x = &profile_entries[*(const int *)a];
+    const ProfileEntry *y = &profile_entries[*(const int *)b];
+    return (y->exclusive > x->exclusive) - (y->exclusive < x->exclusive);
+}
+
+/* Writes one "a;b;c count" line per call tree node, counts in microseconds. */
+void write_stacks(FILE *f, int node, char **path, size_t *capacity, size_t length) {
+    if (node > 0) {
+        char name[256];
+        profile_name(&profile_entries[profile_nodes[node].entry], name, sizeof(name));
+        size_t name_length = strlen(name);
+
+        *path = grow_array(*path, capacity, length + name_length + 2, 1);
+        if (length) (*path)[length++] = ';';
+        memcpy(*path + length, name, name_length + 1);
+        length += name_length;
+
+        long long micros = profile_nodes[node].exclusive / 1000;
+        if (micros > 0) fprintf(f, "%s %lld\n", *path, micros);
+    }
+
+    for (int child = profile_nodes[node].first_child; child >= 0; child = profile_nodes[child].next_sibling) {
+        write_stacks(f, child, path, capacity, length);
+    }
+}
+
+/*
+ * Prints the --profile report to stderr, heaviest exclusive time first,
+ * and writes the collapsed stacks for flamegraph tools.
+ */
+void profile_report(void) {
+    if (!profiling) return;
+    profile_leave(1);
+    out_flush();
+
+    int *order = malloc((profile_entry_count + 1) * sizeof(int));
+    if (!order) {
+        fail_errno("malloc");
+    }
+    for (size_t i = 0; i < profile_entry_count; i++) order[i] = i;
+    qsort(order, profile_entry_count, sizeof(int), compare_exclusive);
+
+    char name[256];
+    fprintf(stderr, "\n%-32s %12s %12s %12s\n", "function", "calls", "incl ms", "excl ms");
+    for (size_t i = 0; i < profile_entry_count; i++) {
+        ProfileEntry *e = &profile_entries[order[i]];
+        if (e->kind != PROFILE_FUNCTION) continue;
+        profile_name(e, name, sizeof(name));
+        fprintf(stderr, "%-32s %12zu %12.3f %12.3f\n", name, e->count, e->inclusive / 1e6, e->exclusive / 1e6);
+    }
+
+    fprintf(stderr, "\n%-32s %12s %12s %12s %12s\n", "rep", "entries", "iterations", "incl ms", "excl ms");
+    for (size_t i = 0; i < profile_entry_count; i++) {
+        ProfileEntry *e = &profile_entries[order[i]];
+        if (e->kind != PROFILE_REP) continue;
+        profile_name(e, name, sizeof(name));
+        fprintf(stderr, "%-32s %12zu %12zu %12.3f %12.3f\n", name, e->count, e->iterations, e->inclusive / 1e6, e->exclusive / 1e6);
+    }
+
+    fprintf(stderr, "\n%-8s %12s\n", "line", "hits");
+    for (int line = 1; line <= program->line_count; line++) {
+        if (line_hits[line])
+            fprintf(stderr, "%-8d %12zu\n", line, line_hits[line]);
+    }
+    free(order);
+
+    FILE *f = fopen(profile_stacks_path, "w");
+    if (!f) {
+        perror(profile_stacks_path);
+        return;
+    }
+    char *path = NULL;
+    size_t capacity = 0;
+    write_stacks(f, 0, &path, &capacity, 0);
+    free(path);
+    fclose(f);
+    fprintf(stderr, "\nCollapsed stacks written to %s\n", profile_stacks_path);
+}
+
+void interpret_tokens(Token tokens[], size_t start, size_t end);
+void run_bytecode(Function *func, Value *args);
+
+/*
+ * Memo tables for pure functions. Every thread has its own table per pure
+ * function, direct-mapped on a hash of the arguments: an entry holds its
+ * state, the result and the arguments the result was computed from, and a
+ * call whose arguments land on a taken entry replaces it. hits and misses
+ * count this thread's lookups until memo_merge adds them to the function.
+ */
+enum { MEMO_EMPTY, MEMO_VALUE, MEMO_NO_VALUE };
+
+/* Entries per memo table, a power of two. */
+size_t memo_size = MEMO_SIZE;
+
+/* Which of the program's memo_tables this thread uses: 0, or a prep worker's number. */
+_Thread_local size_t memo_slot = 0;
+
+/* Makes sure the program has sets of memo tables for slots threads. */
+void memo_reserve(size_t slots) {
+    if (slots <= program->memo_slots) return;
+    program->memo_tables = realloc(program->memo_tables, slots * sizeof(MemoTable *));
+    if (!program->memo_tables) {
+        fail_errno("realloc");
+    }
+    memset(program->memo_tables + program->memo_slots, 0, (slots - program->memo_slots) * sizeof(MemoTable *));
+    program->memo_slots = slots;
+}
+
+/* This thread's memo tables for the program. */
+MemoTable *memo_tables(void) {
+    memo_reserve(memo_slot + 1);
+    MemoTable **tables = &program->memo_tables[memo_slot];
+    if (!*tables) {
+        *tables = calloc(program->memo_count, sizeof(MemoTable));
+        if (!*tables) {
+            fail_errno("calloc");
+        }
+    }
+    return *tables;
+}
+
+/* The entry of table, func's, that a call with args maps to. */
+Value *memo_entry(MemoTable *table, Function *func, const Value *args) {
+    size_t stride = func->param_count + 2;
+    if (!table->entries) {
+        table->entries = calloc(memo_size * stride, sizeof(Value));
+        if (!table->entries) {
+            fail_errno("calloc");
+        }
+    }
+
+    unsigned long long hash = func->param_count;
+    for (size_t p = 0; p < func->param_count; p++) {
+        hash = (hash ^ args[p]) * 0x9E3779B97F4A7C15ULL;
+        hash ^= hash >> 32;
+    }
+    return &table->entries[(hash & (memo_size - 1)) * stride];
+}
+
+/*
+ * Whether a call with args can be remembered. Arrays and maps can change,
+ * and go away when their run ends, so calls given one are not.
+ */
+int memoizable(Function *func, const Value *args) {
+    for (size_t p = 0; p < func->param_count; p++) {
+        if (is_array(args[p]) || is_map(args[p])) return 0;
+    }
+    return 1;
+}
+
+/* Sets the result of func's call with args and returns 1 if it is in the table. */
+int memo_lookup(Function *func, const Value *args) {
+    if (!memoizable(func, args)) return 0;
+    MemoTable *table = &memo_tables()[func->memo];
+    Value *entry = memo_entry(table, func, args);
+
+    if (entry[0] == MEMO_EMPTY || memcmp(&entry[2], args, func->param_count * sizeof(Value)) != 0) {
+        table->misses++;
+        return 0;
+    }
+    table->hits++;
+    return_value = entry[1];
+    has_return_value = entry[0] == MEMO_VALUE;
+    return 1;
+}
+
+/*
+ * Remembers func's call with args until it returns, for a call the VM runs
+ * without recursing, and returns what its CallFrame's memo is set to.
+ */
+size_t memo_push(Function *func, const Value *args) {
+    memo_calls = grow_array(memo_calls, &memo_call_capacity, memo_call_top + 1, sizeof(MemoCall));
+    memo_calls[memo_call_top].func = func;
+    memcpy(memo_calls[memo_call_top].args, args, func->param_count * sizeof(Value));
+    return ++memo_call_top;
+}
+
+/* Records the result func's call with args just returned, unless an array or a map is involved. */
+void memo_store(Function *func, const Value *args) {
+    if (!memoizable(func, args) || is_array(return_value) || is_map(return_value)) return;
+    Value *entry = memo_entry(&memo_tables()[func->memo], func, args);
+    entry[0] = has_return_value ? MEMO_VALUE : MEMO_NO_VALUE;
+    entry[1] = return_value;
+    memcpy(&entry[2], args, func->param_count * sizeof(Value));
+}
+
+/* Adds this thread's hit and miss counts to the functions' totals. */
+void memo_merge(void) {
+    if (memo_slot >= program->memo_slots || !program->memo_tables[memo_slot]) return;
+    MemoTable *tables = program->memo_tables[memo_slot];
+
+    for (size_t i = 0; i < program->function_count; i++) {
+        Function *func = program->functions[i];
+        if (!func->pure) continue;
+        func->memo_hits += tables[func->memo].hits;
+        func->memo_misses += tables[func->memo].misses;
+        tables[func->memo].hits = tables[func->memo].misses = 0;
+    }
+}
+
+/* Frees every memo table of the program. */
+void memo_free(void) {
+    for (size_t slot = 0; slot < program->memo_slots; slot++) {
+        MemoTable *tables = program->memo_tables[slot];
+        if (!tables) continue;
+        for (size_t i = 0; i < program->memo_count; i++) {
+            free(tables[i].entries);
+        }
+        free(tables);
+    }
+    free(program->memo_tables);
+}
+
+/*
+ * prep loops. The iterations of a prep loop are split into at most
+ * PREP_CHUNKS chunks, a split that depends only on the iteration count.
+ * Each chunk runs on a fresh copy of the variables the loop started with,
+ * collects its own output and leaves one result per reduction behind. Once
+ * every chunk is done, the thread that started the loop writes out their
+ * output and folds their results in chunk order, so a prep loop behaves
+ * the same however many threads ran it and in whatever order.
+ */
+typedef struct PrepJob PrepJob;
+
+#ifdef KINNIE_THREADS
+/*
+ * The chunks a thread has yet to run, [next, end). Its owner takes them
+ * from the front; threads that run out of their own steal from the back.
+ */
+typedef struct {
+    pthread_mutex_t lock;
+    size_t next;
+    size_t end;
+} PrepQueue;
+#endif
+
+/*
+ * One run of a prep loop in program. The walker runs tokens[start, end)
+ * over a copy of vars and bytecode runs func from body over a copy of
+ * frame; counter and the reductions' slots index those copies. results
+ * holds reduction_count values per chunk, and statements collects the
+ * worker threads' counts. When the loop runs inside a C API call, recover
+ * is set, and a chunk that fails leaves its message in error instead of
+ * ending the program.
+ */
+struct PrepJob {
+    Program *program;
+    void (*run_chunk)(PrepJob *job, size_t chunk);
+    long long iterations;
+    long long chunk_size;
+    size_t chunk_count;
+    int counter;
+    const Reduction *reductions;
+    int reduction_count;
+    Value *results;
+    char **outputs;
+    size_t *output_lengths;
+    Token *tokens;
+    size_t start;
+    size_t end;
+    Variable *vars;
+    size_t var_count;
+    Function *func;
+    size_t body;
+    Value *frame;
+#ifdef KINNIE_THREADS
+    PrepQueue *queues;
+#endif
+    size_t statements;
+    int recover;
+    int failed;
+    char error[FAIL_MESSAGE_SIZE];
+};
+
+/* Threads running prep loops, the main thread included; 0 for one per CPU. */
+size_t prep_threads = 0;
+
+/* Set while this thread runs a chunk. A prep loop inside one runs in order. */
+_Thread_local int in_prep = 0;
+
+/*
+ * Output is written out when the program exits, unless the exit comes from
+ * inside a prep chunk, whose output is not part of the program's yet.
+ */
+void out_flush_at_exit(void) {
+    if (!in_prep) out_flush();
+}
+
+/* Empties this thread's stacks after a failure left calls on them. */
+void reset_runtime(void) {
+    scope_depth = 0;
+    walker_var_count = 0;
+    call_depth = 0;
+    jit_depth = 0;
+    vm_sp = 0;
+    vm_frame_top = 0;
+    vm_call_top = 0;
+    memo_call_top = 0;
+    tail_function = NULL;
+    is_returning = 0;
+    has_return_value = 0;
+    in_prep = 0;
+}
+
+/* Reduction kinds as written in a prep header, in ReduceKind order. */
+const char *reduction_names[] = { "sum", "min", "max", "count" };
+
+#ifdef KINNIE_THREADS
+pthread_mutex_t prep_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t prep_wake = PTHREAD_COND_INITIALIZER;
+pthread_cond_t prep_idle = PTHREAD_COND_INITIALIZER;
+pthread_mutex_t prep_owner = PTHREAD_MUTEX_INITIALIZER;
+PrepJob *prep_job = NULL;
+unsigned long prep_generation = 0;
+size_t prep_busy = 0;
+int prep_pool_started = 0;
+#endif
+
+/*
+ * Parses the reductions of a prep header from tokens[*idx] on, each a kind
+ * (sum, min, max or count) followed by a variable name, and returns how many
+ * there are.
+ */
+int parse_reductions(Token tokens[], size_t *idx, int counter, Reduction *reductions) {
+    int count = 0;
+
+    while (tokens[*idx].type == TOK_IDENT) {
+        const char *kind = symbol_name(tokens[*idx].symbol);
+        int k = 0;
+        while (k < 4 && strcmp(kind, reduction_names[k]) != 0) k++;
+
+        if (k == 4) {
+            fail("Unknown reduction: %s\n", kind);
+        }
+        if (tokens[*idx + 1].type != TOK_IDENT) {
+            fail("Expected variable name after '%s'\n", kind);
+        }
+        if (tokens[*idx + 1].symbol == counter) {
+            fail("Loop counter %s cannot be a reduction\n", symbol_name(counter));
+        }
+        if (count == MAX_REDUCTIONS) {
+            fail("Too many reductions\n");
+        }
+
+        reductions[count].kind = k;
+        reductions[count].name = tokens[*idx + 1].symbol;
+        reductions[count].slot = 0;
+        count++;
+        *idx += 2;
+    }
+    return count;
+}
+
+/*
+ * What a reduction variable holds at the start of a chunk. A count variable
+ * is reset to 0 before every iteration instead, and counts the iterations
+ * that leave it true.
+ */
+Value reduction_start(ReduceKind kind) {
+    if (kind == REDUCE_MIN) return make_double(INFINITY);
+    if (kind == REDUCE_MAX) return make_double(-INFINITY);
+    return make_int(0);
+}
+
+void prep_return_error(void) {
+    fail("Cannot use 'ret' inside prep\n");
+}
+
+/* The iterations of chunk, [*first, *last). */
+void prep_range(PrepJob *job, size_t chunk, long long *first, long long *last) {
+    *first = (long long)chunk * job->chunk_size;
+    *last = job->iterations - *first > job->chunk_size ? *first + job->chunk_size : job->iterations;
+}
+
+/* Runs one chunk with its output going to a buffer of its own. */
+void prep_chunk(PrepJob *job, size_t chunk) {
+    char *buffer = out_buffer;
+    size_t length = out_length;
+    size_t capacity = out_capacity;
+    int newline = out_newline;
+    FlushPolicy policy = flush_policy;
+    int nested = in_prep;
+    Array *made = arrays;
+    Map *made_maps = maps;
+    const void *owner = map_owner;
+    jmp_buf *outer = fail_target;
+    jmp_buf target;
+
+    /* A failing chunk gives the output buffer back before passing the error on. */
+    if (outer) {
+        if (setjmp(target)) {
+            free_arrays(made);
+            free_maps(made_maps);
+            map_owner = owner;
+            free(out_buffer);
+            out_buffer = buffer;
+            out_length = length;
+            out_capacity = capacity;
+            out_newline = newline;
+            flush_policy = policy;
+            in_prep = nested;
+            fail_target = outer;
+            longjmp(*outer, 1);
+        }
+        fail_target = &target;
+    }
+
+    out_capacity = 256;
+    out_buffer = malloc(out_capacity);
+    if (!out_buffer) {
+        fail_errno("malloc");
+    }
+    out_length = 0;
+    flush_policy = FLUSH_EXIT;
+    in_prep = 1;
+    map_owner = job;
+
+    job->run_chunk(job, chunk);
+    free_arrays(made);
+    free_maps(made_maps);
+    map_owner = owner;
+
+    job->outputs[chunk] = out_buffer;
+    job->output_lengths[chunk] = out_length;
+    out_buffer = buffer;
+    out_length = length;
+    out_capacity = capacity;
+    out_newline = newline;
+    flush_policy = policy;
+    in_prep = nested;
+    fail_target = outer;
+}
+
+#ifdef KINNIE_THREADS
+int prep_take(PrepJob *job, size_t self, size_t *chunk) {
+    for (size_t n = 0; n < prep_threads; n++) {
+        PrepQueue *queue = &job->queues[(self + n) % prep_threads];
+        pthread_mutex_lock(&queue->lock);
+        int found = queue->next < queue->end;
+        if (found) *chunk = n == 0 ? queue->next++ : --queue->end;
+        pthread_mutex_unlock(&queue->lock);
+        if (found) return 1;
+    }
+    return 0;
+}
+
+void prep_work(PrepJob *job, size_t self) {
+    size_t chunk;
+    while (prep_take(job, self, &chunk)) prep_chunk(job, chunk);
+}
+
+/* Keeps the first failure's message and stops every thread from taking more chunks. */
+void prep_failed(PrepJob *job) {
+    pthread_mutex_lock(&prep_lock);
+    if (!job->failed) {
+        job->failed = 1;
+        memcpy(job->error, fail_message, sizeof(job->error));
+    }
+    pthread_mutex_unlock(&prep_lock);
+
+    for (size_t t = 0; t < prep_threads; t++) {
+        pthread_mutex_lock(&job->queues[t].lock);
+        job->queues[t].next = job->queues[t].end;
+        pthread_mutex_unlock(&job->queues[t].lock);
+    }
+}
+
+/* Runs chunks of job until there are none left, or one fails. */
+void prep_work_recovering(PrepJob *job, size_t self) {
+    jmp_buf *outer = fail_target;
+    jmp_buf target;
+
+    if (setjmp(target)) {
+        fail_target = outer;
+        prep_failed(job);
+        return;
+    }
+    fail_target = &target;
+    prep_work(job, self);
+    fail_target = outer;
+}
+
+void *prep_worker(void *arg) {
+    size_t self = (size_t)arg;
+    unsigned long seen = 0;
+
+    memo_slot = self;
+    for (;;) {
+        pthread_mutex_lock(&prep_lock);
+        while (prep_generation == seen) pthread_cond_wait(&prep_wake, &prep_lock);
+        seen = prep_generation;
+        PrepJob *job = prep_job;
+        pthread_mutex_unlock(&prep_lock);
+
+        program = job->program;
+        statement_count = 0;
+        if (job->recover) {
+            prep_work_recovering(job, self);
+            reset_runtime();
+        } else {
+            prep_work(job, self);
+        }
+
+        pthread_mutex_lock(&prep_lock);
+        job->statements += statement_count;
+        memo_merge();
+        if (--prep_busy == 0) pthread_cond_signal(&prep_idle);
+        pthread_mutex_unlock(&prep_lock);
+    }
+    return NULL;
+}
+
+/* Starts the worker threads on first use and returns how many threads run prep loops. */
+size_t prep_pool(void) {
+    if (prep_pool_started) return prep_threads;
+    prep_pool_started = 1;
+
+    if (!prep_threads) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        prep_threads = cpus > 1 ? (size_t)cpus : 1;
+    }
+    for (size_t t = 1; t < prep_threads; t++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, prep_worker, (void *)t) != 0) {
+            prep_threads = t;
+            break;
+        }
+        pthread_detach(thread);
+    }
+    return prep_threads;
+}
+
+/* Runs job's chunks on every thread, this one included. */
+void prep_parallel(PrepJob *job) {
+    if (program->memo_count) memo_reserve(prep_threads);
+
+    job->queues = malloc(prep_threads * sizeof(PrepQueue));
+    if (!job->queues) {
+        fail_errno("malloc");
+    }
+    for (size_t t = 0; t < prep_threads; t++) {
+        pthread_mutex_init(&job->queues[t].lock, NULL);
+        job->queues[t].next = job->chunk_count * t / prep_threads;
+        job->queues[t].end = job->chunk_count * (t + 1) / prep_threads;
+    }
+
+    /* An iteration that fails exits from its own thread, without this buffer. */
+    if (flush_policy != FLUSH_EXIT) out_flush();
+
+    pthread_mutex_lock(&prep_lock);
+    prep_job = job;
+    prep_generation++;
+    prep_busy = prep_threads - 1;
+    pthread_cond_broadcast(&prep_wake);
+    pthread_mutex_unlock(&prep_lock);
+
+    if (job->recover)
+        prep_work_recovering(job, 0);
+    else
+        prep_work(job, 0);
+
+    pthread_mutex_lock(&prep_lock);
+    while (prep_busy) pthread_cond_wait(&prep_idle, &prep_lock);
+    pthread_mutex_unlock(&prep_lock);
+
+    for (size_t t = 0; t < prep_threads; t++) {
+        pthread_mutex_destroy(&job->queues[t].lock);
+    }
+    free(job->queues);
+}
+#endif
+
+void prep_free(PrepJob *job) {
+    free(job->results);
+    free(job->outputs);
+    free(job->output_lengths);
+    free(job->vars);
+    free(job->frame);
+}
+
+/*
+ * Runs every chunk of job, in parallel unless this thread is already
+ * running a chunk or --profile is on, and writes out their output.
+ */
+void prep_run(PrepJob *job) {
+    jmp_buf *outer = fail_target;
+    jmp_buf target;
+
+    job->chunk_size = (job->iterations + PREP_CHUNKS - 1) / PREP_CHUNKS;
+    job->chunk_count = job->chunk_size ? (job->iterations + job->chunk_size - 1) / job->chunk_size : 0;
+    job->results = malloc((job->chunk_count * job->reduction_count + 1) * sizeof(Value));
+    job->outputs = calloc(job->chunk_count + 1, sizeof(char *));
+    job->output_lengths = malloc((job->chunk_count + 1) * sizeof(size_t));
+    job->statements = 0;
+    job->program = program;
+    job->recover = fail_target != NULL;
+    job->failed = 0;
+    if (!job->results || !job->outputs || !job->output_lengths) {
+        fail_errno("malloc");
+    }
+
+    /* Inside a C API call, a failure frees the job on its way out. */
+    if (outer) {
+        if (setjmp(target)) {
+            fail_target = outer;
+            for (size_t chunk = 0; chunk < job->chunk_count; chunk++) {
+                free(job->outputs[chunk]);
+            }
+            prep_free(job);
+            longjmp(*outer, 1);
+        }
+        fail_target = &target;
+    }
+
+    int parallel = 0;
+#ifdef KINNIE_THREADS
+    /* The pool runs one loop at a time; a loop started meanwhile by another thread runs in order. */
+    if (!in_prep && !profiling && job->chunk_count > 1 && pthread_mutex_trylock(&prep_owner) == 0) {
+        parallel = prep_pool() > 1;
+        if (parallel) prep_parallel(job);
+        pthread_mutex_unlock(&prep_owner);
+        if (job->failed) fail("%s", job->error);
+    }
+#endif
+    if (!parallel) {
+        for (size_t chunk = 0; chunk < job->chunk_count; chunk++) {
+            prep_chunk(job, chunk);
+        }
+    }
+    statement_count += job->statements;
+
+    for (size_t chunk = 0; chunk < job->chunk_count; chunk++) {
+        out_text(job->outputs[chunk], job->output_lengths[chunk]);
+        free(job->outputs[chunk]);
+        job->outputs[chunk] = NULL;
+    }
+    out_end();
+
+    for (int r = 0; r < job->reduction_count; r++) {
+        for (size_t chunk = 0; chunk < job->chunk_count; chunk++) {
+            if (!is_number(job->results[chunk * job->reduction_count + r])) number_error(job->reductions[r].name);
+        }
+    }
+    fail_target = outer;
+}
+
+/* Folds every chunk's result for reduction r, all numbers by now, into total in chunk order. */
+Value prep_reduce(PrepJob *job, int r, Value total) {
+    const Reduction *reduction = &job->reductions[r];
+
+    for (size_t chunk = 0; chunk < job->chunk_count; chunk++) {
+        Value part = job->results[chunk * job->reduction_count + r];
+
+        if (reduction->kind == REDUCE_MIN) {
+            if (number_value(part) < number_value(total)) total = part;
+        } else if (reduction->kind == REDUCE_MAX) {
+            if (number_value(part) > number_value(total)) total = part;
+        } else {
+            total = arithmetic(OP_ADD, total, part);
+        }
+    }
+    return total;
+}
+
+/* Runs one chunk of a prep loop in the walker, inside a function scope of its own. */
+void prep_walk_chunk(PrepJob *job, size_t chunk) {
+    long long first, last;
+    long long counts[MAX_REDUCTIONS] = {0};
+    prep_range(job, chunk, &first, &last);
+
+    push_scope(1);
+    size_t base = walker_var_count;
+    for (size_t v = 0; v < job->var_count; v++) {
+        *declare_var(job->vars[v].name) = job->vars[v];
+    }
+    for (int r = 0; r < job->reduction_count; r++) {
+        walker_vars[base + job->reductions[r].slot].value = reduction_start(job->reductions[r].kind);
+    }
+
+    for (long long k = first; k < last; k++) {
+        walker_vars[base + job->counter].value = make_int(k);
+        for (int r = 0; r < job->reduction_count; r++) {
+            if (job->reductions[r].kind == REDUCE_COUNT)
+                walker_vars[base + job->reductions[r].slot].value = make_int(0);
+        }
+
+        push_scope(0);
+        interpret_tokens(job->tokens, job->start, job->end);
+        pop_scope();
+        if (is_returning) prep_return_error();
+
+        for (int r = 0; r < job->reduction_count; r++) {
+            Value v = walker_vars[base + job->reductions[r].slot].value;
+            if (job->reductions[r].kind != REDUCE_COUNT) continue;
+            if (!is_number(v)) number_error(job->reductions[r].name);
+            if (is_true(v)) counts[r]++;
+        }
+    }
+
+    for (int r = 0; r < job->reduction_count; r++) {
+        Value v = walker_vars[base + job->reductions[r].slot].value;
+        job->results[chunk * job->reduction_count + r] = job->reductions[r].kind == REDUCE_COUNT ? make_int(counts[r]) : v;
+    }
+    pop_scope();
+}
+
+/*
+ * Runs a prep loop over tokens[start, end) in the walker. Its chunks see
+ * copies of the variables of the enclosing function; only the counter,
+ * which ends at the goal, and the reductions change in the original.
+ */
+void prep_walk(Token tokens[], size_t start, size_t end, int counter_name, Reduction *reductions, int reduction_count) {
+    size_t scope = scope_depth - 1;
+    while (!scope_stack[scope].is_function_boundary) scope--;
+    size_t first = scope_stack[scope].start;
+
+    Variable *counter = get_var(counter_name);
+    if (!counter) {
+        fail("Loop counter not found or not int: %s\n", symbol_name(counter_name));
+    }
+    for (int r = 0; r < reduction_count; r++) {
+        Variable *v = get_var(reductions[r].name);
+        if (!v) {
+            fail("Unknown variable: %s\n", symbol_name(reductions[r].name));
+        }
+        reductions[r].slot = v - &walker_vars[first];
+    }
+
+    PrepJob job;
+    memset(&job, 0, sizeof(job));
+    job.run_chunk = prep_walk_chunk;
+    job.counter = counter - &walker_vars[first];
+    Value goal = rep_start(&counter->value, counter_name);
+    job.iterations = int_of(goal);
+    job.reductions = reductions;
+    job.reduction_count = reduction_count;
+    for (int r = 0; r < reduction_count; r++) {
+        if (!is_number(walker_vars[first + reductions[r].slot].value)) number_error(reductions[r].name);
+    }
+
+    job.tokens = tokens;
+    job.start = start;
+    job.end = end;
+    job.var_count = walker_var_count - first;
+    job.vars = malloc((job.var_count + 1) * sizeof(Variable));
+    if (!job.vars) {
+        fail_errno("malloc");
+    }
+    memcpy(job.vars, &walker_vars[first], job.var_count * sizeof(Variable));
+
+    prep_run(&job);
+
+    walker_vars[first + job.counter].value = goal;
+    for (int r = 0; r < reduction_count; r++) {
+        Variable *v = &walker_vars[first + reductions[r].slot];
+        v->value = prep_reduce(&job, r, v->value);
+    }
+    prep_free(&job);
+}
+
+void call_function(Function *func, Value *args) {
+    /* args can live on vm_stack, so the key is copied out before the call. */
+    Function *memo_func = NULL;
+    Value key[MAX_FUNC_PARAMS];
+    if (func->pure) {
+        if (memo_lookup(func, args)) return;
+        memo_func = func;
+        memcpy(key, args, func->param_count * sizeof(Value));
+    }
+
+    size_t limit = use_token_walker && max_call_depth > MAX_CALL_DEPTH ? MAX_CALL_DEPTH : max_call_depth;
+    if (++call_depth > limit) {
+        fail("Call depth exceeded\n");
+    }
+
+    has_return_value = 0;
+    size_t mark = profiling ? profile_enter(PROFILE_FUNCTION, func->name) : 0;
+
+    if (!use_token_walker) {
+        run_bytecode(func, args);
+        if (profiling) profile_leave(mark);
+        call_depth--;
+        if (memo_func) memo_store(memo_func, key);
+        return;
+    }
+
+    push_scope(1);
+    
+    for (size_t i = 0; i < func->param_count; i++) {
+        set_var_value(func->param_names[i], args[i]);
+    }
+    
+    interpret_tokens(func->tokens, 0, func->token_count);
+
+    /* A 'ret f(...)' replaces this call's scope instead of nesting. */
+    while (tail_function) {
+        func = tail_function;
+        tail_function = NULL;
+        if (func->pure) {
+            if (memo_lookup(func, tail_args)) break;
+            if (!memo_func) {
+                memo_func = func;
+                memcpy(key, tail_args, func->param_count * sizeof(Value));
+            }
+        }
+        is_returning = 0;
+        has_return_value = 0;
+        pop_scope();
+        push_scope(1);
+
+        for (size_t i = 0; i < func->param_count; i++) {
+            set_var_value(func->param_names[i], tail_args[i]);
+        }
+        if (profiling) mark = profile_replace(mark, func->name);
+
+        interpret_tokens(func->tokens, 0, func->token_count);
+    }
+
+    if (!is_returning) has_return_value = 0;
+    is_returning = 0;
+    pop_scope();
+    if (profiling) profile_leave(mark);
+    call_depth--;
+    if (memo_func) memo_store(memo_func, key);
+}
+
+/*
+ * Runs tokens[start, end) in place. Nested blocks are executed as sub-ranges
+ * of the same array, bounded by the offsets from match_blocks.
+ */
+void interpret_tokens(Token tokens[], size_t start, size_t end) {
+    size_t i = start;
+    while (i < end && tokens[i].type != TOK_EOF) {
+        statement_count++;
+        if (profiling) line_hits[program->token_lines[&tokens[i] - program->tokens]]++;
+
+        if (tokens[i].type == TOK_VAR || (tokens[i].type == TOK_IDENT && tokens[i + 1].type == TOK_ASSIGN)) {
+            if (tokens[i].type == TOK_VAR) i++;
+            int name = tokens[i].symbol;
+            i += 2;
+            
+            if (is_whole_call(tokens, i)) {
+                int func_name = tokens[i].symbol;
+                Value args[MAX_FUNC_PARAMS];
+                size_t arg_count = evaluate_arguments(tokens, &i, args);
+                
+                call_named(func_name, args, arg_count);
+                
+                if (has_return_value) {
+                    set_var_value(name, return_value);
+                } else {
+                    fail("Function %s did not return a value\n", symbol_name(func_name));
+                }
+                
+                continue;
+            }
+            
+            if (tokens[i].type == TOK_STRING) {
+                set_var_value(name, make_string(tokens[i].string));
+                i++;
+            } else {
+                set_var_value(name, evaluate_value(tokens, &i));
+            }
+            continue;
+        }
+
+        if (tokens[i].type == TOK_IDENT && tokens[i + 1].type == TOK_LBRACKET) {
+            int func_name = tokens[i].symbol;
+            Value args[MAX_FUNC_PARAMS];
+            size_t arg_count = evaluate_arguments(tokens, &i, args);
+            
+            call_named(func_name, args, arg_count);
+            continue;
+        }
+
+        if (tokens[i].type == TOK_IDENT && tokens[i + 1].type == TOK_LSQUARE) {
+            int name = tokens[i].symbol;
+            Value index = evaluate_index(tokens, &i);
+            if (tokens[i].type != TOK_ASSIGN) {
+                fail("Expected '=' after ']'\n");
+            }
+            i++;
+
+            Value value = evaluate_value(tokens, &i);
+            store_index(get_var(name)->value, index, value, name);
+            continue;
+        }
+
+        if (tokens[i].type == TOK_PRINT) {
+            i++;
+            
+            if (tokens[i].type == TOK_STRING) {
+                print_text(pool_text(tokens[i].string), 1);
+                out_end();
+                i++;
+                continue;
+            }
+            
+            if (tokens[i].type == TOK_IDENT && ends_operand(tokens[i + 1].type)) {
+                Variable *v = get_var(tokens[i].symbol);
+                if (v && !is_number(v->value)) {
+                    if (is_string(v->value))
+                        print_text(pool_text(string_of(v->value)), 0);
+                    else
+                        out_value(v->value);
+                    out_end();
+                    i++;
+                    continue;
+                }
+            }
+            
+            out_value(evaluate_expression(tokens, &i));
+            out_end();
+
+            continue;
+        }
+
+        if (tokens[i].type == TOK_IF_START) {
+            size_t if_pos = i;
+            i++;
+
+            int condition_met = is_true(evaluate_expression(tokens, &i));
+            if (tokens[i].type != TOK_LBRACE) {
+                fail("Expected '{' after if condition\n");
+            }
+            i++;
+
+            size_t block_start = i;
+            size_t block_end = block_start - 1 + tokens[block_start - 1].jump;
+
+            if (condition_met) {
+                push_scope(0);
+                interpret_tokens(tokens, block_start, block_end);
+                pop_scope();
+                if (is_returning) return;
+            }
+            
+            i = block_end + 1;
+
+            if (tokens[if_pos].jump) {
+                i = if_pos + tokens[if_pos].jump + 1;
+                
+                if (tokens[i].type != TOK_LBRACE) {
+                    fail("Expected '{' after else\n");
+                }
+                i++;
+
+                size_t else_start = i;
+                size_t else_end = else_start - 1 + tokens[else_start - 1].jump;
+
+                if (!condition_met) {
+                    push_scope(0);
+                    interpret_tokens(tokens, else_start, else_end);
+                    pop_scope();
+                    if (is_returning) return;
+                }
+                
+                i = else_end + 1;
+            }
+
+            continue;
+        }
+
+        if (tokens[i].type == TOK_LOOP_START) {
+            i++;
+            
+            int counter_name = tokens[i].symbol;
+            i++;
+            
+            Variable *counter_var = get_var(counter_name);
+            if (!counter_var) {
+                fail("Loop counter not found or not int: %s\n", symbol_name(counter_name));
+            }
+
+            size_t counter = counter_var - walker_vars;
+            
+            if (tokens[i].type != TOK_LBRACE) {
+                fail("Expected '{' after repeat\n");
+            }
+            i++;
+
+            size_t loop_start = i;
+            size_t loop_end = loop_start - 1 + tokens[loop_start - 1].jump;
+
+            Value goal = rep_start(&counter_var->value, counter_name);
+            size_t mark = profiling ? profile_enter(PROFILE_REP, &tokens[loop_start - 3] - program->tokens) : 0;
+            
+            if (tokens[loop_start - 3].jump) {
+                /*
+                 * The body never assigns the counter, so it is kept in a
+                 * local and only stored for the body to read. Instead of a
+                 * scope per iteration, anything the body declares lands in
+                 * the enclosing scope and is dropped again afterwards; a
+                 * name is only declared when no visible variable has it, so
+                 * lookups find the same variables either way.
+                 */
+                Scope *scope = &scope_stack[scope_depth - 1];
+                size_t var_count = scope->var_count;
+                long long n = int_of(goal);
+
+                for (long long k = 0; k < n; k++) {
+                    if (profiling) profile_iteration();
+                    walker_vars[counter].value = make_int(k);
+                    interpret_tokens(tokens, loop_start, loop_end);
+                    if (is_returning) return;
+
+                    scope = &scope_stack[scope_depth - 1];
+                    if (scope->var_count != var_count) {
+                        scope->var_count = var_count;
+                        walker_var_count = scope->start + var_count;
+                    }
+                }
+                walker_vars[counter].value = goal;
+            } else {
+                while (rep_continues(walker_vars[counter].value, goal)) {
+                    if (profiling) profile_iteration();
+                    push_scope(0);
+                    interpret_tokens(tokens, loop_start, loop_end);
+                    pop_scope();
+                    if (is_returning) return;
+                    rep_step(&walker_vars[counter].value);
+                }
+            }
+            if (profiling) profile_leave(mark);
+            
+            i = loop_end + 1;
+            continue;
+        }
+
+        if (tokens[i].type == TOK_PREP_START) {
+            i++;
+
+            int counter_name = tokens[i].symbol;
+            i++;
+
+            Reduction reductions[MAX_REDUCTIONS];
+            int reduction_count = parse_reductions(tokens, &i, counter_name, reductions);
+
+            if (tokens[i].type != TOK_LBRACE) {
+                fail("Expected '{' after prep\n");
+            }
+            i++;
+
+            size_t body = i;
+            size_t body_end = body - 1 + tokens[body - 1].jump;
+            prep_walk(tokens, body, body_end, counter_name, reductions, reduction_count);
+
+            i = body_end + 1;
+            continue;
+        }
+
+        if (tokens[i].type == TOK_RETURN) {
+            i++;
+            
+            if (tokens[i].type == TOK_STRING) {
+                return_value = make_string(tokens[i].string);
+                has_return_value = 1;
+                i++;
+            } else if (is_whole_call(tokens, i)) {
+                /* A tail call: call_function runs it once this frame is gone. A built-in runs right away. */
+                int func_name = tokens[i].symbol;
+                int builtin = find_builtin(func_name);
+                Value args[MAX_FUNC_PARAMS];
+                size_t arg_count = evaluate_arguments(tokens, &i, args);
+
+                if (builtin >= 0) {
+                    call_builtin(builtin, args, arg_count);
+                } else {
+                    memcpy(tail_args, args, arg_count * sizeof(Value));
+                    tail_function = resolve_function(func_name, arg_count);
+                }
+            } else {
+                return_value = evaluate_value(tokens, &i);
+                has_return_value = 1;
+            }
+            
+            is_returning = 1;
+            return;
+        }
+
+        if (tokens[i].type == TOK_END) {
+            is_returning = 1;
+            return;
+        }
+
+        fail("Unknown command at position %zu, token type: %d\n", i, tokens[i].type);
+    }
+}
+
+/*
+ * A pure function's result depends only on its arguments, which is what
+ * lets its calls be memoized: it cannot print, and every function it calls
+ * has to be pure as well. Functions cannot see their callers' variables,
+ * so that is all there is to check.
+ */
+void check_pure(Function *func) {
+    Token *tokens = func->tokens;
+
+    for (size_t i = 0; i < func->token_count; i++) {
+        if (tokens[i].type == TOK_PRINT) {
+            fail("Pure function %s cannot use 'out'\n", symbol_name(func->name));
+        }
+        if (tokens[i].type == TOK_IDENT && tokens[i + 1].type == TOK_LBRACKET) {
+            Function *callee = get_function(tokens[i].symbol);
+            if (callee && !callee->pure) {
+                fail("Pure function %s calls %s, which is not pure\n",
+                     symbol_name(func->name), symbol_name(callee->name));
+            }
+        }
+    }
+}
+
+void parse_functions(Token tokens[], size_t token_count) {
+    size_t i = 0;
+
+    while (i < token_count && tokens[i].type != TOK_EOF) {
+        int pure = tokens[i].type == TOK_PURE;
+        if (pure) {
+            i++;
+            if (tokens[i].type != TOK_FUN_START) {
+                fail("Expected 'fun' after 'pure'\n");
+            }
+        }
+
+        if (tokens[i].type == TOK_FUN_START) {
+            i++;
+            
+            if (tokens[i].type != TOK_IDENT) {
+                fail("Expected function name after 'fun'\n");
+            }
+
+            Function *func = arena_alloc(&program->arena, sizeof(Function));
+            memset(func, 0, sizeof(Function));
+            func->name = tokens[i].symbol;
+            if (pure) {
+                func->pure = 1;
+                func->memo = program->memo_count++;
+            }
+            i++;
+
+            if (tokens[i].type == TOK_LBRACKET) {
+                i++;
+                
+                while (tokens[i].type != TOK_RBRACKET && tokens[i].type != TOK_EOF) {
+                    if (tokens[i].type == TOK_IDENT) {
+                        if (func->param_count >= MAX_FUNC_PARAMS) {
+                            fail("Too many parameters\n");
+                        }
+                        func->param_names[func->param_count++] = tokens[i].symbol;
+                        i++;
+                        
+                        if (tokens[i].type == TOK_COMMA) {
+                            i++;
+                        }
+                    } else {
+                        fail("Expected parameter name\n");
+                    }
+                }
+                
+                if (tokens[i].type != TOK_RBRACKET) {
+                    fail("Expected ')' after parameters\n");
+                }
+                i++;
+            }
+
+            if (tokens[i].type != TOK_LBRACE) {
+                fail("Expected '{' after function signature\n");
+            }
+            i++;
+
+            size_t fun_start = i;
+            size_t fun_end = fun_start - 1 + tokens[fun_start - 1].jump;
+
+            func->tokens = &tokens[fun_start];
+            func->token_count = fun_end - fun_start;
+
+            program->functions = grow_array(program->functions, &program->function_capacity, program->function_count + 1, sizeof(Function *));
+            program->functions[program->function_count++] = func;
+            register_function(func);
+            i = fun_end + 1;
+            continue;
+        }
+        i++;
+    }
+
+    for (size_t f = 0; f < program->function_count; f++) {
+        if (program->functions[f]->pure) check_pure(program->functions[f]);
+    }
+}
+
+typedef struct {
+    int name;
+    int slot;
+} Binding;
+
+/*
+ * Compile-time view of a function: the instruction stream being built and
+ * the lexical scopes used to resolve every variable to a frame slot.
+ */
+typedef struct {
+    Function *func;
+    Binding *bindings;
+    size_t binding_count;
+    size_t binding_capacity;
+    size_t *scope_start;
+    size_t scope_count;
+    size_t scope_capacity;
+    size_t stack_depth;
+    Instr *code;
+    size_t code_capacity;
+    Value *constants;
+    size_t constant_capacity;
+    Segment *segments;
+    size_t segment_capacity;
+    CallSite *call_sites;
+    size_t call_site_capacity;
+    PrepLoop *preps;
+    size_t prep_capacity;
+} Compiler;
+
+int stack_effect(OpCode op, int b) {
+    switch (op) {
+        case OP_PUSH_NUM:
+        case OP_PUSH_STR:
+        case OP_LOAD:
+        case OP_LOAD_VALUE:
+        case OP_PUSH_RESULT:
+        case OP_PUSH_VALUE:
+        case OP_REP_INIT:
+            return 1;
+        case OP_STORE_INDEX:
+            return -2;
+        case OP_STORE_NUM:
+        case OP_ADD:
+        case OP_SUB:
+        case OP_MUL:
+        case OP_DIV:
+        case OP_MOD:
+        case OP_EQUALS:
+        case OP_NOT_EQUALS:
+        case OP_MORE:
+        case OP_LESS:
+        case OP_MORE_EQUALS:
+        case OP_LESS_EQUALS:
+        case OP_JUMP_IF_FALSE:
+        case OP_POP:
+        case OP_PRINT_NUM:
+        case OP_RETURN_NUM:
+            return -1;
+        case OP_CALL:
+        case OP_TAIL_CALL:
+        case OP_BUILTIN:
+            return -b;
+        default:
+            return 0;
+    }
+}
+
+size_t emit(Compiler *c, OpCode op, int a, int b) {
+    Function *func = c->func;
+    c->code = grow_array(c->code, &c->code_capacity, func->code_count + 1, sizeof(Instr));
+
+    c->code[func->code_count].op = op;
+    c->code[func->code_count].a = a;
+    c->code[func->code_count].b = b;
+
+    c->stack_depth += stack_effect(op, b);
+    if (c->stack_depth > func->max_stack)
+        func->max_stack = c->stack_depth;
+
+    return func->code_count++;
+}
+
+void patch_jump(Compiler *c, size_t at) {
+    c->code[at].b = c->func->code_count;
+}
+
+void expect_token(Token tokens[], size_t i, TokenType type, const char *message) {
+    if (tokens[i].type != type) {
+        fail("%s\n", message);
+    }
+}
+
+void begin_scope(Compiler *c) {
+    c->scope_start = grow_array(c->scope_start, &c->scope_capacity, c->scope_count + 1, sizeof(size_t));
+    c->scope_start[c->scope_count++] = c->binding_count;
+}
+
+void end_scope(Compiler *c) {
+    c->binding_count = c->scope_start[--c->scope_count];
+}
+
+int resolve_slot(Compiler *c, int name) {
+    for (size_t i = c->binding_count; i > 0; i--) {
+        if (c->bindings[i - 1].name == name)
+            return c->bindings[i - 1].slot;
+    }
+    return -1;
+}
+
+/*
+ * Assignments and 'var' reuse a visible variable of the same name and
+ * otherwise declare one in the innermost scope. Slots of finished blocks
+ * are handed out again, so a frame only needs as many slots as the deepest
+ * set of simultaneously live variables.
+ */
+int declare_slot(Compiler *c, int name) {
+    int slot = resolve_slot(c, name);
+    if (slot >= 0) return slot;
+
+    c->bindings = grow_array(c->bindings, &c->binding_capacity, c->binding_count + 1, sizeof(Binding));
+
+    slot = c->binding_count;
+    c->bindings[c->binding_count].name = name;
+    c->bindings[c->binding_count].slot = slot;
+    c->binding_count++;
+
+    if ((size_t)slot + 1 > c->func->slot_count)
+        c->func->slot_count = slot + 1;
+    return slot;
+}
+
+void compile_operand(Compiler *c, size_t *idx) {
+    Function *func = c->func;
+    Token *tok = &func->tokens[*idx];
+
+    if (is_literal(tok->type)) {
+        c->constants = grow_array(c->constants, &c->constant_capacity,
+                                  func->constant_count + 1, sizeof(Value));
+        c->constants[func->constant_count] = literal_value(tok);
+        emit(c, OP_PUSH_NUM, func->constant_count++, 0);
+    } else if (tok->type == TOK_IDENT) {
+        int slot = resolve_slot(c, tok->symbol);
+        if (slot < 0) {
+            emit(c, OP_UNKNOWN_VAR, *idx, 0);
+            c->stack_depth++;
+        } else {
+            emit(c, OP_LOAD, slot, *idx);
+        }
+    } else {
+        fail("Syntax error\n");
+    }
+    (*idx)++;
+}
+
+void compile_expression(Compiler *c, size_t *idx);
+void compile_call(Compiler *c, size_t *idx, OpCode op);
+
+void compile_value(Compiler *c, size_t *idx);
+
+/*
+ * Compiles the index after the array or map variable at tokens[*idx],
+ * leaving *idx after the ']', and returns the variable's slot.
+ */
+int compile_index(Compiler *c, size_t *idx) {
+    Token *tokens = c->func->tokens;
+    int slot = resolve_slot(c, tokens[*idx].symbol);
+    if (slot < 0) {
+        emit(c, OP_UNKNOWN_VAR, *idx, 0);
+        slot = 0;
+    }
+
+    *idx += 2;
+    compile_value(c, idx);
+    expect_token(tokens, *idx, TOK_RSQUARE, "Expected ']'");
+    (*idx)++;
+    return slot;
+}
+
+/* The counterpart of evaluate_value: a string, a variable or an index on its own is pushed whatever it is. */
+void compile_value(Compiler *c, size_t *idx) {
+    Token *tokens = c->func->tokens;
+
+    if (tokens[*idx].type == TOK_STRING && ends_operand(tokens[*idx + 1].type)) {
+        emit(c, OP_PUSH_STR, 0, *idx);
+        (*idx)++;
+        return;
+    }
+    if (tokens[*idx].type == TOK_IDENT && ends_operand(tokens[*idx + 1].type)) {
+        int slot = resolve_slot(c, tokens[*idx].symbol);
+        if (slot >= 0) {
+            emit(c, OP_LOAD_VALUE, slot, *idx);
+            (*idx)++;
+            return;
+        }
+    }
+    if (is_whole_index(tokens, *idx)) {
+        size_t name_idx = *idx;
+        emit(c, OP_INDEX_VALUE, compile_index(c, idx), name_idx);
+        return;
+    }
+    if (is_whole_call(tokens, *idx)) {
+        size_t name_idx = *idx;
+        compile_call(c, idx, OP_CALL);
+        emit(c, OP_PUSH_VALUE, 0, name_idx);
+        return;
+    }
+    compile_expression(c, idx);
+}
+
+/* An operand with any unary minus in front of it. */
+void compile_unary(Compiler *c, size_t *idx) {
+    Token *tokens = c->func->tokens;
+
+    if (tokens[*idx].type == TOK_MINUS) {
+        (*idx)++;
+        compile_unary(c, idx);
+        emit(c, OP_NEGATE, 0, 0);
+    } else if (tokens[*idx].type == TOK_LBRACKET) {
+        (*idx)++;
+        compile_expression(c, idx);
+        expect_token(tokens, *idx, TOK_RBRACKET, "Expected ')'");
+        (*idx)++;
+    } else if (tokens[*idx].type == TOK_IDENT && tokens[*idx + 1].type == TOK_LBRACKET) {
+        size_t name_idx = *idx;
+        compile_call(c, idx, OP_CALL);
+        emit(c, OP_PUSH_RESULT, 0, name_idx);
+    } else if (tokens[*idx].type == TOK_IDENT && tokens[*idx + 1].type == TOK_LSQUARE) {
+        size_t name_idx = *idx;
+        int slot = compile_index(c, idx);
+        emit(c, OP_INDEX, slot, name_idx);
+    } else {
+        compile_operand(c, idx);
+    }
+}
+
+/* Precedence climbing: compiles operators binding at least as tightly as min_precedence. */
+void compile_binary(Compiler *c, size_t *idx, int min_precedence) {
+    Token *tokens = c->func->tokens;
+    int precedence;
+
+    compile_unary(c, idx);
+
+    while ((precedence = binary_precedence(tokens[*idx].type)) >= min_precedence) {
+        TokenType op = tokens[*idx].type;
+        (*idx)++;
+
+        compile_binary(c, idx, precedence + 1);
+        emit(c, binary_op(op), 0, 0);
+    }
+}
+
+void compile_expression(Compiler *c, size_t *idx) {
+    compile_binary(c, idx, 1);
+}
+
+void compile_call(Compiler *c, size_t *idx, OpCode op) {
+    Token *tokens = c->func->tokens;
+    size_t name_idx = *idx;
+    size_t arg_count = 0;
+    *idx += 2;
+
+    while (tokens[*idx].type != TOK_RBRACKET && tokens[*idx].type != TOK_EOF) {
+        if (arg_count >= MAX_FUNC_PARAMS) {
+            fail("Too many arguments\n");
+        }
+
+        compile_value(c, idx);
+        arg_count++;
+
+        if (tokens[*idx].type == TOK_COMMA) {
+            (*idx)++;
+        }
+    }
+
+    expect_token(tokens, *idx, TOK_RBRACKET, "Expected ')'");
+    (*idx)++;
+
+    /* A built-in leaves its result like a call does; one in tail position is simply returned. */
+    int builtin = find_builtin(tokens[name_idx].symbol);
+    if (builtin >= 0) {
+        emit(c, OP_BUILTIN, builtin, arg_count);
+        if (op == OP_TAIL_CALL) emit(c, OP_RETURN_RESULT, 0, 0);
+        return;
+    }
+
+    Function *func = c->func;
+    c->call_sites = grow_array(c->call_sites, &c->call_site_capacity, func->call_site_count + 1, sizeof(CallSite));
+    c->call_sites[func->call_site_count].name = tokens[name_idx].symbol;
+    c->call_sites[func->call_site_count].target = NULL;
+    emit(c, op, func->call_site_count++, arg_count);
+}
+
+void compile_assignment(Compiler *c, size_t *idx, size_t name_idx) {
+    Token *tokens = c->func->tokens;
+
+    if (is_whole_call(tokens, *idx)) {
+        size_t func_idx = *idx;
+        compile_call(c, idx, OP_CALL);
+        emit(c, OP_STORE_RESULT, declare_slot(c, tokens[name_idx].symbol), func_idx);
+        return;
+    }
+
+    if (tokens[*idx].type == TOK_STRING) {
+        emit(c, OP_STORE_STR, declare_slot(c, tokens[name_idx].symbol), *idx);
+        (*idx)++;
+        return;
+    }
+
+    compile_value(c, idx);
+    emit(c, OP_STORE_NUM, declare_slot(c, tokens[name_idx].symbol), 0);
+}
+
+size_t add_segment(Compiler *c, int slot, size_t text, size_t length) {
+    Function *func = c->func;
+    c->segments = grow_array(c->segments, &c->segment_capacity, func->segment_count + 1, sizeof(Segment));
+
+    c->segments[func->segment_count].slot = slot;
+    c->segments[func->segment_count].text = text;
+    c->segments[func->segment_count].length = length;
+    return func->segment_count++;
+}
+
+/*
+ * Splits an 'out' string literal into literal text and variable references
+ * once, decoding \n escapes and resolving every {name} to a frame slot.
+ * Returns the index of the first segment; *count receives how many there are.
+ */
+size_t compile_interpolation(Compiler *c, size_t literal, size_t *count) {
+    size_t first = c->func->segment_count;
+    size_t j = 0;
+
+    while (program->string_pool[literal + j] != '\0') {
+        const char *str = program->string_pool + literal;
+
+        if (str[j] == '{') {
+            size_t name_start = ++j;
+            while (str[j] != '}' && str[j] != '\0') j++;
+
+            if (str[j] != '}') {
+                fail("Missing closing '}' in string interpolation\n");
+            }
+
+            int name = find_symbol(str + name_start, j - name_start);
+            int slot = name < 0 ? -1 : resolve_slot(c, name);
+            add_segment(c, slot < 0 ? SEGMENT_UNKNOWN : slot, literal + name_start, j - name_start);
+            j++;
+            continue;
+        }
+
+        size_t run_start = j;
+        while (str[j] != '\0' && str[j] != '{') j++;
+
+        /* Reserve first: growing string_pool moves the literal along with it. */
+        program->string_pool = grow_array(program->string_pool, &program->string_pool_capacity,
+                                 program->string_pool_size + sizeof(size_t) + (j - run_start) + 1, 1);
+        size_t text = pool_string(program->string_pool + literal + run_start, j - run_start);
+        char *decoded = program->string_pool + text;
+        size_t length = 0;
+        for (size_t k = 0; k < j - run_start; k++) {
+            if (decoded[k] == '\\' && decoded[k + 1] == 'n') {
+                decoded[length++] = '\n';
+                k++;
+            } else {
+                decoded[length++] = decoded[k];
+            }
+        }
+        add_segment(c, SEGMENT_TEXT, text, length);
+    }
+
+    *count = c->func->segment_count - first;
+    return first;
+}
+
+void compile_block(Compiler *c, size_t *idx);
+
+void compile_statement(Compiler *c, size_t *idx) {
+    Token *tokens = c->func->tokens;
+    size_t i = *idx;
+
+    if (count_statements)
+        emit(c, OP_COUNT_STATEMENT, program->token_lines[&tokens[i] - program->tokens], 0);
+
+    if (tokens[i].type == TOK_VAR) {
+        expect_token(tokens, i + 1, TOK_IDENT, "Expected variable name after 'var'");
+        expect_token(tokens, i + 2, TOK_ASSIGN, "Expected '=' after variable name");
+        *idx = i + 3;
+        compile_assignment(c, idx, i + 1);
+        return;
+    }
+
+    if (tokens[i].type == TOK_IDENT && tokens[i + 1].type == TOK_ASSIGN) {
+        *idx = i + 2;
+        compile_assignment(c, idx, i);
+        return;
+    }
+
+    if (tokens[i].type == TOK_IDENT && tokens[i + 1].type == TOK_LBRACKET) {
+        compile_call(c, idx, OP_CALL);
+        return;
+    }
+
+    if (tokens[i].type == TOK_IDENT && tokens[i + 1].type == TOK_LSQUARE) {
+        int slot = compile_index(c, idx);
+        expect_token(tokens, *idx, TOK_ASSIGN, "Expected '=' after ']'");
+        (*idx)++;
+        compile_value(c, idx);
+        emit(c, OP_STORE_INDEX, slot, i);
+        return;
+    }
+
+    if (tokens[i].type == TOK_PRINT) {
+        i++;
+        if (tokens[i].type == TOK_STRING) {
+            size_t count;
+            size_t first = compile_interpolation(c, tokens[i].string, &count);
+            emit(c, OP_PRINT_STR, first, count);
+            *idx = i + 1;
+        } else if (tokens[i].type == TOK_IDENT && ends_operand(tokens[i + 1].type)) {
+            int slot = resolve_slot(c, tokens[i].symbol);
+            if (slot < 0) {
+                emit(c, OP_UNKNOWN_VAR, i, 0);
+            } else {
+                emit(c, OP_PRINT_VAR, slot, i);
+            }
+            *idx = i + 1;
+        } else {
+            *idx = i;
+            compile_expression(c, idx);
+            emit(c, OP_PRINT_NUM, 0, 0);
+        }
+        return;
+    }
+
+    if (tokens[i].type == TOK_IF_START) {
+        *idx = i + 1;
+        compile_expression(c, idx);
+
+        expect_token(tokens, *idx, TOK_LBRACE, "Expected '{' after if condition");
+        size_t skip_then = emit(c, OP_JUMP_IF_FALSE, 0, 0);
+        compile_block(c, idx);
+
+        if (tokens[*idx].type == TOK_ELSE) {
+            (*idx)++;
+            expect_token(tokens, *idx, TOK_LBRACE, "Expected '{' after else");
+            size_t skip_else = emit(c, OP_JUMP, 0, 0);
+            patch_jump(c, skip_then);
+            compile_block(c, idx);
+            patch_jump(c, skip_else);
+        } else {
+            patch_jump(c, skip_then);
+        }
+        return;
+    }
+
+    if (tokens[i].type == TOK_LOOP_START) {
+        expect_token(tokens, i + 1, TOK_IDENT, "Expected loop counter after 'rep'");
+        expect_token(tokens, i + 2, TOK_LBRACE, "Expected '{' after repeat");
+        *idx = i + 2;
+
+        int slot = resolve_slot(c, tokens[i + 1].symbol);
+        if (slot < 0) {
+            emit(c, OP_UNKNOWN_COUNTER, i + 1, 0);
+            slot = 0;
+        }
+
+        emit(c, OP_REP_INIT, slot, i + 1);
+        if (profiling) emit(c, OP_PROFILE_ENTER, &tokens[i] - program->tokens, 0);
+        size_t loop_test = emit(c, OP_REP_TEST, slot, 0);
+        if (profiling) emit(c, OP_PROFILE_ITERATION, 0, 0);
+        compile_block(c, idx);
+        if (tokens[i].jump)
+            emit(c, OP_REP_LOOP, slot, loop_test + 1);
+        else
+            emit(c, OP_REP_NEXT, slot, loop_test);
+        patch_jump(c, loop_test);
+        if (profiling) emit(c, OP_PROFILE_LEAVE, 0, 0);
+        emit(c, OP_POP, 0, 0);
+        return;
+    }
+
+    if (tokens[i].type == TOK_PREP_START) {
+        expect_token(tokens, i + 1, TOK_IDENT, "Expected loop counter after 'prep'");
+        size_t j = i + 2;
+        PrepLoop prep;
+        prep.reduction_count = parse_reductions(tokens, &j, tokens[i + 1].symbol, prep.reductions);
+        expect_token(tokens, j, TOK_LBRACE, "Expected '{' after prep");
+        *idx = j;
+
+        prep.name = i + 1;
+        prep.counter = resolve_slot(c, tokens[i + 1].symbol);
+        if (prep.counter < 0) {
+            emit(c, OP_UNKNOWN_COUNTER, i + 1, 0);
+            prep.counter = 0;
+        }
+        for (int r = 0; r < prep.reduction_count; r++) {
+            prep.reductions[r].slot = resolve_slot(c, prep.reductions[r].name);
+            if (prep.reductions[r].slot < 0) {
+                emit(c, OP_UNKNOWN_VAR, i + 3 + 2 * r, 0);
+                prep.reductions[r].slot = 0;
+            }
+        }
+
+        c->preps = grow_array(c->preps, &c->prep_capacity, c->func->prep_count + 1, sizeof(PrepLoop));
+        c->preps[c->func->prep_count] = prep;
+        size_t start = emit(c, OP_PREP, c->func->prep_count++, 0);
+        compile_block(c, idx);
+        emit(c, OP_PREP_END, 0, 0);
+        patch_jump(c, start);
+        return;
+    }
+
+    if (tokens[i].type == TOK_RETURN) {
+        i++;
+        if (tokens[i].type == TOK_STRING) {
+            emit(c, OP_RETURN_STR, i, 0);
+            *idx = i + 1;
+        } else if (is_whole_call(tokens, i)) {
+            *idx = i;
+            compile_call(c, idx, OP_TAIL_CALL);
+        } else {
+            *idx = i;
+            compile_value(c, idx);
+            emit(c, OP_RETURN_NUM, 0, 0);
+        }
+        return;
+    }
+
+    if (tokens[i].type == TOK_END) {
+        emit(c, OP_RETURN, 0, 0);
+        *idx = i + 1;
+        return;
+    }
+
+    fail("Unknown command at position %zu, token type: %d\n", i, tokens[i].type);
+}
+
+void compile_block(Compiler *c, size_t *idx) {
+    Token *tokens = c->func->tokens;
+    (*idx)++;
+
+    begin_scope(c);
+    while (tokens[*idx].type != TOK_RBRACE) {
+        if (tokens[*idx].type == TOK_EOF) {
+            fail("Expected '}'\n");
+        }
+        compile_statement(c, idx);
+    }
+    end_scope(c);
+    (*idx)++;
+}
+
+/*
+ * Bytecode optimizer, run on every function right after it is compiled:
+ * folds arithmetic and comparisons on constants, turns conditions that are
+ * known at compile time into plain jumps, drops code that can no longer be
+ * reached and moves loop-invariant expressions in front of their rep loop.
+ * It only ever removes or moves instructions that cannot fail, so a
+ * program's output and errors are the same as before.
+ */
+int is_binary(OpCode op) {
+    return op >= OP_ADD && op <= OP_LESS_EQUALS;
+}
+
+int jumps(OpCode op) {
+    return op == OP_JUMP || op == OP_JUMP_IF_FALSE || op == OP_REP_TEST || op == OP_REP_NEXT || op == OP_REP_LOOP || op == OP_PREP;
+}
+
+int falls_through(OpCode op) {
+    switch (op) {
+        case OP_JUMP:
+        case OP_REP_NEXT:
+        case OP_PREP_END:
+        case OP_TAIL_CALL:
+        case OP_RETURN_NUM:
+        case OP_RETURN_STR:
+        case OP_RETURN_RESULT:
+        case OP_RETURN:
+        case OP_UNKNOWN_VAR:
+        case OP_UNKNOWN_COUNTER:
+            return 0;
+        default:
+            return 1;
+    }
+}
+
+/*
+ * Computes lhs op rhs into *result the way run_bytecode would. Returns 0
+ * for a modulo by zero, which has to be left to run time to report the error.
+ */
+int fold_binary(OpCode op, Value lhs, Value rhs, Value *result) {
+    if (op == OP_MOD && is_zero_divisor(rhs)) return 0;
+    *result = arithmetic(op, lhs, rhs);
+    return 1;
+}
+
+/* Marks every instruction that some jump lands on. */
+void mark_targets(Compiler *c, char *target) {
+    size_t count = c->func->code_count;
+    memset(target, 0, count + 1);
+    for (size_t i = 0; i < count; i++) {
+        if (jumps(c->code[i].op))
+            target[c->code[i].b] = 1;
+    }
+}
+
+/*
+ * Removes the instructions marked dead. A jump to a removed instruction
+ * goes to the next one that is kept.
+ */
+void remove_dead(Compiler *c, const char *dead) {
+    size_t count = c->func->code_count;
+    size_t *map = malloc((count + 1) * sizeof(size_t));
+    if (!map) {
+        fail_errno("malloc");
+    }
+
+    size_t kept = 0;
+    for (size_t i = 0; i < count; i++) {
+        map[i] = kept;
+        if (!dead[i]) kept++;
+    }
+    map[count] = kept;
+
+    kept = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (dead[i]) continue;
+        c->code[kept] = c->code[i];
+        if (jumps(c->code[kept].op))
+            c->code[kept].b = map[c->code[kept].b];
+        kept++;
+    }
+    c->func->code_count = kept;
+    free(map);
+}
+
+/* One round of folding and dead code removal. Returns whether anything changed. */
+int fold_constants(Compiler *c, char *target, char *dead) {
+    Instr *code = c->code;
+    size_t count = c->func->code_count;
+    int changed = 0;
+
+    mark_targets(c, target);
+    memset(dead, 0, count);
+
+    for (size_t i = 0; i + 1 < count; i++) {
+        if (dead[i] || code[i].op != OP_PUSH_NUM || target[i + 1]) continue;
+        Value value = c->constants[code[i].a];
+
+        if (i + 2 < count && code[i + 1].op == OP_PUSH_NUM && is_binary(code[i + 2].op) && !target[i + 2]) {
+            if (fold_binary(code[i + 2].op, value, c->constants[code[i + 1].a], &c->constants[code[i].a])) {
+                dead[i + 1] = dead[i + 2] = 1;
+                changed = 1;
+                i += 2;
+            }
+        } else if (code[i + 1].op == OP_NEGATE) {
+            c->constants[code[i].a] = negate(value);
+            dead[i + 1] = 1;
+            changed = 1;
+            i++;
+        } else if (code[i + 1].op == OP_JUMP_IF_FALSE) {
+            if (!is_true(value)) {
+                code[i].op = OP_JUMP;
+                code[i].b = code[i + 1].b;
+            } else {
+                dead[i] = 1;
+            }
+            dead[i + 1] = 1;
+            changed = 1;
+            i++;
+        }
+    }
+    remove_dead(c, dead);
+
+    /* Whatever cannot be reached from the first instruction is dead too. */
+    count = c->func->code_count;
+    memset(dead, 1, count);
+    size_t *work = malloc((count + 1) * sizeof(size_t));
+    if (!work) {
+        fail_errno("malloc");
+    }
+    size_t pending = 0;
+    work[pending++] = 0;
+    dead[0] = 0;
+    while (pending) {
+        size_t i = work[--pending];
+        if (falls_through(code[i].op) && i + 1 < count && dead[i + 1]) {
+            dead[i + 1] = 0;
+            work[pending++] = i + 1;
+        }
+        if (jumps(code[i].op) && dead[code[i].b]) {
+            dead[code[i].b] = 0;
+            work[pending++] = code[i].b;
+        }
+    }
+    free(work);
+
+    for (size_t i = 0; i < count; i++) {
+        if (dead[i]) changed = 1;
+        else if (code[i].op == OP_JUMP && (size_t)code[i].b == i + 1) {
+            dead[i] = 1;
+            changed = 1;
+        }
+    }
+    remove_dead(c, dead);
+    return changed;
+}
+
+/*
+ * Looks for a loop-invariant expression in the body of the rep loop whose
+ * OP_REP_TEST is at test: a run of pushes and loads of slots the loop
+ * never writes, combined by at least one operator, leaving one value. Only
+ * slots in numeric[] may be loaded, so the hoisted code cannot fail. On
+ * success the run is [*start, *end].
+ */
+int find_invariant(Compiler *c, size_t test, const char *numeric, const char *written, const char *target, size_t *start, size_t *end) {
+    Instr *code = c->code;
+    size_t body_end = code[test].b - 1;
+
+    for (size_t p = test + 1; p < body_end; p++) {
+        size_t depth = 0;
+        size_t best = 0;
+
+        for (size_t q = p; q < body_end; q++) {
+            Instr *ins = &code[q];
+            if (q > p && target[q]) break;
+
+            if (ins->op == OP_PUSH_NUM || (ins->op == OP_LOAD && numeric[ins->a] && !written[ins->a])) {
+                depth++;
+            } else if (is_binary(ins->op) && depth >= 2) {
+                if (ins->op == OP_MOD) {
+                    if (code[q - 1].op != OP_PUSH_NUM) break;
+                    if (is_zero_divisor(c->constants[code[q - 1].a])) break;
+                }
+                depth--;
+                if (depth == 1) best = q;
+            } else if (ins->op == OP_NEGATE && depth >= 1) {
+                if (depth == 1) best = q;
+            } else {
+                break;
+            }
+        }
+
+        if (best) {
+            *start = p;
+            *end = best;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Moves one loop-invariant expression in front of its rep loop, storing it
+ * in a new slot that the body loads instead. Returns whether one was found.
+ */
+int hoist_invariant(Compiler *c, char *target) {
+    Function *func = c->func;
+    size_t count = func->code_count;
+    char *numeric = malloc(func->slot_count + 1);
+    char *written = malloc(func->slot_count + 1);
+    if (!numeric || !written) {
+        fail_errno("malloc");
+    }
+
+    /* Parameters, and variables set from a call, a string, another variable or an index as it is, may hold anything. */
+    memset(numeric, 1, func->slot_count + 1);
+    memset(numeric, 0, func->param_count);
+    for (size_t i = 0; i < count; i++) {
+        OpCode before = i > 0 ? c->code[i - 1].op : OP_PUSH_NUM;
+        if (c->code[i].op == OP_STORE_STR || c->code[i].op == OP_STORE_RESULT ||
+            (c->code[i].op == OP_STORE_NUM &&
+             (before == OP_LOAD_VALUE || before == OP_INDEX_VALUE || before == OP_PUSH_STR ||
+              before == OP_PUSH_VALUE)))
+            numeric[c->code[i].a] = 0;
+    }
+    mark_targets(c, target);
+
+    /* Innermost loops come last, so walk backwards to hoist from them first. */
+    for (size_t test = count; test-- > 0;) {
+        if (c->code[test].op != OP_REP_TEST) continue;
+
+        size_t init = test - 1;
+        while (c->code[init].op != OP_REP_INIT) init--;
+        size_t exit_pc = c->code[test].b;
+
+        memset(written, 0, func->slot_count + 1);
+        for (size_t i = init; i < exit_pc; i++) {
+            switch (c->code[i].op) {
+                case OP_STORE_NUM:
+                case OP_STORE_STR:
+                case OP_STORE_RESULT:
+                case OP_REP_INIT:
+                case OP_REP_NEXT:
+                case OP_REP_LOOP:
+                    written[c->code[i].a] = 1;
+                    break;
+                case OP_PREP: {
+                    PrepLoop *prep = &c->preps[c->code[i].a];
+                    written[prep->counter] = 1;
+                    for (int r = 0; r < prep->reduction_count; r++) {
+                        written[prep->reductions[r].slot] = 1;
+                    }
+                    break;
+                }
+                default:
+                    break;
+            }
+        }
+
+        size_t start, end;
+        if (!find_invariant(c, test, numeric, written, target, &start, &end)) continue;
+
+        /*
+         * New layout: [0, init) expression STORE [init, start) LOAD (end, count).
+         * Jumps to init now run the hoisted expression first.
+         */
+        int slot = func->slot_count++;
+        Instr *code = malloc((count + 2) * sizeof(Instr));
+        size_t *map = malloc((count + 1) * sizeof(size_t));
+        if (!code || !map) {
+            fail_errno("malloc");
+        }
+
+        size_t n = 0;
+        for (size_t i = 0; i < init; i++) {
+            map[i] = n;
+            code[n++] = c->code[i];
+        }
+        map[init] = n;
+        for (size_t i = start; i <= end; i++) code[n++] = c->code[i];
+        code[n].op = OP_STORE_NUM;
+        code[n].a = slot;
+        code[n++].b = 0;
+        for (size_t i = init; i < start; i++) {
+            if (i > init) map[i] = n;
+            code[n++] = c->code[i];
+        }
+        for (size_t i = start; i <= end; i++) map[i] = n;
+        code[n].op = OP_LOAD;
+        code[n].a = slot;
+        code[n++].b = c->code[start].op == OP_LOAD ? c->code[start].b : 0;
+        for (size_t i = end + 1; i < count; i++) {
+            map[i] = n;
+            code[n++] = c->code[i];
+        }
+        map[count] = n;
+
+        for (size_t i = 0; i < n; i++) {
+            if (jumps(code[i].op)) code[i].b = map[code[i].b];
+        }
+
+        c->code = grow_array(c->code, &c->code_capacity, n, sizeof(Instr));
+        memcpy(c->code, code, n * sizeof(Instr));
+        func->code_count = n;
+        free(code);
+        free(map);
+        free(numeric);
+        free(written);
+        return 1;
+    }
+
+    free(numeric);
+    free(written);
+    return 0;
+}
+
+void optimize_function(Compiler *c) {
+    char *target = NULL;
+    char *dead = NULL;
+    size_t capacity = 0;
+    size_t dead_capacity = 0;
+
+    for (;;) {
+        size_t count = c->func->code_count + 2;
+        target = grow_array(target, &capacity, count, 1);
+        dead = grow_array(dead, &dead_capacity, count, 1);
+
+        if (fold_constants(c, target, dead)) continue;
+        if (!hoist_invariant(c, target)) break;
+    }
+
+    free(target);
+    free(dead);
+}
+
+/* Points each call site of func at its callee, if one takes that many arguments. */
+void link_call_sites(Function *func) {
+    for (size_t pc = 0; pc < func->code_count; pc++) {
+        Instr *ins = &func->code[pc];
+        if (ins->op != OP_CALL && ins->op != OP_TAIL_CALL) continue;
+
+        CallSite *site = &func->call_sites[ins->a];
+        Function *callee = get_function(site->name);
+        if (callee && callee->param_count == (size_t)ins->b) site->target = callee;
+    }
+}
+
+/* Scratch space compile_function reuses from one function to the next. */
+_Thread_local Compiler compiler;
+
+/*
+ * Translates a parsed function body into bytecode once, so run_bytecode
+ * never has to look at the token stream again. Parameters take the first
+ * frame slots.
+ */
+void compile_function(Function *func) {
+    Compiler *c = &compiler;
+    size_t i = 0;
+
+    c->func = func;
+    c->binding_count = 0;
+    c->scope_count = 0;
+    c->stack_depth = 0;
+    func->code_count = 0;
+    func->constant_count = 0;
+    func->segment_count = 0;
+    func->call_site_count = 0;
+    func->prep_count = 0;
+    func->max_stack = 0;
+    func->slot_count = 0;
+
+    begin_scope(c);
+    for (size_t p = 0; p < func->param_count; p++) {
+        declare_slot(c, func->param_names[p]);
+    }
+
+    while (i < func->token_count && func->tokens[i].type != TOK_EOF) {
+        compile_statement(c, &i);
+    }
+    emit(c, OP_RETURN, 0, 0);
+    optimize_function(c);
+
+    func->code = arena_copy(&program->arena, c->code, func->code_count * sizeof(Instr));
+    func->constants = arena_copy(&program->arena, c->constants, func->constant_count * sizeof(Value));
+    func->segments = arena_copy(&program->arena, c->segments, func->segment_count * sizeof(Segment));
+    func->call_sites = arena_copy(&program->arena, c->call_sites, func->call_site_count * sizeof(CallSite));
+    func->preps = arena_copy(&program->arena, c->preps, func->prep_count * sizeof(PrepLoop));
+    link_call_sites(func);
+}
+
+/* Names of the opcodes for --dump-optimized, in OpCode order. */
+const char *op_names[] = {
+    "PUSH_NUM",
+    "PUSH_STR",
+    "LOAD",
+    "LOAD_VALUE",
+    "INDEX",
+    "INDEX_VALUE",
+    "STORE_NUM",
+    "STORE_STR",
+    "STORE_RESULT",
+    "STORE_INDEX",
+    "PUSH_RESULT",
+    "PUSH_VALUE",
+    "UNKNOWN_VAR",
+    "UNKNOWN_COUNTER",
+    "ADD",
+    "SUB",
+    "MUL",
+    "DIV",
+    "MOD",
+    "EQUALS",
+    "NOT_EQUALS",
+    "MORE",
+    "LESS",
+    "MORE_EQUALS",
+    "LESS_EQUALS",
+    "NEGATE",
+    "JUMP",
+    "JUMP_IF_FALSE",
+    "REP_INIT",
+    "REP_TEST",
+    "REP_NEXT",
+    "REP_LOOP",
+    "PREP",
+    "PREP_END",
+    "POP",
+    "COUNT_STATEMENT",
+    "PROFILE_ENTER",
+    "PROFILE_ITERATION",
+    "PROFILE_LEAVE",
+    "CALL",
+    "TAIL_CALL",
+    "BUILTIN",
+    "PRINT_STR",
+    "PRINT_VAR",
+    "PRINT_NUM",
+    "RETURN_NUM",
+    "RETURN_STR",
+    "RETURN_RESULT",
+    "RETURN"
+};
+
+/* Prints func's optimized bytecode, one instruction per line. */
+void dump_function(Function *func) {
+    printf("fun %s(", symbol_name(func->name));
+    for (size_t p = 0; p < func->param_count; p++)
+        printf("%s%s", p ? ", " : "", symbol_name(func->param_names[p]));
+    printf(")  slots %zu, stack %zu\n", func->slot_count, func->max_stack);
+
+    for (size_t pc = 0; pc < func->code_count; pc++) {
+        Instr *ins = &func->code[pc];
+        printf("  %4zu  %-18s", pc, op_names[ins->op]);
+
+        switch (ins->op) {
+            case OP_PUSH_NUM:
+                if (is_int(func->constants[ins->a]))
+                    printf(" %lld", int_of(func->constants[ins->a]));
+                else
+                    printf(" %g", double_of(func->constants[ins->a]));
+                break;
+            case OP_LOAD:
+            case OP_LOAD_VALUE:
+            case OP_INDEX:
+            case OP_INDEX_VALUE:
+            case OP_STORE_NUM:
+            case OP_STORE_STR:
+            case OP_STORE_RESULT:
+            case OP_STORE_INDEX:
+            case OP_REP_INIT:
+            case OP_PRINT_VAR:
+                printf(" slot %d", ins->a);
+                break;
+            case OP_REP_TEST:
+            case OP_REP_NEXT:
+            case OP_REP_LOOP:
+                printf(" slot %d -> %d", ins->a, ins->b);
+                break;
+            case OP_PREP: {
+                PrepLoop *prep = &func->preps[ins->a];
+                printf(" slot %d -> %d", prep->counter, ins->b);
+                for (int r = 0; r < prep->reduction_count; r++)
+                    printf(", %s slot %d", reduction_names[prep->reductions[r].kind], prep->reductions[r].slot);
+                break;
+            }
+            case OP_JUMP:
+            case OP_JUMP_IF_FALSE:
+                printf(" -> %d", ins->b);
+                break;
+            case OP_CALL:
+            case OP_TAIL_CALL:
+                printf(" %s, %d args", symbol_name(func->call_sites[ins->a].name), ins->b);
+                break;
+            case OP_BUILTIN:
+                printf(" %s, %d args", builtin_names[ins->a], ins->b);
+                break;
+            case OP_PUSH_RESULT:
+            case OP_PUSH_VALUE:
+                printf(" %s", symbol_name(func->tokens[ins->b].symbol));
+                break;
+            case OP_PUSH_STR:
+                printf(" \"%s\"", pool_text(func->tokens[ins->b].string));
+                break;
+            case OP_PRINT_STR:
+                printf(" %d segments", ins->b);
+                break;
+            default:
+                break;
+        }
+        printf("\n");
+    }
+    printf("\n");
+}
+
+void print_variable(Value v) {
+    if (is_string(v))
+        out_text(pool_text(string_of(v)), pool_length(string_of(v)));
+    else
+        out_value(v);
+}
+
+void print_segments(const Segment *segment, size_t count, Value *frame) {
+    for (; count > 0; count--, segment++) {
+        if (segment->slot >= 0) {
+            print_variable(frame[segment->slot]);
+        } else if (segment->slot == SEGMENT_TEXT) {
+            out_text(program->string_pool + segment->text, segment->length);
+        } else {
+            fail("Variable not found: %.*s\n", (int)segment->length, program->string_pool + segment->text);
+        }
+    }
+}
+
+#ifdef KINNIE_JIT
+/*
+ * Template JIT for x86-64 Linux, enabled with --jit. A function is
+ * translated one bytecode instruction at a time once it has been called
+ * JIT_CALL_THRESHOLD times, or once its rep blocks have iterated
+ * JIT_LOOP_THRESHOLD times, in which case the running loop continues in
+ * native code from where the interpreter left it.
+ *
+ * Native code works on the same frame and operand stack memory as
+ * run_bytecode, so it can be entered at any instruction. While it runs,
+ * rbx holds the frame, r12 the operand stack top and r13 the frame's byte
+ * offset in vm_frames, used to find it again after a call. Integer
+ * arithmetic and comparisons, jumps and rep loops are inlined; doubles,
+ * integer overflow, calls, output and errors go through arithmetic and the
+ * jit_* helpers below. Functions using the profiler opcodes or prep are
+ * left to the interpreter. Native code refers to the main thread's
+ * thread-local state, so only the main thread runs it.
+ */
+typedef void (*JitEntry)(Value *frame, Value *stack_top, void *target);
+
+typedef struct {
+    size_t at;
+    int target;
+} JitFixup;
+
+unsigned char *jit_buffer = NULL;
+size_t jit_length = 0;
+size_t jit_capacity = 0;
+
+JitFixup *jit_fixups = NULL;
+size_t jit_fixup_count = 0;
+size_t jit_fixup_capacity = 0;
+
+void jit_bytes(const char *bytes, size_t count) {
+    jit_buffer = grow_array(jit_buffer, &jit_capacity, jit_length + count, 1);
+    memcpy(jit_buffer + jit_length, bytes, count);
+    jit_length += count;
+}
+
+#define JIT_EMIT(bytes) jit_bytes(bytes, sizeof(bytes) - 1)
+
+void jit_byte(unsigned char value) {
+    jit_bytes((const char *)&value, 1);
+}
+
+void jit_u32(unsigned int value) {
+    jit_bytes((const char *)&value, 4);
+}
+
+void jit_u64(unsigned long long value) {
+    jit_bytes((const char *)&value, 8);
+}
+
+/* mov rax, imm64; call rax */
+void jit_call_helper(void *helper) {
+    JIT_EMIT("\x48\xB8");
+    jit_u64((unsigned long long)(size_t)helper);
+    JIT_EMIT("\xFF\xD0");
+}
+
+/* Emits a rel8 jump (opcode given) forward to where jit_land is called. */
+size_t jit_branch(unsigned char opcode) {
+    jit_byte(opcode);
+    jit_byte(0);
+    return jit_length;
+}
+
+void jit_land(size_t branch) {
+    jit_buffer[branch - 1] = jit_length - branch;
+}
+
+/* Emits a rel32 jump (opcode given) to the instruction at pc target. */
+void jit_jump(const char *opcode, size_t length, int target) {
+    jit_bytes(opcode, length);
+    jit_fixups = grow_array(jit_fixups, &jit_fixup_capacity, jit_fixup_count + 1, sizeof(JitFixup));
+    jit_fixups[jit_fixup_count].at = jit_length;
+    jit_fixups[jit_fixup_count].target = target;
+    jit_fixup_count++;
+    jit_u32(0);
+}
+
+unsigned int slot_offset(int slot) {
+    return slot * sizeof(Value);
+}
+
+/* Compares the tag of the value in rcx with tag; rcx is clobbered. */
+void jit_compare_tag(Value tag) {
+    JIT_EMIT("\x48\xC1\xE9\x30");                 /* shr rcx, 48 */
+    JIT_EMIT("\x81\xF9");                         /* cmp ecx, tag */
+    jit_u32(tag >> 48);
+}
+
+/* Tags the integer payload in the low 48 bits of rax. */
+void jit_box_int(void) {
+    JIT_EMIT("\x48\xB9");                         /* mov rcx, VALUE_INT_TAG */
+    jit_u64(VALUE_INT_TAG);
+    JIT_EMIT("\x48\x09\xC8");                     /* or rax, rcx */
+}
+
+void jit_store_result(Value *slot, int name) {
+    if (!has_return_value) {
+        fail("Function %s did not return a value\n", symbol_name(name));
+    }
+    *slot = return_value;
+}
+
+void jit_unknown(int counter, int name) {
+    if (counter)
+        fail("Loop counter not found or not int: %s\n", symbol_name(name));
+    else
+        fail("Unknown variable: %s\n", symbol_name(name));
+}
+
+/*
+ * Calls site's function with the arguments on top of the operand stack and
+ * returns the new stack top, since vm_stack may have moved.
+ */
+Value *jit_call(CallSite *site, int arg_count, Value *stack_top) {
+    if (!site->target)
+        site->target = resolve_function(site->name, arg_count);
+    vm_sp = stack_top - vm_stack - arg_count;
+    call_function(site->target, &vm_stack[vm_sp]);
+    return &vm_stack[vm_sp];
+}
+
+/*
+ * Records a tail call for run_bytecode to make once the native code has
+ * returned and released the frame.
+ */
+void jit_tail_call(CallSite *site, int arg_count, Value *stack_top) {
+    if (!site->target)
+        site->target = resolve_function(site->name, arg_count);
+    memcpy(tail_args, stack_top - arg_count, arg_count * sizeof(Value));
+    tail_function = site->target;
+}
+
+void jit_print_segments(const Segment *segments, int count, Value *frame) {
+    print_segments(segments, count, frame);
+    out_end();
+}
+
+void jit_print_variable(Value v) {
+    if (is_string(v))
+        print_text(pool_text(string_of(v)), 0);
+    else
+        out_value(v);
+    out_end();
+}
+
+void jit_print_number(Value v) {
+    out_value(v);
+    out_end();
+}
+
+/*
+ * Pops the right operand and combines it with the left one. No double has
+ * all the bits of VALUE_INT_TAG set, so the AND of both values carries that
+ * tag only when both are integers; those are added, subtracted, multiplied
+ * or compared inline as 48-bit payloads shifted to the top of the register,
+ * where overflow sets the flag, unless the result does not fit. Everything
+ * else calls arithmetic.
+ */
+void jit_binary(OpCode op) {
+    size_t mixed = 0;
+    size_t overflow = 0;
+    size_t done = 0;
+
+    JIT_EMIT("\x49\x83\xEC\x08");                 /* sub r12, 8 */
+    if (op != OP_DIV && op != OP_MOD) {
+        JIT_EMIT("\x49\x8B\x44\x24\xF8");         /* mov rax, [r12-8] */
+        JIT_EMIT("\x49\x8B\x14\x24");             /* mov rdx, [r12] */
+        JIT_EMIT("\x48\x89\xC1");                 /* mov rcx, rax */
+        JIT_EMIT("\x48\x21\xD1");                 /* and rcx, rdx */
+        jit_compare_tag(VALUE_INT_TAG);
+        mixed = jit_branch(0x75);                 /* jne slow */
+        JIT_EMIT("\x48\xC1\xE0\x10");             /* shl rax, 16 */
+        JIT_EMIT("\x48\xC1\xE2\x10");             /* shl rdx, 16 */
+        switch (op) {
+            case OP_ADD:
+                JIT_EMIT("\x48\x01\xD0");         /* add rax, rdx */
+                overflow = jit_branch(0x70);      /* jo slow */
+                JIT_EMIT("\x48\xC1\xE8\x10");     /* shr rax, 16 */
+                break;
+            case OP_SUB:
+                JIT_EMIT("\x48\x29\xD0");         /* sub rax, rdx */
+                overflow = jit_branch(0x70);      /* jo slow */
+                JIT_EMIT("\x48\xC1\xE8\x10");     /* shr rax, 16 */
+                break;
+            case OP_MUL:
+                JIT_EMIT("\x48\xC1\xFA\x10");     /* sar rdx, 16 */
+                JIT_EMIT("\x48\x0F\xAF\xC2");     /* imul rax, rdx */
+                overflow = jit_branch(0x70);      /* jo slow */
+                JIT_EMIT("\x48\xC1\xE8\x10");     /* shr rax, 16 */
+                break;
+            default:
+                JIT_EMIT("\x48\x39\xD0");         /* cmp rax, rdx */
+                switch (op) {
+                    case OP_EQUALS: JIT_EMIT("\x0F\x94\xC0"); break;     /* sete al */
+                    case OP_NOT_EQUALS: JIT_EMIT("\x0F\x95\xC0"); break; /* setne al */
+                    case OP_MORE: JIT_EMIT("\x0F\x9F\xC0"); break;       /* setg al */
+                    case OP_LESS: JIT_EMIT("\x0F\x9C\xC0"); break;       /* setl al */
+                    case OP_MORE_EQUALS: JIT_EMIT("\x0F\x9D\xC0"); break; /* setge al */
+                    default: JIT_EMIT("\x0F\x9E\xC0"); break;            /* setle al */
+                }
+                JIT_EMIT("\x0F\xB6\xC0");             /* movzx eax, al */
+                break;
+        }
+        jit_box_int();
+        JIT_EMIT("\x49\x89\x44\x24\xF8");         /* mov [r12-8], rax */
+        done = jit_branch(0xEB);                  /* jmp done */
+        jit_land(mixed);
+        if (overflow) jit_land(overflow);
+    }
+
+    JIT_EMIT("\xBF");                             /* mov edi, op */
+    jit_u32(op);
+    JIT_EMIT("\x49\x8B\x74\x24\xF8");             /* mov rsi, [r12-8] */
+    JIT_EMIT("\x49\x8B\x14\x24");                 /* mov rdx, [r12] */
+    jit_call_helper(arithmetic);
+    JIT_EMIT("\x49\x89\x44\x24\xF8");             /* mov [r12-8], rax */
+    if (done) jit_land(done);
+}
+
+/* Reloads rbx after vm_frames may have moved. */
+void jit_reload_frame(void) {
+    JIT_EMIT("\x48\xB8");                         /* mov rax, &vm_frames */
+    jit_u64((unsigned long long)(size_t)&vm_frames);
+    JIT_EMIT("\x48\x8B\x18");                     /* mov rbx, [rax] */
+    JIT_EMIT("\x4C\x01\xEB");                     /* add rbx, r13 */
+}
+
+/* Returns 0 if func uses an instruction the JIT does not translate. */
+int jit_translate(Function *func, unsigned int *offsets) {
+    Token *tokens = func->tokens;
+    size_t epilogue_fixups = 0;
+    size_t *epilogues = NULL;
+    size_t epilogue_capacity = 0;
+
+    jit_length = 0;
+    jit_fixup_count = 0;
+
+    JIT_EMIT("\x55\x53\x41\x54\x41\x55\x41\x56"); /* push rbp, rbx, r12, r13, r14 */
+    JIT_EMIT("\x48\x89\xFB");                     /* mov rbx, rdi */
+    JIT_EMIT("\x49\x89\xF4");                     /* mov r12, rsi */
+    JIT_EMIT("\x49\x89\xFD");                     /* mov r13, rdi */
+    JIT_EMIT("\x48\xB8");                         /* mov rax, &vm_frames */
+    jit_u64((unsigned long long)(size_t)&vm_frames);
+    JIT_EMIT("\x4C\x2B\x28");                     /* sub r13, [rax] */
+    JIT_EMIT("\xFF\xE2");                         /* jmp rdx */
+
+    for (size_t pc = 0; pc < func->code_count; pc++) {
+        Instr *ins = &func->code[pc];
+        unsigned int slot = slot_offset(ins->a);
+
+        offsets[pc] = jit_length;
+
+        switch (ins->op) {
+            case OP_PUSH_NUM:
+                JIT_EMIT("\x48\xB8");             /* mov rax, constant */
+                jit_u64(func->constants[ins->a]);
+                JIT_EMIT("\x49\x89\x04\x24");     /* mov [r12], rax */
+                JIT_EMIT("\x49\x83\xC4\x08");     /* add r12, 8 */
+                break;
+            case OP_PUSH_STR:
+                JIT_EMIT("\x48\xB8");             /* mov rax, string */
+                jit_u64(make_string(tokens[ins->b].string));
+                JIT_EMIT("\x49\x89\x04\x24");     /* mov [r12], rax */
+                JIT_EMIT("\x49\x83\xC4\x08");     /* add r12, 8 */
+                break;
+            case OP_LOAD_VALUE:
+                JIT_EMIT("\x48\x8B\x83");         /* mov rax, [rbx+slot] */
+                jit_u32(slot);
+                JIT_EMIT("\x49\x89\x04\x24");     /* mov [r12], rax */
+                JIT_EMIT("\x49\x83\xC4\x08");     /* add r12, 8 */
+                break;
+            case OP_LOAD: {
+                JIT_EMIT("\x48\x8B\x83");         /* mov rax, [rbx+slot] */
+                jit_u32(slot);
+                JIT_EMIT("\x48\x89\xC1");         /* mov rcx, rax */
+                jit_compare_tag(VALUE_STRING_TAG);
+                /* Numbers have the tags below strings. */
+                size_t number = jit_branch(0x72); /* jb number */
+                JIT_EMIT("\xBF");                 /* mov edi, name */
+                jit_u32(tokens[ins->b].symbol);
+                jit_call_helper(number_error);
+                jit_land(number);
+                JIT_EMIT("\x49\x89\x04\x24");     /* mov [r12], rax */
+                JIT_EMIT("\x49\x83\xC4\x08");     /* add r12, 8 */
+                break;
+            }
+            case OP_INDEX:
+            case OP_INDEX_VALUE:
+                JIT_EMIT("\x48\x8B\xBB");         /* mov rdi, [rbx+slot] */
+                jit_u32(slot);
+                JIT_EMIT("\x49\x8B\x74\x24\xF8"); /* mov rsi, [r12-8] */
+                JIT_EMIT("\xBA");                 /* mov edx, name */
+                jit_u32(tokens[ins->b].symbol);
+                if (ins->op == OP_INDEX)
+                    jit_call_helper(index_number);
+                else
+                    jit_call_helper(index_value);
+                JIT_EMIT("\x49\x89\x44\x24\xF8"); /* mov [r12-8], rax */
+                break;
+            case OP_STORE_INDEX:
+                JIT_EMIT("\x48\x8B\xBB");         /* mov rdi, [rbx+slot] */
+                jit_u32(slot);
+                JIT_EMIT("\x49\x8B\x74\x24\xF0"); /* mov rsi, [r12-16] */
+                JIT_EMIT("\x49\x8B\x54\x24\xF8"); /* mov rdx, [r12-8] */
+                JIT_EMIT("\xB9");                 /* mov ecx, name */
+                jit_u32(tokens[ins->b].symbol);
+                JIT_EMIT("\x49\x83\xEC\x10");     /* sub r12, 16 */
+                jit_call_helper(store_index);
+                break;
+            case OP_STORE_NUM:
+                JIT_EMIT("\x49\x83\xEC\x08");     /* sub r12, 8 */
+                JIT_EMIT("\x49\x8B\x04\x24");     /* mov rax, [r12] */
+                JIT_EMIT("\x48\x89\x83");         /* mov [rbx+slot], rax */
+                jit_u32(slot);
+                break;
+            case OP_STORE_STR:
+                JIT_EMIT("\x48\xB8");             /* mov rax, string */
+                jit_u64(make_string(tokens[ins->b].string));
+                JIT_EMIT("\x48\x89\x83");         /* mov [rbx+slot], rax */
+                jit_u32(slot);
+                break;
+            case OP_STORE_RESULT:
+                JIT_EMIT("\x48\x8D\xBB");         /* lea rdi, [rbx+slot] */
+                jit_u32(slot);
+                JIT_EMIT("\xBE");                 /* mov esi, name */
+                jit_u32(tokens[ins->b].symbol);
+                jit_call_helper(jit_store_result);
+                break;
+            case OP_PUSH_RESULT:
+            case OP_PUSH_VALUE:
+                JIT_EMIT("\xBF");                 /* mov edi, name */
+                jit_u32(tokens[ins->b].symbol);
+                jit_call_helper(ins->op == OP_PUSH_RESULT ? call_result : call_value);
+                JIT_EMIT("\x49\x89\x04\x24");     /* mov [r12], rax */
+                JIT_EMIT("\x49\x83\xC4\x08");     /* add r12, 8 */
+                break;
+            case OP_UNKNOWN_VAR:
+            case OP_UNKNOWN_COUNTER:
+                JIT_EMIT("\xBF");                 /* mov edi, counter */
+                jit_u32(ins->op == OP_UNKNOWN_COUNTER);
+                JIT_EMIT("\xBE");                 /* mov esi, name */
+                jit_u32(tokens[ins->a].symbol);
+                jit_call_helper(jit_unknown);
+                break;
+            case OP_ADD:
+            case OP_SUB:
+            case OP_MUL:
+            case OP_DIV:
+            case OP_MOD:
+            case OP_EQUALS:
+            case OP_NOT_EQUALS:
+            case OP_MORE:
+            case OP_LESS:
+            case OP_MORE_EQUALS:
+            case OP_LESS_EQUALS:
+                jit_binary(ins->op);
+                break;
+            case OP_NEGATE:
+                JIT_EMIT("\x49\x8B\x7C\x24\xF8"); /* mov rdi, [r12-8] */
+                jit_call_helper(negate);
+                JIT_EMIT("\x49\x89\x44\x24\xF8"); /* mov [r12-8], rax */
+                break;
+            case OP_JUMP:
+                jit_jump("\xE9", 1, ins->b);      /* jmp */
+                break;
+            case OP_JUMP_IF_FALSE:
+                JIT_EMIT("\x49\x83\xEC\x08");     /* sub r12, 8 */
+                JIT_EMIT("\x49\x8B\x04\x24");     /* mov rax, [r12] */
+                JIT_EMIT("\x48\xB9");             /* mov rcx, integer 0 */
+                jit_u64(VALUE_INT_TAG);
+                JIT_EMIT("\x48\x39\xC8");         /* cmp rax, rcx */
+                jit_jump("\x0F\x84", 2, ins->b);  /* je */
+                JIT_EMIT("\x48\x01\xC0");         /* add rax, rax: zero for 0.0 and -0.0 */
+                jit_jump("\x0F\x84", 2, ins->b);  /* je */
+                break;
+            case OP_REP_INIT:
+                JIT_EMIT("\x48\x8D\xBB");         /* lea rdi, [rbx+slot] */
+                jit_u32(slot);
+                JIT_EMIT("\xBE");                 /* mov esi, name */
+                jit_u32(tokens[ins->b].symbol);
+                jit_call_helper(rep_start);
+                JIT_EMIT("\x49\x89\x04\x24");     /* mov [r12], rax */
+                JIT_EMIT("\x49\x83\xC4\x08");     /* add r12, 8 */
+                break;
+            case OP_REP_TEST: {
+                JIT_EMIT("\x48\x8B\x83");         /* mov rax, [rbx+slot] */
+                jit_u32(slot);
+                JIT_EMIT("\x48\x89\xC1");         /* mov rcx, rax */
+                jit_compare_tag(VALUE_INT_TAG);
+                size_t slow = jit_branch(0x75);   /* jne slow */
+                JIT_EMIT("\x49\x8B\x54\x24\xF8"); /* mov rdx, [r12-8] */
+                JIT_EMIT("\x48\xC1\xE0\x10");     /* shl rax, 16 */
+                JIT_EMIT("\x48\xC1\xE2\x10");     /* shl rdx, 16 */
+                JIT_EMIT("\x48\x39\xD0");         /* cmp rax, rdx */
+                jit_jump("\x0F\x8D", 2, ins->b);  /* jge: counter is not below goal */
+                size_t body = jit_branch(0xEB);   /* jmp body */
+                jit_land(slow);
+                JIT_EMIT("\x48\x89\xC7");         /* mov rdi, rax */
+                JIT_EMIT("\x49\x8B\x74\x24\xF8"); /* mov rsi, [r12-8] */
+                jit_call_helper(rep_continues);
+                JIT_EMIT("\x85\xC0");             /* test eax, eax */
+                jit_jump("\x0F\x84", 2, ins->b);  /* je */
+                jit_land(body);
+                break;
+            }
+            case OP_REP_NEXT: {
+                JIT_EMIT("\x48\x8B\x83");         /* mov rax, [rbx+slot] */
+                jit_u32(slot);
+                JIT_EMIT("\x48\x89\xC1");         /* mov rcx, rax */
+                jit_compare_tag(VALUE_INT_TAG);
+                size_t slow = jit_branch(0x75);   /* jne slow */
+                JIT_EMIT("\x48\xC1\xE0\x10");     /* shl rax, 16 */
+                JIT_EMIT("\x48\x05\x00\x00\x01\x00"); /* add rax, 1 << 16 */
+                size_t overflow = jit_branch(0x70); /* jo slow */
+                JIT_EMIT("\x48\xC1\xE8\x10");     /* shr rax, 16 */
+                jit_box_int();
+                JIT_EMIT("\x48\x89\x83");         /* mov [rbx+slot], rax */
+                jit_u32(slot);
+                jit_jump("\xE9", 1, ins->b);      /* jmp */
+                jit_land(slow);
+                jit_land(overflow);
+                JIT_EMIT("\x48\x8D\xBB");         /* lea rdi, [rbx+slot] */
+                jit_u32(slot);
+                jit_call_helper(rep_step);
+                jit_jump("\xE9", 1, ins->b);      /* jmp */
+                break;
+            }
+            case OP_REP_LOOP:
+                /*
+                 * The counter is a boxed int in [0, goal), so stepping it
+                 * cannot carry into the tag and boxed values compare like
+                 * their payloads.
+                 */
+                JIT_EMIT("\x48\x8B\x83");         /* mov rax, [rbx+slot] */
+                jit_u32(slot);
+                JIT_EMIT("\x48\xFF\xC0");         /* inc rax */
+                JIT_EMIT("\x48\x89\x83");         /* mov [rbx+slot], rax */
+                jit_u32(slot);
+                JIT_EMIT("\x49\x3B\x44\x24\xF8"); /* cmp rax, [r12-8] */
+                jit_jump("\x0F\x82", 2, ins->b);  /* jb */
+                break;
+            case OP_POP:
+                JIT_EMIT("\x49\x83\xEC\x08");     /* sub r12, 8 */
+                break;
+            case OP_COUNT_STATEMENT:
+                if (profiling) goto unsupported;
+                JIT_EMIT("\x48\xB8");             /* mov rax, &statement_count */
+                jit_u64((unsigned long long)(size_t)&statement_count);
+                JIT_EMIT("\x48\xFF\x00");         /* inc qword [rax] */
+                break;
+            case OP_CALL:
+                JIT_EMIT("\x48\xBF");             /* mov rdi, site */
+                jit_u64((unsigned long long)(size_t)&func->call_sites[ins->a]);
+                JIT_EMIT("\xBE");                 /* mov esi, arg count */
+                jit_u32(ins->b);
+                JIT_EMIT("\x4C\x89\xE2");         /* mov rdx, r12 */
+                jit_call_helper(jit_call);
+                JIT_EMIT("\x49\x89\xC4");         /* mov r12, rax */
+                jit_reload_frame();
+                break;
+            case OP_TAIL_CALL:
+                JIT_EMIT("\x48\xBF");             /* mov rdi, site */
+                jit_u64((unsigned long long)(size_t)&func->call_sites[ins->a]);
+                JIT_EMIT("\xBE");                 /* mov esi, arg count */
+                jit_u32(ins->b);
+                JIT_EMIT("\x4C\x89\xE2");         /* mov rdx, r12 */
+                jit_call_helper(jit_tail_call);
+                epilogues = grow_array(epilogues, &epilogue_capacity, epilogue_fixups + 1, sizeof(size_t));
+                JIT_EMIT("\xE9");                 /* jmp epilogue */
+                epilogues[epilogue_fixups++] = jit_length;
+                jit_u32(0);
+                break;
+            case OP_BUILTIN:
+                JIT_EMIT("\x49\x83\xEC");         /* sub r12, arg count * 8 */
+                jit_byte(ins->b * sizeof(Value));
+                JIT_EMIT("\xBF");                 /* mov edi, builtin */
+                jit_u32(ins->a);
+                JIT_EMIT("\x4C\x89\xE6");         /* mov rsi, r12 */
+                JIT_EMIT("\xBA");                 /* mov edx, arg count */
+                jit_u32(ins->b);
+                jit_call_helper(call_builtin);
+                break;
+            case OP_PRINT_STR:
+                JIT_EMIT("\x48\xBF");             /* mov rdi, segments */
+                jit_u64((unsigned long long)(size_t)&func->segments[ins->a]);
+                JIT_EMIT("\xBE");                 /* mov esi, count */
+                jit_u32(ins->b);
+                JIT_EMIT("\x48\x89\xDA");         /* mov rdx, rbx */
+                jit_call_helper(jit_print_segments);
+                break;
+            case OP_PRINT_VAR:
+                JIT_EMIT("\x48\x8B\xBB");         /* mov rdi, [rbx+slot] */
+                jit_u32(slot);
+                jit_call_helper(jit_print_variable);
+                break;
+            case OP_PRINT_NUM:
+                JIT_EMIT("\x49\x83\xEC\x08");     /* sub r12, 8 */
+                JIT_EMIT("\x49\x8B\x3C\x24");     /* mov rdi, [r12] */
+                jit_call_helper(jit_print_number);
+                break;
+            case OP_RETURN_NUM:
+            case OP_RETURN_STR:
+                JIT_EMIT("\x48\xB9");             /* mov rcx, &return_value */
+                jit_u64((unsigned long long)(size_t)&return_value);
+                if (ins->op == OP_RETURN_NUM) {
+                    JIT_EMIT("\x49\x83\xEC\x08"); /* sub r12, 8 */
+                    JIT_EMIT("\x49\x8B\x04\x24"); /* mov rax, [r12] */
+                } else {
+                    JIT_EMIT("\x48\xB8");         /* mov rax, string */
+                    jit_u64(make_string(tokens[ins->a].string));
+                }
+                JIT_EMIT("\x48\x89\x01");         /* mov [rcx], rax */
+                /* fall through */
+            case OP_RETURN_RESULT:
+            case OP_RETURN:
+                JIT_EMIT("\x48\xB9");             /* mov rcx, &has_return_value */
+                jit_u64((unsigned long long)(size_t)&has_return_value);
+                JIT_EMIT("\xC7\x01");             /* mov dword [rcx], has value */
+                jit_u32(ins->op != OP_RETURN);
+                epilogues = grow_array(epilogues, &epilogue_capacity, epilogue_fixups + 1, sizeof(size_t));
+                JIT_EMIT("\xE9");                 /* jmp epilogue */
+                epilogues[epilogue_fixups++] = jit_length;
+                jit_u32(0);
+                break;
+            default:
+            unsupported:
+                free(epilogues);
+                return 0;
+        }
+    }
+
+    size_t epilogue = jit_length;
+    offsets[func->code_count] = epilogue;
+    JIT_EMIT("\x41\x5E\x41\x5D\x41\x5C\x5B\x5D\xC3"); /* pop r14, r13, r12, rbx, rbp; ret */
+
+    for (size_t i = 0; i < jit_fixup_count; i++) {
+        int rel = offsets[jit_fixups[i].target] - (jit_fixups[i].at + 4);
+        memcpy(jit_buffer + jit_fixups[i].at, &rel, 4);
+    }
+    for (size_t i = 0; i < epilogue_fixups; i++) {
+        int rel = epilogue - (epilogues[i] + 4);
+        memcpy(jit_buffer + epilogues[i], &rel, 4);
+    }
+    free(epilogues);
+    return 1;
+}
+
+/*
+ * Compiles func to native code unless that was already done or already
+ * failed. Returns whether native code is available.
+ */
+int jit_compile(Function *func) {
+    if (func->jit_state) return func->jit_state > 0;
+
+    unsigned int *offsets = arena_alloc(&program->arena, (func->code_count + 1) * sizeof(unsigned int));
+    if (!jit_translate(func, offsets)) {
+        func->jit_state = -1;
+        return 0;
+    }
+
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t size = (jit_length + page - 1) / page * page;
+    void *code = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (code == MAP_FAILED) {
+        func->jit_state = -1;
+        return 0;
+    }
+    memcpy(code, jit_buffer, jit_length);
+    if (mprotect(code, size, PROT_READ | PROT_EXEC) < 0) {
+        munmap(code, size);
+        func->jit_state = -1;
+        return 0;
+    }
+
+    func->jit_code = code;
+    func->jit_offsets = offsets;
+    func->jit_state = 1;
+    return 1;
+}
+
+/* Continues func in native code at pc, with frame and vm_stack as they are. */
+void jit_run(Function *func, Value *frame, size_t pc) {
+    JitEntry entry = (JitEntry)func->jit_code;
+    jit_depth++;
+    entry(frame, &vm_stack[vm_sp], (char *)func->jit_code + func->jit_offsets[pc]);
+    jit_depth--;
+}
+#endif
+
+/*
+ * Gives func a frame at vm_frame_top and binds its arguments. args may
+ * point into vm_stack, so it is copied into the frame before vm_stack is
+ * allowed to grow.
+ */
+Value *bind_frame(Function *func, Value *args) {
+    vm_frames = grow_array(vm_frames, &vm_frame_capacity, vm_frame_top + func->slot_count, sizeof(Value));
+    Value *frame = &vm_frames[vm_frame_top];
+    vm_frame_top += func->slot_count;
+
+    for (size_t p = 0; p < func->param_count; p++) {
+        frame[p] = args[p];
+    }
+
+    vm_stack = grow_array(vm_stack, &vm_stack_capacity, vm_sp + func->max_stack, sizeof(Value));
+    return frame;
+}
+
+Value *push_call(Function *func, Value *args, size_t profile_mark) {
+    vm_calls = grow_array(vm_calls, &vm_call_capacity, vm_call_top + 1, sizeof(CallFrame));
+    CallFrame *call = &vm_calls[vm_call_top++];
+    call->func = func;
+    call->pc = 0;
+    call->base_sp = vm_sp;
+    call->base_frame = vm_frame_top;
+    call->profile_mark = profile_mark;
+    call->memo = 0;
+    return bind_frame(func, args);
+}
+
+void prep_bytecode(Function *func, const PrepLoop *prep, size_t base, size_t body);
+
+/*
+ * Runs the topmost call, to func, from pc on, together with every bytecode
+ * function it calls in one loop, keeping the calls on vm_calls rather than
+ * the C stack. Returns once func returns, or when it reaches the end of the
+ * prep body it was started in, in which case its call is left in place.
+ * vm_frames and vm_stack may move during a call, so frame is reloaded
+ * whenever control comes back to a caller.
+ */
+void run_frame(Function *func, size_t pc) {
+    size_t entry = vm_call_top - 1;
+    Value *frame = &vm_frames[vm_calls[entry].base_frame];
+    Instr *code = func->code;
+    Token *tokens = func->tokens;
+    Function *callee;
+    Value *callee_args;
+
+#ifdef KINNIE_JIT
+    if (pc == 0 && use_jit && jit_depth < JIT_MAX_DEPTH && ++func->jit_calls >= jit_call_threshold && jit_compile(func)) {
+        jit_run(func, frame, 0);
+        goto native_done;
+    }
+#endif
+
+    for (;;) {
+        Instr *ins = &code[pc++];
+        Value lhs, rhs;
+
+        switch (ins->op) {
+            case OP_PUSH_NUM:
+                vm_stack[vm_sp++] = func->constants[ins->a];
+                break;
+            case OP_LOAD:
+                if (!is_number(frame[ins->a]))
+                    number_error(tokens[ins->b].symbol);
+                vm_stack[vm_sp++] = frame[ins->a];
+                break;
+            case OP_PUSH_STR:
+                vm_stack[vm_sp++] = make_string(tokens[ins->b].string);
+                break;
+            case OP_LOAD_VALUE:
+                vm_stack[vm_sp++] = frame[ins->a];
+                break;
+            case OP_INDEX:
+                vm_stack[vm_sp - 1] = index_number(frame[ins->a], vm_stack[vm_sp - 1], tokens[ins->b].symbol);
+                break;
+            case OP_INDEX_VALUE:
+                vm_stack[vm_sp - 1] = index_value(frame[ins->a], vm_stack[vm_sp - 1], tokens[ins->b].symbol);
+                break;
+            case OP_STORE_NUM:
+                frame[ins->a] = vm_stack[--vm_sp];
+                break;
+            case OP_STORE_STR:
+                frame[ins->a] = make_string(tokens[ins->b].string);
+                break;
+            case OP_STORE_RESULT:
+                if (!has_return_value) {
+                    fail("Function %s did not return a value\n", symbol_name(tokens[ins->b].symbol));
                 }
-                
-                continue;
+                frame[ins->a] = return_value;
+                break;
+            case OP_STORE_INDEX:
+                vm_sp -= 2;
+                store_index(frame[ins->a], vm_stack[vm_sp], vm_stack[vm_sp + 1], tokens[ins->b].symbol);
+                break;
+            case OP_PUSH_RESULT:
+                vm_stack[vm_sp++] = call_result(tokens[ins->b].symbol);
+                break;
+            case OP_PUSH_VALUE:
+                vm_stack[vm_sp++] = call_value(tokens[ins->b].symbol);
+                break;
+            case OP_UNKNOWN_VAR:
+                fail("Unknown variable: %s\n", symbol_name(tokens[ins->a].symbol));
+            case OP_UNKNOWN_COUNTER:
+                fail("Loop counter not found or not int: %s\n", symbol_name(tokens[ins->a].symbol));
+            /* Integer cases of the commonest operators are inlined; everything else goes through arithmetic. */
+            case OP_ADD:
+                rhs = vm_stack[--vm_sp];
+                lhs = vm_stack[vm_sp - 1];
+                if (is_int(lhs) && is_int(rhs))
+                    vm_stack[vm_sp - 1] = make_int(int_of(lhs) + int_of(rhs));
+                else
+                    vm_stack[vm_sp - 1] = arithmetic(OP_ADD, lhs, rhs);
+                break;
+            case OP_SUB:
+                rhs = vm_stack[--vm_sp];
+                lhs = vm_stack[vm_sp - 1];
+                if (is_int(lhs) && is_int(rhs))
+                    vm_stack[vm_sp - 1] = make_int(int_of(lhs) - int_of(rhs));
+                else
+                    vm_stack[vm_sp - 1] = arithmetic(OP_SUB, lhs, rhs);
+                break;
+            case OP_MUL:
+                rhs = vm_stack[--vm_sp];
+                lhs = vm_stack[vm_sp - 1];
+                if (is_int(lhs) && is_int(rhs) && mul_fits(int_of(lhs), int_of(rhs)))
+                    vm_stack[vm_sp - 1] = make_int(int_of(lhs) * int_of(rhs));
+                else
+                    vm_stack[vm_sp - 1] = arithmetic(OP_MUL, lhs, rhs);
+                break;
+            case OP_MOD:
+                rhs = vm_stack[--vm_sp];
+                lhs = vm_stack[vm_sp - 1];
+                if (is_int(lhs) && is_int(rhs) && int_of(rhs) > 0)
+                    vm_stack[vm_sp - 1] = make_int(int_of(lhs) % int_of(rhs));
+                else
+                    vm_stack[vm_sp - 1] = arithmetic(OP_MOD, lhs, rhs);
+                break;
+            case OP_LESS:
+                rhs = vm_stack[--vm_sp];
+                lhs = vm_stack[vm_sp - 1];
+                if (is_int(lhs) && is_int(rhs))
+                    vm_stack[vm_sp - 1] = make_int(int_of(lhs) < int_of(rhs));
+                else
+                    vm_stack[vm_sp - 1] = arithmetic(OP_LESS, lhs, rhs);
+                break;
+            case OP_DIV:
+            case OP_EQUALS:
+            case OP_NOT_EQUALS:
+            case OP_MORE:
+            case OP_MORE_EQUALS:
+            case OP_LESS_EQUALS:
+                vm_sp--;
+                vm_stack[vm_sp - 1] = arithmetic(ins->op, vm_stack[vm_sp - 1], vm_stack[vm_sp]);
+                break;
+            case OP_NEGATE:
+                vm_stack[vm_sp - 1] = negate(vm_stack[vm_sp - 1]);
+                break;
+            case OP_JUMP:
+                pc = ins->b;
+                break;
+            case OP_JUMP_IF_FALSE:
+                if (!is_true(vm_stack[--vm_sp])) pc = ins->b;
+                break;
+            case OP_REP_INIT:
+                vm_stack[vm_sp++] = rep_start(&frame[ins->a], tokens[ins->b].symbol);
+                break;
+            case OP_REP_TEST:
+                lhs = frame[ins->a];
+                if (is_int(lhs) ? int_of(lhs) >= int_of(vm_stack[vm_sp - 1])
+                                : !rep_continues(lhs, vm_stack[vm_sp - 1]))
+                    pc = ins->b;
+                break;
+            case OP_REP_NEXT:
+                rep_step(&frame[ins->a]);
+                pc = ins->b;
+#ifdef KINNIE_JIT
+                if (use_jit && jit_depth < JIT_MAX_DEPTH && ++func->jit_loops >= jit_loop_threshold && jit_compile(func)) {
+                    jit_run(func, frame, pc);
+                    goto native_done;
+                }
+#endif
+                break;
+            case OP_REP_LOOP:
+                frame[ins->a] = make_int(int_of(frame[ins->a]) + 1);
+                if (int_of(frame[ins->a]) < int_of(vm_stack[vm_sp - 1])) pc = ins->b;
+#ifdef KINNIE_JIT
+                if (use_jit && jit_depth < JIT_MAX_DEPTH && ++func->jit_loops >= jit_loop_threshold && jit_compile(func)) {
+                    jit_run(func, frame, pc);
+                    goto native_done;
+                }
+#endif
+                break;
+            case OP_PREP:
+                prep_bytecode(func, &func->preps[ins->a], vm_calls[vm_call_top - 1].base_frame, pc);
+                frame = &vm_frames[vm_calls[vm_call_top - 1].base_frame];
+                pc = ins->b;
+                break;
+            case OP_PREP_END:
+                return;
+            case OP_POP:
+                vm_sp--;
+                break;
+            case OP_COUNT_STATEMENT:
+                statement_count++;
+                if (profiling) line_hits[ins->a]++;
+                break;
+            case OP_PROFILE_ENTER:
+                profile_enter(PROFILE_REP, ins->a);
+                break;
+            case OP_PROFILE_ITERATION:
+                profile_iteration();
+                break;
+            case OP_PROFILE_LEAVE:
+                profile_leave(profile_depth - 1);
+                break;
+            case OP_CALL: {
+                CallSite *site = &func->call_sites[ins->a];
+                if (!site->target)
+                    site->target = resolve_function(site->name, ins->b);
+                size_t memo = 0;
+                if (site->target->pure) {
+                    if (memo_lookup(site->target, &vm_stack[vm_sp - ins->b])) {
+                        vm_sp -= ins->b;
+                        break;
+                    }
+                    memo = memo_push(site->target, &vm_stack[vm_sp - ins->b]);
+                }
+                if (++call_depth > max_call_depth) {
+                    fail("Call depth exceeded\n");
+                }
+
+                vm_sp -= ins->b;
+                vm_calls[vm_call_top - 1].pc = pc;
+                has_return_value = 0;
+                func = site->target;
+                frame = push_call(func, &vm_stack[vm_sp], profiling ? profile_enter(PROFILE_FUNCTION, func->name) : 0);
+                vm_calls[vm_call_top - 1].memo = memo;
+                code = func->code;
+                tokens = func->tokens;
+                pc = 0;
+
+#ifdef KINNIE_JIT
+                if (use_jit && jit_depth < JIT_MAX_DEPTH && ++func->jit_calls >= jit_call_threshold && jit_compile(func)) {
+                    jit_run(func, frame, 0);
+                    goto native_done;
+                }
+#endif
+                break;
             }
-            
-            if (tokens[i].type == TOK_STRING) {
-                set_var_string(name, tokens[i].text);
-                i++;
-            } else {
-                double value = evaluate_expression(tokens, &i);
-                set_var_double(name, value);
+            case OP_TAIL_CALL: {
+                CallSite *site = &func->call_sites[ins->a];
+                if (!site->target)
+                    site->target = resolve_function(site->name, ins->b);
+                vm_sp -= ins->b;
+                callee = site->target;
+                callee_args = &vm_stack[vm_sp];
+                goto tail_call;
             }
-            continue;
+            case OP_BUILTIN:
+                vm_sp -= ins->b;
+                call_builtin(ins->a, &vm_stack[vm_sp], ins->b);
+                break;
+            case OP_PRINT_STR:
+                print_segments(&func->segments[ins->a], ins->b, frame);
+                out_end();
+                break;
+            case OP_PRINT_VAR:
+                if (is_string(frame[ins->a]))
+                    print_text(pool_text(string_of(frame[ins->a])), 0);
+                else
+                    out_value(frame[ins->a]);
+                out_end();
+                break;
+            case OP_PRINT_NUM:
+                out_value(vm_stack[--vm_sp]);
+                out_end();
+                break;
+            case OP_RETURN_NUM:
+                return_value = vm_stack[--vm_sp];
+                has_return_value = 1;
+                goto done;
+            case OP_RETURN_STR:
+                return_value = make_string(tokens[ins->a].string);
+                has_return_value = 1;
+                goto done;
+            case OP_RETURN_RESULT:
+                goto done;
+            case OP_RETURN:
+                has_return_value = 0;
+                goto done;
         }
+        continue;
 
-        if (tokens[i].type == TOK_IDENT && tokens[i + 1].type == TOK_ASSIGN) {
-            char name[MAX_NAME_LEN];
-            strcpy(name, tokens[i].text);
-            i += 2;
-            
-            if (tokens[i].type == TOK_IDENT && tokens[i + 1].type == TOK_LBRACKET) {
-                char func_name[MAX_NAME_LEN];
-                strcpy(func_name, tokens[i].text);
-                i += 2;
-                
-                double args[MAX_FUNC_PARAMS];
-                size_t arg_count = 0;
-                
-                while (tokens[i].type != TOK_RBRACKET && tokens[i].type != TOK_EOF) {
-                    args[arg_count++] = evaluate_expression(tokens, &i);
-                    if (tokens[i].type == TOK_COMMA) i++;
-                }
-                i++;
-                
-                call_function(func_name, args, arg_count);
-                
-                if (has_return_value) {
-                    if (return_value.var_type == VAR_DOUBLE) {
-                        set_var_double(name, return_value.double_value);
-                    } else if (return_value.var_type == VAR_STRING) {
-                        set_var_string(name, return_value.string_value);
-                    }
-                } else {
-                    fprintf(stderr, "Function %s did not return a value\n", func_name);
-                    exit(1);
-                }
-                
-                continue;
+#ifdef KINNIE_JIT
+    native_done:
+        if (!tail_function) goto done;
+        callee = tail_function;
+        callee_args = tail_args;
+        tail_function = NULL;
+#endif
+
+    /* The callee takes over this call's frame and CallFrame. */
+    tail_call: {
+        CallFrame *call = &vm_calls[vm_call_top - 1];
+        if (callee->pure) {
+            if (memo_lookup(callee, callee_args)) goto done;
+            if (!call->memo) call->memo = memo_push(callee, callee_args);
+        }
+        if (profiling) call->profile_mark = profile_replace(call->profile_mark, callee->name);
+
+        has_return_value = 0;
+        vm_sp = call->base_sp;
+        vm_frame_top = call->base_frame;
+        func = call->func = callee;
+        frame = bind_frame(func, callee_args);
+        code = func->code;
+        tokens = func->tokens;
+        pc = 0;
+
+#ifdef KINNIE_JIT
+        if (use_jit && jit_depth < JIT_MAX_DEPTH && ++func->jit_calls >= jit_call_threshold && jit_compile(func)) {
+            jit_run(func, frame, 0);
+            goto native_done;
+        }
+#endif
+        continue;
+    }
+
+    done: {
+        CallFrame *call = &vm_calls[--vm_call_top];
+        if (call->memo) {
+            memo_call_top = call->memo - 1;
+            memo_store(memo_calls[memo_call_top].func, memo_calls[memo_call_top].args);
+        }
+        vm_sp = call->base_sp;
+        vm_frame_top = call->base_frame;
+        if (vm_call_top == entry) return;
+
+        if (profiling) profile_leave(call->profile_mark);
+        call_depth--;
+
+        call = &vm_calls[vm_call_top - 1];
+        func = call->func;
+        code = func->code;
+        tokens = func->tokens;
+        pc = call->pc;
+        frame = &vm_frames[call->base_frame];
+    }
+    }
+}
+
+void run_bytecode(Function *func, Value *args) {
+    push_call(func, args, profiling ? profile_depth - 1 : 0);
+    run_frame(func, 0);
+}
+
+/* Runs one chunk of a prep loop in bytecode, in a call of its own. */
+void prep_bytecode_chunk(PrepJob *job, size_t chunk) {
+    Function *func = job->func;
+    long long first, last;
+    long long counts[MAX_REDUCTIONS] = {0};
+    prep_range(job, chunk, &first, &last);
+
+    size_t calls = vm_call_top;
+    Value *frame = push_call(func, job->frame, 0);
+    size_t base = frame - vm_frames;
+    memcpy(frame, job->frame, func->slot_count * sizeof(Value));
+    for (int r = 0; r < job->reduction_count; r++) {
+        frame[job->reductions[r].slot] = reduction_start(job->reductions[r].kind);
+    }
+
+    for (long long k = first; k < last; k++) {
+        frame = &vm_frames[base];
+        frame[job->counter] = make_int(k);
+        for (int r = 0; r < job->reduction_count; r++) {
+            if (job->reductions[r].kind == REDUCE_COUNT)
+                frame[job->reductions[r].slot] = make_int(0);
+        }
+
+        run_frame(func, job->body);
+        if (vm_call_top == calls) prep_return_error();
+
+        frame = &vm_frames[base];
+        for (int r = 0; r < job->reduction_count; r++) {
+            Value v = frame[job->reductions[r].slot];
+            if (job->reductions[r].kind != REDUCE_COUNT) continue;
+            if (!is_number(v)) number_error(job->reductions[r].name);
+            if (is_true(v)) counts[r]++;
+        }
+    }
+
+    for (int r = 0; r < job->reduction_count; r++) {
+        Value v = frame[job->reductions[r].slot];
+        job->results[chunk * job->reduction_count + r] = job->reductions[r].kind == REDUCE_COUNT ? make_int(counts[r]) : v;
+    }
+
+    CallFrame *call = &vm_calls[--vm_call_top];
+    vm_sp = call->base_sp;
+    vm_frame_top = call->base_frame;
+}
+
+/*
+ * Runs the prep loop whose body starts at body in func, on the frame at
+ * vm_frames[base]. Its chunks run on copies of the frame; only the counter,
+ * which ends at the goal, and the reductions change in the original.
+ */
+void prep_bytecode(Function *func, const PrepLoop *prep, size_t base, size_t body) {
+    Value *frame = &vm_frames[base];
+    PrepJob job;
+    memset(&job, 0, sizeof(job));
+    job.run_chunk = prep_bytecode_chunk;
+    job.counter = prep->counter;
+    Value goal = rep_start(&frame[prep->counter], func->tokens[prep->name].symbol);
+    job.iterations = int_of(goal);
+    job.reductions = prep->reductions;
+    job.reduction_count = prep->reduction_count;
+    for (int r = 0; r < prep->reduction_count; r++) {
+        if (!is_number(frame[prep->reductions[r].slot])) number_error(prep->reductions[r].name);
+    }
+
+    job.func = func;
+    job.body = body;
+    job.frame = malloc((func->slot_count + 1) * sizeof(Value));
+    if (!job.frame) {
+        fail_errno("malloc");
+    }
+    memcpy(job.frame, frame, func->slot_count * sizeof(Value));
+
+    prep_run(&job);
+
+    frame = &vm_frames[base];
+    frame[prep->counter] = goal;
+    for (int r = 0; r < prep->reduction_count; r++) {
+        Value *v = &frame[prep->reductions[r].slot];
+        *v = prep_reduce(&job, r, *v);
+    }
+    prep_free(&job);
+}
+
+/* Finds the program's functions in tokens and, unless --walk is on, compiles them. */
+void load_program(Token tokens[], size_t token_count) {
+    program->tokens = tokens;
+    program->token_count = token_count;
+    parse_functions(tokens, token_count);
+
+    if (!use_token_walker) {
+        for (size_t i = 0; i < program->function_count; i++) {
+            compile_function(program->functions[i]);
+        }
+    }
+}
+
+/* Runs the loaded program's main, or prints its bytecode for --dump-optimized. */
+void interpret(void) {
+    if (profiling) profile_start();
+
+    if (dump_optimized) {
+        for (size_t i = 0; i < program->function_count; i++) {
+            dump_function(program->functions[i]);
+        }
+        return;
+    }
+
+    int main_name = intern("main", 4);
+    Function *main_func = get_function(main_name);
+    if (!main_func) {
+        fail("No 'main' function found\n");
+    }
+
+    Value no_args[1];
+    call_function(resolve_function(main_name, 0), no_args);
+}
+
+#ifdef KINNIE_JIT
+char *read_all(FILE *f, size_t *size) {
+    fseek(f, 0, SEEK_END);
+    *size = ftell(f);
+    rewind(f);
+
+    char *data = malloc(*size + 1);
+    if (!data) {
+        fail_errno("malloc");
+    }
+    *size = fread(data, 1, *size, f);
+    return data;
+}
+
+/* Runs the program in a child process with stdout and stderr captured. */
+int run_captured(int jit, FILE *out, FILE *err) {
+    pid_t pid = fork();
+    if (pid < 0) {
+        fail_errno("fork");
+    }
+
+    if (pid == 0) {
+        dup2(fileno(out), STDOUT_FILENO);
+        dup2(fileno(err), STDERR_FILENO);
+        use_jit = jit;
+        interpret();
+        exit(0);
+    }
+
+    int status;
+    waitpid(pid, &status, 0);
+    return status;
+}
+
+int compare_output(const char *what, const char *expected, size_t expected_size, const char *actual, size_t actual_size) {
+    size_t i = 0;
+    while (i < expected_size && i < actual_size && expected[i] == actual[i]) i++;
+    if (i == expected_size && i == actual_size) return 1;
+
+    fprintf(stderr, "jit-check: %s differs at byte %zu (interpreter %zu bytes, JIT %zu bytes)\n",
+            what, i, expected_size, actual_size);
+    return 0;
+}
+
+/*
+ * --jit-check: runs the program in the interpreter and again with every
+ * function compiled as soon as it runs, then compares stdout, stderr and
+ * exit status. The interpreter's output is passed through.
+ */
+int run_jit_check(void) {
+    FILE *files[4];
+    for (int i = 0; i < 4; i++) {
+        files[i] = tmpfile();
+        if (!files[i]) {
+            perror("tmpfile");
+            return 1;
+        }
+    }
+
+    jit_call_threshold = jit_loop_threshold = 1;
+    int expected_status = run_captured(0, files[0], files[1]);
+    int actual_status = run_captured(1, files[2], files[3]);
+
+    size_t sizes[4];
+    char *data[4];
+    for (int i = 0; i < 4; i++) {
+        data[i] = read_all(files[i], &sizes[i]);
+        fclose(files[i]);
+    }
+
+    fwrite(data[0], 1, sizes[0], stdout);
+    fflush(stdout);
+    fwrite(data[1], 1, sizes[1], stderr);
+
+    int same = compare_output("stdout", data[0], sizes[0], data[2], sizes[2]);
+    same &= compare_output("stderr", data[1], sizes[1], data[3], sizes[3]);
+    if (expected_status != actual_status) {
+        fprintf(stderr, "jit-check: exit status differs (interpreter %d, JIT %d)\n", expected_status, actual_status);
+        same = 0;
+    }
+    if (same)
+        fprintf(stderr, "jit-check: JIT output matches the interpreter\n");
+
+    for (int i = 0; i < 4; i++) free(data[i]);
+
+    if (!same) return 1;
+    return WIFEXITED(expected_status) ? WEXITSTATUS(expected_status) : 1;
+}
+#endif
+
+int has_extension(const char *name, const char *ext) {
+    size_t nlen = strlen(name);
+    size_t elen = strlen(ext);
+    if (nlen < elen) return 0;
+    return strcmp(name + nlen - elen, ext) == 0;
+}
+
+/*
+ * Maps a source file read-only. The tokenizer reads it front to back once,
+ * so the kernel is told to read ahead and drop pages behind. Platforms
+ * without mmap fall back to reading the file into memory.
+ */
+const char *load_source(const char *path, size_t *size) {
+#ifdef _WIN32
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        fail_errno("fopen");
+    }
+
+    fseek(f, 0, SEEK_END);
+    long length = ftell(f);
+    rewind(f);
+
+    if (length <= 0) {
+        fail("The file is empty\n");
+    }
+
+    char *source = malloc(length);
+    if (!source) {
+        fail_errno("malloc");
+    }
+
+    *size = fread(source, 1, length, f);
+    fclose(f);
+    return source;
+#else
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        fail_errno("open");
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        fail_errno("fstat");
+    }
+
+    if (st.st_size <= 0) {
+        close(fd);
+        fail("The file is empty\n");
+    }
+
+    void *source = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (source == MAP_FAILED) {
+        fail_errno("mmap");
+    }
+
+    madvise(source, st.st_size, MADV_SEQUENTIAL);
+    *size = st.st_size;
+    return source;
+#endif
+}
+
+void unload_source(const char *source, size_t size) {
+#ifdef _WIN32
+    (void)size;
+    free((char *)source);
+#else
+    munmap((void *)source, size);
+#endif
+}
+
+/*
+ * .knc images. Running file.kn writes file.knc next to it: the tokens and
+ * line table, the string pool and symbols and, when the run compiled them
+ * as a plain run does, the bytecode of every function. Later runs of the
+ * same source map the image and skip the tokenizer, and usually the
+ * parser and compiler too. The image is a header followed by sections;
+ * everything in it is an offset or an index, so it works wherever it is
+ * mapped. An image is used only if its version, struct layout, source
+ * size and source hash all match; KNC_VERSION goes up whenever the token
+ * or bytecode format changes.
+ */
+typedef struct {
+    unsigned long long offset;
+    unsigned long long count;
+} ImageSection;
+
+typedef struct {
+    char magic[4];
+    unsigned int version;
+    unsigned long long layout;
+    unsigned long long source_hash;
+    unsigned long long source_size;
+    int line_count;
+    int compiled;
+    unsigned long long memo_count;
+    ImageSection tokens;
+    ImageSection token_lines;
+    ImageSection string_pool;
+    ImageSection symbol_names;
+    ImageSection symbol_table;
+    ImageSection functions;
+} ImageHeader;
+
+/* A compiled function in an image. Its arrays are sections of their own. */
+typedef struct {
+    int name;
+    int pure;
+    int param_names[MAX_FUNC_PARAMS];
+    unsigned long long param_count;
+    unsigned long long first_token;
+    unsigned long long token_count;
+    unsigned long long memo;
+    unsigned long long max_stack;
+    unsigned long long slot_count;
+    ImageSection code;
+    ImageSection constants;
+    ImageSection segments;
+    ImageSection call_names;
+    ImageSection preps;
+} ImageFunction;
+
+#define IMAGE_LAYOUT ((unsigned long long)sizeof(Token) | (unsigned long long)sizeof(Instr) << 8 | \
+                      (unsigned long long)sizeof(Segment) << 16 | (unsigned long long)sizeof(PrepLoop) << 24 | \
+                      (unsigned long long)sizeof(ImageFunction) << 32 | (unsigned long long)sizeof(size_t) << 48)
+
+int use_cache = 1;
+
+/* A 64-bit hash of data, to tell whether an image was made from it. */
+unsigned long long hash_source(const char *data, size_t size) {
+    unsigned long long hash = 0xcbf29ce484222325ULL ^ size;
+    size_t i = 0;
+
+    for (; i + 8 <= size; i += 8) {
+        unsigned long long word;
+        memcpy(&word, data + i, sizeof(word));
+        hash = (hash ^ word) * 0x100000001b3ULL;
+        hash ^= hash >> 29;
+    }
+    for (; i < size; i++) {
+        hash = (hash ^ (unsigned char)data[i]) * 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+/* Whether functions compiled in this run are what a plain run compiles. */
+int compiles_plain(void) {
+    return !use_token_walker && !count_statements && !profiling;
+}
+
+/* Appends count items of data to the image at a 16-byte boundary and returns their section. */
+ImageSection image_append(char **image, size_t *length, size_t *capacity, const void *data, size_t count, size_t item_size) {
+    ImageSection section;
+    size_t offset = (*length + 15) & ~(size_t)15;
+    size_t size = count * item_size;
+
+    *image = grow_array(*image, capacity, offset + size, 1);
+    memset(*image + *length, 0, offset - *length);
+    if (size) memcpy(*image + offset, data, size);
+    *length = offset + size;
+
+    section.offset = offset;
+    section.count = count;
+    return section;
+}
+
+#ifndef _WIN32
+mode_t image_mode;
+pthread_once_t image_mode_once = PTHREAD_ONCE_INIT;
+
+/* umask can only be read by setting it, so this happens once, before any image is written. */
+void read_image_mode(void) {
+    mode_t mask = umask(0);
+    umask(mask);
+    image_mode = 0666 & ~mask;
+}
+#endif
+
+/* Writes the loaded program to path as an image of source. Failing to write it is not an error. */
+void cache_save(const char *path, unsigned long long hash, size_t source_size) {
+    ImageHeader header;
+    char *image = NULL;
+    size_t length = 0;
+    size_t capacity = 0;
+    size_t token_count = program->token_count + 1;
+
+    memset(&header, 0, sizeof(header));
+    image_append(&image, &length, &capacity, &header, 1, sizeof(header));
+    header.tokens = image_append(&image, &length, &capacity, program->tokens, token_count, sizeof(Token));
+    header.token_lines = image_append(&image, &length, &capacity, program->token_lines, token_count, sizeof(int));
+    header.string_pool = image_append(&image, &length, &capacity, program->string_pool, program->string_pool_size, 1);
+    header.symbol_names = image_append(&image, &length, &capacity, program->symbol_names, program->symbol_count, sizeof(size_t));
+    header.symbol_table = image_append(&image, &length, &capacity, program->symbol_table, program->symbol_table_size, sizeof(int));
+
+    header.compiled = compiles_plain();
+    if (header.compiled) {
+        ImageFunction *functions = calloc(program->function_count + 1, sizeof(ImageFunction));
+        if (!functions) {
+            fail_errno("calloc");
+        }
+
+        for (size_t f = 0; f < program->function_count; f++) {
+            Function *func = program->functions[f];
+            ImageFunction *out = &functions[f];
+            int *call_names = malloc((func->call_site_count + 1) * sizeof(int));
+            if (!call_names) {
+                fail_errno("malloc");
             }
-            
-            if (tokens[i].type == TOK_STRING) {
-                set_var_string(name, tokens[i].text);
-                i++;
-            } else {
-                double value = evaluate_expression(tokens, &i);
-                set_var_double(name, value);
+            for (size_t c = 0; c < func->call_site_count; c++) {
+                call_names[c] = func->call_sites[c].name;
             }
-            continue;
+
+            out->name = func->name;
+            out->pure = func->pure;
+            memcpy(out->param_names, func->param_names, sizeof(out->param_names));
+            out->param_count = func->param_count;
+            out->first_token = func->tokens - program->tokens;
+            out->token_count = func->token_count;
+            out->memo = func->memo;
+            out->max_stack = func->max_stack;
+            out->slot_count = func->slot_count;
+            out->code = image_append(&image, &length, &capacity, func->code, func->code_count, sizeof(Instr));
+            out->constants = image_append(&image, &length, &capacity, func->constants, func->constant_count, sizeof(Value));
+            out->segments = image_append(&image, &length, &capacity, func->segments, func->segment_count, sizeof(Segment));
+            out->call_names = image_append(&image, &length, &capacity, call_names, func->call_site_count, sizeof(int));
+            out->preps = image_append(&image, &length, &capacity, func->preps, func->prep_count, sizeof(PrepLoop));
+            free(call_names);
+        }
+        header.functions = image_append(&image, &length, &capacity, functions, program->function_count, sizeof(ImageFunction));
+        free(functions);
+    }
+
+    memcpy(header.magic, "KNC", 4);
+    header.version = KNC_VERSION;
+    header.layout = IMAGE_LAYOUT;
+    header.source_hash = hash;
+    header.source_size = source_size;
+    header.line_count = program->line_count;
+    header.memo_count = program->memo_count;
+    memcpy(image, &header, sizeof(header));
+
+    /*
+     * Written under a name of its own first, so no run ever maps half an
+     * image, even when several threads of --serve write one at once.
+     */
+    char temporary[FILENAME_MAX];
+    if (snprintf(temporary, sizeof(temporary), "%s.XXXXXX", path) >= (int)sizeof(temporary)) {
+        free(image);
+        return;
+    }
+#ifdef _WIN32
+    FILE *f = _mktemp(temporary) ? fopen(temporary, "wb") : NULL;
+#else
+    /* mkstemp makes the file private; an image gets the mode any new file would. */
+    pthread_once(&image_mode_once, read_image_mode);
+    int fd = mkstemp(temporary);
+    if (fd >= 0) fchmod(fd, image_mode);
+    FILE *f = fd >= 0 ? fdopen(fd, "wb") : NULL;
+    if (fd >= 0 && !f) close(fd);
+#endif
+    if (f) {
+        int written = fwrite(image, 1, length, f) == length;
+#ifdef _WIN32
+        remove(path);
+#endif
+        if (fclose(f) == 0 && written && rename(temporary, path) == 0) {
+            free(image);
+            return;
+        }
+        remove(temporary);
+    }
+    free(image);
+}
+
+/* Whether section, of items of item_size bytes, lies inside an image of size bytes. */
+int section_fits(ImageSection section, size_t item_size, size_t size) {
+    return section.offset <= size && section.count <= (size - section.offset) / item_size;
+}
+
+/* Maps path if it exists and is not empty; returns NULL otherwise. */
+const char *map_image(const char *path, size_t *size) {
+#ifdef _WIN32
+    FILE *f = fopen(path, "rb");
+    if (!f) return NULL;
+
+    fseek(f, 0, SEEK_END);
+    long length = ftell(f);
+    rewind(f);
+
+    char *image = length > 0 ? malloc(length) : NULL;
+    if (image) *size = fread(image, 1, length, f);
+    fclose(f);
+    return image;
+#else
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return NULL;
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size <= 0) {
+        close(fd);
+        return NULL;
+    }
+
+    void *image = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (image == MAP_FAILED) return NULL;
+
+    *size = st.st_size;
+    return image;
+#endif
+}
+
+/* What cache_load got out of an image. */
+enum {CACHE_MISS, CACHE_TOKENS, CACHE_PROGRAM};
+
+/*
+ * Loads the program from the image at path if it was made from source.
+ * With CACHE_TOKENS the functions still have to be parsed and compiled,
+ * because the image holds no bytecode or this run compiles differently.
+ */
+int cache_load(const char *path, unsigned long long hash, size_t source_size) {
+    size_t size;
+    const char *image = map_image(path, &size);
+    if (!image) return CACHE_MISS;
+
+    ImageHeader header;
+    int valid = size >= sizeof(header);
+    if (valid) {
+        memcpy(&header, image, sizeof(header));
+        valid = memcmp(header.magic, "KNC", 4) == 0 && header.version == KNC_VERSION &&
+                header.layout == IMAGE_LAYOUT && header.source_hash == hash &&
+                header.source_size == source_size && header.tokens.count > 0 &&
+                header.token_lines.count == header.tokens.count &&
+                section_fits(header.tokens, sizeof(Token), size) &&
+                section_fits(header.token_lines, sizeof(int), size) &&
+                section_fits(header.string_pool, 1, size) &&
+                section_fits(header.symbol_names, sizeof(size_t), size) &&
+                section_fits(header.symbol_table, sizeof(int), size) &&
+                section_fits(header.functions, sizeof(ImageFunction), size);
+    }
+
+    /* header is only read from the image when it is long enough to hold one. */
+    const ImageFunction *functions = valid ? (const ImageFunction *)(image + header.functions.offset) : NULL;
+    for (size_t f = 0; valid && f < header.functions.count; f++) {
+        const ImageFunction *in = &functions[f];
+        valid = in->first_token + in->token_count < header.tokens.count &&
+                section_fits(in->code, sizeof(Instr), size) &&
+                section_fits(in->constants, sizeof(Value), size) &&
+                section_fits(in->segments, sizeof(Segment), size) &&
+                section_fits(in->call_names, sizeof(int), size) &&
+                section_fits(in->preps, sizeof(PrepLoop), size);
+    }
+    if (!valid) {
+        unload_source(image, size);
+        return CACHE_MISS;
+    }
+
+    program->image = image;
+    program->image_size = size;
+    program->tokens = (Token *)(image + header.tokens.offset);
+    program->token_count = header.tokens.count - 1;
+    program->token_lines = (int *)(image + header.token_lines.offset);
+    program->line_count = header.line_count;
+
+    /* Strings and symbols can still be added to, so they are copied. */
+    program->string_pool = grow_array(NULL, &program->string_pool_capacity, header.string_pool.count + 1, 1);
+    memcpy(program->string_pool, image + header.string_pool.offset, header.string_pool.count);
+    program->string_pool_size = header.string_pool.count;
+    program->symbol_names = grow_array(NULL, &program->symbol_capacity, header.symbol_names.count + 1, sizeof(size_t));
+    memcpy(program->symbol_names, image + header.symbol_names.offset, header.symbol_names.count * sizeof(size_t));
+    program->symbol_count = header.symbol_names.count;
+    program->symbol_table = calloc(header.symbol_table.count + 1, sizeof(int));
+    if (!program->symbol_table) {
+        fail_errno("calloc");
+    }
+    memcpy(program->symbol_table, image + header.symbol_table.offset, header.symbol_table.count * sizeof(int));
+    program->symbol_table_size = header.symbol_table.count;
+
+    if (!header.compiled || !compiles_plain()) return CACHE_TOKENS;
+
+    for (size_t f = 0; f < header.functions.count; f++) {
+        const ImageFunction *in = &functions[f];
+        Function *func = arena_alloc(&program->arena, sizeof(Function));
+        memset(func, 0, sizeof(Function));
+
+        func->name = in->name;
+        func->pure = in->pure;
+        memcpy(func->param_names, in->param_names, sizeof(func->param_names));
+        func->param_count = in->param_count;
+        func->tokens = program->tokens + in->first_token;
+        func->token_count = in->token_count;
+        func->memo = in->memo;
+        func->max_stack = in->max_stack;
+        func->slot_count = in->slot_count;
+        func->code = (Instr *)(image + in->code.offset);
+        func->code_count = in->code.count;
+        func->constants = (Value *)(image + in->constants.offset);
+        func->constant_count = in->constants.count;
+        func->segments = (Segment *)(image + in->segments.offset);
+        func->segment_count = in->segments.count;
+        func->preps = (PrepLoop *)(image + in->preps.offset);
+        func->prep_count = in->preps.count;
+
+        const int *call_names = (const int *)(image + in->call_names.offset);
+        func->call_sites = arena_alloc(&program->arena, (in->call_names.count + 1) * sizeof(CallSite));
+        func->call_site_count = in->call_names.count;
+        for (size_t c = 0; c < func->call_site_count; c++) {
+            func->call_sites[c].name = call_names[c];
+            func->call_sites[c].target = NULL;
         }
 
-        if (tokens[i].type == TOK_IDENT && tokens[i + 1].type == TOK_LBRACKET) {
-            char func_name[MAX_NAME_LEN];
-            strcpy(func_name, tokens[i].text);
-            i += 2;
-            
-            double args[MAX_FUNC_PARAMS];
-            size_t arg_count = 0;
-            
-            while (tokens[i].type != TOK_RBRACKET && tokens[i].type != TOK_EOF) {
-                if (arg_count >= MAX_FUNC_PARAMS) {
-                    fprintf(stderr, "Too many arguments\n");
-                    exit(1);
-                }
-                
-                args[arg_count++] = evaluate_expression(tokens, &i);
-                
-                if (tokens[i].type == TOK_COMMA) {
-                    i++;
-                }
-            }
-            
-            if (tokens[i].type != TOK_RBRACKET) {
-                fprintf(stderr, "Expected ')'\n");
-                exit(1);
-            }
-            i++;
-            
-            call_function(func_name, args, arg_count);
-            continue;
-        }
+        program->functions = grow_array(program->functions, &program->function_capacity, program->function_count + 1, sizeof(Function *));
+        program->functions[program->function_count++] = func;
+        register_function(func);
+    }
+    program->memo_count = header.memo_count;
+
+    for (size_t f = 0; f < program->function_count; f++) {
+        link_call_sites(program->functions[f]);
+    }
+    return CACHE_PROGRAM;
+}
+
+/*
+ * Loads the program in source, read from path, through its image when
+ * there is a usable one, and writes a new image when that saves the next
+ * run some work.
+ */
+void load_file(const char *path, const char *source, size_t size) {
+    char image_path[FILENAME_MAX];
+    Token *tokens;
+
+    if (!use_cache || snprintf(image_path, sizeof(image_path), "%sc", path) >= (int)sizeof(image_path)) {
+        size_t token_count = tokenize(source, size, &tokens);
+        load_program(tokens, token_count);
+        return;
+    }
+
+    unsigned long long hash = hash_source(source, size);
+    int cached = cache_load(image_path, hash, size);
+
+    if (cached == CACHE_MISS) {
+        size_t token_count = tokenize(source, size, &tokens);
+        load_program(tokens, token_count);
+        cache_save(image_path, hash, size);
+    } else if (cached == CACHE_TOKENS) {
+        load_program(program->tokens, program->token_count);
+        if (compiles_plain()) cache_save(image_path, hash, size);
+    }
+}
+
+/*
+ * Prints the --stats line to stderr after the program's own output, in a
+ * key=value form that bench/run.sh parses.
+ */
+void report_stats(size_t token_count) {
+    if (!show_stats) return;
+    out_flush();
+    fprintf(stderr, "tokens=%zu statements=%zu\n", token_count, statement_count);
+
+    memo_merge();
+    for (size_t i = 0; i < program->function_count; i++) {
+        Function *func = program->functions[i];
+        if (func->pure)
+            fprintf(stderr, "memo %s: hits=%zu misses=%zu\n", symbol_name(func->name), func->memo_hits, func->memo_misses);
+    }
+}
+
+/* Frees everything p holds, including the image its tokens were mapped from. */
+void free_program(Program *p) {
+    Program *running = program;
+    program = p;
+    memo_free();
+    program = running;
+
+    arena_free(&p->arena);
+    free(p->string_pool);
+    free(p->symbol_names);
+    free(p->symbol_table);
+    free(p->functions);
+    free(p->function_table);
+    if (p->image) {
+        unload_source(p->image, p->image_size);
+    } else {
+        free(p->tokens);
+        free(p->token_lines);
+    }
+}
+
+/*
+ * The C API of kinnie.h. Each call makes ctx's program the one this thread
+ * runs and sets fail_target, so that an error unwinds to the call instead
+ * of ending the process.
+ */
+struct kinnie_ctx {
+    Program program;
+    int loaded;
+    char error[FAIL_MESSAGE_SIZE];
+};
+
+kinnie_ctx *kinnie_create(void) {
+    return calloc(1, sizeof(kinnie_ctx));
+}
+
+#ifdef KINNIE_THREADS
+/*
+ * The stacks and scratch space a thread keeps between calls. They are
+ * freed when a thread that made a C API call exits, through the destructor
+ * of thread_state_key, so a pool of threads running scripts leaks nothing.
+ */
+pthread_key_t thread_state_key;
+pthread_once_t thread_state_once = PTHREAD_ONCE_INIT;
+
+void free_thread_state(void *unused) {
+    (void)unused;
+    free(vm_stack);
+    free(vm_frames);
+    free(vm_calls);
+    free(memo_calls);
+    free(scope_stack);
+    free(walker_vars);
+    free(out_buffer);
+    free(compiler.bindings);
+    free(compiler.scope_start);
+    free(compiler.code);
+    free(compiler.constants);
+    free(compiler.segments);
+    free(compiler.call_sites);
+    free(compiler.preps);
+    vm_stack = NULL;
+    vm_frames = NULL;
+    vm_calls = NULL;
+    memo_calls = NULL;
+    scope_stack = NULL;
+    walker_vars = NULL;
+    out_buffer = NULL;
+    vm_stack_capacity = vm_frame_capacity = vm_call_capacity = memo_call_capacity = 0;
+    scope_capacity = walker_var_capacity = out_capacity = out_length = 0;
+    memset(&compiler, 0, sizeof(compiler));
+}
+
+void make_thread_state_key(void) {
+    pthread_key_create(&thread_state_key, free_thread_state);
+}
+#endif
 
-        if (tokens[i].type == TOK_PRINT) {
-            TokenType print_type = tokens[i].type;
-            i++;
-            
-            if (tokens[i].type == TOK_STRING) {
-                char *str = tokens[i].text;
-                for (size_t j = 0; str[j] != '\0'; j++) {
-                    if (str[j] == '\\' && str[j+1] == 'n') {
-                        putchar('\n');
-                        j++;
-                    } else if (str[j] == '{') {
-                        j++;
-                        char var_name[MAX_NAME_LEN];
-                        size_t var_name_i = 0;
-
-                        while (str[j] != '}' && str[j] != '\0') {
-                            var_name[var_name_i++] = str[j++];
-                        }
-                        var_name[var_name_i] = '\0';
+void api_enter(kinnie_ctx *ctx, jmp_buf *target) {
+#ifdef KINNIE_THREADS
+    pthread_once(&thread_state_once, make_thread_state_key);
+    if (!pthread_getspecific(thread_state_key)) pthread_setspecific(thread_state_key, &thread_state_key);
+#endif
+    program = &ctx->program;
+    fail_target = target;
+    ctx->error[0] = '\0';
+}
 
-                        if (str[j] != '}') {
-                            fprintf(stderr, "Missing closing '}' in string interpolation\n");
-                            exit(1);
-                        }
+/* Ends a C API call on ctx and returns its status. */
+int api_leave(kinnie_ctx *ctx, int failed) {
+    if (failed) {
+        reset_runtime();
+        memcpy(ctx->error, fail_message, sizeof(ctx->error));
+    }
+    fail_target = NULL;
+    out_flush();
+    memo_merge();
+    free_arrays(NULL);
+    free_maps(NULL);
+    program = NULL;
+    return failed ? KINNIE_ERROR : KINNIE_OK;
+}
 
-                        Variable *temp_var = get_var(var_name);
-                        if (!temp_var) {
-                            fprintf(stderr, "Variable not found: %s\n", var_name);
-                            exit(1);
-                        }
+int kinnie_load(kinnie_ctx *ctx, const char *source, size_t length) {
+    jmp_buf target;
+    if (setjmp(target)) return api_leave(ctx, 1);
+    api_enter(ctx, &target);
 
-                        switch (temp_var->var_type) {
-                            case VAR_DOUBLE:
-                                printf("%.1lf", temp_var->double_value);
-                                break;
-                            case VAR_STRING:
-                                printf("%s", temp_var->string_value);
-                                break;
-                            default:
-                                fprintf(stderr, "Cannot interpolate variable of this type\n");
-                                exit(1);
-                        }
-                    }else {
-                        printf("%c", str[j]);
-                    }
-                }
-                
-                i++;
-                continue;
-            }
-            
-            if (tokens[i].type == TOK_IDENT) {
-                Variable *v = get_var(tokens[i].text);
-                if (v && v->var_type == VAR_STRING) {
-                    char *str = v->string_value;
-                    for (size_t j = 0; str[j] != '\0'; j++) {
-                        if (str[j] == '\\' && str[j+1] == 'n') {
-                            putchar('\n');
-                            j++;
-                        } else {
-                            printf("%c", str[j]);
-                        }
-                    }
-                    
-                    i++;
-                    continue;
-                }
-            }
-            
-            double result = evaluate_expression(tokens, &i);
-            printf("%.1lf", result);
+    if (ctx->loaded || ctx->program.symbol_count) fail("This context already loaded a program\n");
+    Token *tokens;
+    size_t token_count = tokenize(source, length, &tokens);
+    load_program(tokens, token_count);
+    ctx->loaded = 1;
+    return api_leave(ctx, 0);
+}
 
-            continue;
-        }
+int kinnie_call(kinnie_ctx *ctx, const char *name, const double *args, size_t arg_count, double *result) {
+    jmp_buf target;
+    if (setjmp(target)) return api_leave(ctx, 1);
+    api_enter(ctx, &target);
 
-        if (tokens[i].type == TOK_IF_START) {
-            i++;
+    if (!ctx->loaded) fail("No program is loaded\n");
+    int symbol = find_symbol(name, strlen(name));
+    if (symbol < 0 || !get_function(symbol)) fail("Unknown function: %s\n", name);
+    if (arg_count > MAX_FUNC_PARAMS) fail("Too many arguments\n");
 
-            double left = 0;
-            if (tokens[i].type == TOK_NUMBER) {
-                left = atof(tokens[i].text);
-            } else if (tokens[i].type == TOK_IDENT) {
-                Variable *v = get_var(tokens[i].text);
-                if (!v || v->var_type != VAR_DOUBLE) {
-                    fprintf(stderr, "Variable not found or not double: %s\n", tokens[i].text);
-                    exit(1);
-                }
-                left = v->double_value;
-            }
+    /* Whole numbers are passed as integers, as if they were written in the source. */
+    Value values[MAX_FUNC_PARAMS];
+    for (size_t i = 0; i < arg_count; i++) {
+        if (args[i] > -1e15 && args[i] < 1e15 && args[i] == (double)(long long)args[i])
+            values[i] = make_int((long long)args[i]);
+        else
+            values[i] = make_double(args[i]);
+    }
 
-            int condition_met = 0;
-            TokenType op = tokens[i + 1].type;
-            if (op == TOK_EQUALS || op == TOK_MORE || op == TOK_LESS || op == TOK_NOT_EQUALS || op == TOK_MORE_EQUALS || op == TOK_LESS_EQUALS) {
-                i += 2;
+    call_function(resolve_function(symbol, arg_count), values);
+    if (result) *result = number_value(call_result(symbol));
+    return api_leave(ctx, 0);
+}
 
-                double right = 0;
-                if (tokens[i].type == TOK_NUMBER) {
-                    right = atof(tokens[i].text);
-                } else if (tokens[i].type == TOK_IDENT) {
-                    Variable *v = get_var(tokens[i].text);
-                    if (!v || v->var_type != VAR_DOUBLE) {
-                        fprintf(stderr, "Variable not found or not double: %s\n", tokens[i].text);
-                        exit(1);
-                    }
-                    right = v->double_value;
-                }
+const char *kinnie_error(const kinnie_ctx *ctx) {
+    return ctx->error;
+}
 
-                i++;
-                if (op == TOK_EQUALS) condition_met = (left == right);
-                else if (op == TOK_MORE) condition_met = (left > right);
-                else if (op == TOK_LESS) condition_met = (left < right);
-                else if (op == TOK_NOT_EQUALS) condition_met = (left != right);
-                else if (op == TOK_MORE_EQUALS) condition_met = (left >= right);
-                else if (op == TOK_LESS_EQUALS) condition_met = (left <= right);
+void kinnie_destroy(kinnie_ctx *ctx) {
+    if (!ctx) return;
+    free_program(&ctx->program);
+    free(ctx);
+}
 
-                if (tokens[i].type != TOK_LBRACE) {
-                    fprintf(stderr, "Expected '{' after if condition\n");
-                    exit(1);
-                }
-                i++;
-            } else {
-                condition_met = (left != 0);
-                
-                if (tokens[i + 1].type != TOK_LBRACE) {
-                    fprintf(stderr, "Expected '{' after if condition\n");
-                    exit(1);
-                }
-                i += 2;
-            }
+#ifdef KINNIE_THREADS
+/* Writes all of data to fd; returns 0 if the connection failed. */
+int write_all(int fd, const void *data, size_t length) {
+    const char *p = data;
 
-            size_t block_start = i;
-            size_t block_end = i;
-            int depth = 1;
-            
-            while (depth > 0 && tokens[block_end].type != TOK_EOF) {
-                if (tokens[block_end].type == TOK_LBRACE) depth++;
-                if (tokens[block_end].type == TOK_RBRACE) depth--;
-                if (depth > 0) block_end++;
-            }
+    while (length) {
+        ssize_t written = write(fd, p, length);
+        if (written < 0 && errno == EINTR) continue;
+        if (written <= 0) return 0;
+        p += written;
+        length -= written;
+    }
+    return 1;
+}
 
-            Token if_tokens[MAX_TOKENS];
-            size_t if_token_count = 0;
-            for (size_t j = block_start; j < block_end; j++) {
-                if_tokens[if_token_count++] = tokens[j];
-            }
-            if_tokens[if_token_count].type = TOK_EOF;
+/* Reads exactly length bytes from fd; returns 0 at the end of the connection or on an error. */
+int read_exact(int fd, void *data, size_t length) {
+    char *p = data;
 
-            if (condition_met) {
-                push_scope(0);
-                interpret_tokens(if_tokens, if_token_count);
-                pop_scope();
-            }
-            
-            i = block_end + 1;
+    while (length) {
+        ssize_t got = read(fd, p, length);
+        if (got < 0 && errno == EINTR) continue;
+        if (got <= 0) return 0;
+        p += got;
+        length -= got;
+    }
+    return 1;
+}
 
-            if (i < token_count && tokens[i].type == TOK_ELSE) {
-                i++;
-                
-                if (tokens[i].type != TOK_LBRACE) {
-                    fprintf(stderr, "Expected '{' after else\n");
-                    exit(1);
-                }
-                i++;
+/* Sends data as frames of kind, splitting it if it is too long for one. */
+int send_frame(int fd, int kind, const void *data, size_t length) {
+    const char *p = data;
 
-                size_t else_start = i;
-                size_t else_end = i;
-                depth = 1;
-                
-                while (depth > 0 && tokens[else_end].type != TOK_EOF) {
-                    if (tokens[else_end].type == TOK_LBRACE) depth++;
-                    if (tokens[else_end].type == TOK_RBRACE) depth--;
-                    if (depth > 0) else_end++;
-                }
+    do {
+        unsigned int part = length > FRAME_MAX ? FRAME_MAX : (unsigned int)length;
+        char head[5];
+        head[0] = (char)kind;
+        memcpy(head + 1, &part, sizeof(part));
+        if (!write_all(fd, head, sizeof(head)) || !write_all(fd, p, part)) return 0;
+        p += part;
+        length -= part;
+    } while (length);
+    return 1;
+}
 
-                Token else_tokens[MAX_TOKENS];
-                size_t else_token_count = 0;
-                for (size_t j = else_start; j < else_end; j++) {
-                    else_tokens[else_token_count++] = tokens[j];
-                }
-                else_tokens[else_token_count].type = TOK_EOF;
+/*
+ * Receives one frame from fd and returns its data with a NUL after it, or
+ * NULL if the connection ended or the frame is longer than FRAME_MAX.
+ */
+char *receive_frame(int fd, int *kind, size_t *size) {
+    char head[5];
+    unsigned int length;
 
-                if (!condition_met) {
-                    push_scope(0);
-                    interpret_tokens(else_tokens, else_token_count);
-                    pop_scope();
-                }
-                
-                i = else_end + 1;
-            }
+    if (!read_exact(fd, head, sizeof(head))) return NULL;
+    memcpy(&length, head + 1, sizeof(length));
+    if (length > FRAME_MAX) return NULL;
+
+    char *data = malloc((size_t)length + 1);
+    if (!data) {
+        fail_errno("malloc");
+    }
+    if (!read_exact(fd, data, length)) {
+        free(data);
+        return NULL;
+    }
+    data[length] = '\0';
+    *kind = (unsigned char)head[0];
+    *size = length;
+    return data;
+}
+
+/*
+ * A program loaded by --serve. Runs never share one: a program is busy
+ * while a run uses it, and a request for a program whose copies are all
+ * busy loads another copy. Copies of a file whose size, inode or
+ * modification time, to the nanosecond, has changed since are freed as
+ * soon as they are idle.
+ */
+typedef struct ServedProgram {
+    char *path;
+    struct timespec mtime;
+    ino_t inode;
+    off_t size;
+    int busy;
+    int stale;
+    Program program;
+    struct ServedProgram *next;
+} ServedProgram;
+
+pthread_mutex_t served_lock = PTHREAD_MUTEX_INITIALIZER;
+ServedProgram *served_programs = NULL;
+
+void free_served(ServedProgram *served) {
+    free_program(&served->program);
+    free(served->path);
+    free(served);
+}
+
+/* Takes an idle copy of the program at path as st describes it, or returns NULL if there is none. */
+ServedProgram *serve_acquire(const char *path, const struct stat *st) {
+    ServedProgram *found = NULL;
+    ServedProgram **link = &served_programs;
 
+    pthread_mutex_lock(&served_lock);
+    while (*link) {
+        ServedProgram *served = *link;
+        if (strcmp(served->path, path) != 0) {
+            link = &served->next;
             continue;
         }
 
-        if (tokens[i].type == TOK_LOOP_START) {
-            i++;
-            
-            char counter_name[MAX_NAME_LEN];
-            strcpy(counter_name, tokens[i].text);
-            i++;
-            
-            Variable *counter_var = get_var(counter_name);
-            if (!counter_var || counter_var->var_type != VAR_DOUBLE) {
-                fprintf(stderr, "Loop counter not found or not int: %s\n", counter_name);
-                exit(1);
-            }
+        if (served->mtime.tv_sec != st->st_mtim.tv_sec || served->mtime.tv_nsec != st->st_mtim.tv_nsec ||
+            served->inode != st->st_ino || served->size != st->st_size)
+            served->stale = 1;
+        if (served->stale && !served->busy) {
+            *link = served->next;
+            free_served(served);
+            continue;
+        }
+        if (!served->stale && !served->busy && !found) found = served;
+        link = &served->next;
+    }
+    if (found) found->busy = 1;
+    pthread_mutex_unlock(&served_lock);
+    return found;
+}
 
-            size_t goal = counter_var->double_value;
-            
-            if (tokens[i].type != TOK_LBRACE) {
-                fprintf(stderr, "Expected '{' after repeat\n");
-                exit(1);
-            }
-            i++;
+/* Makes a newly loaded copy available to later requests. */
+void serve_add(ServedProgram *served) {
+    pthread_mutex_lock(&served_lock);
+    served->next = served_programs;
+    served_programs = served;
+    pthread_mutex_unlock(&served_lock);
+}
 
-            size_t loop_start = i;
-            size_t loop_end = i;
-            int depth = 1;
-            
-            while (depth > 0 && tokens[loop_end].type != TOK_EOF) {
-                if (tokens[loop_end].type == TOK_LBRACE) depth++;
-                if (tokens[loop_end].type == TOK_RBRACE) depth--;
-                if (depth > 0) loop_end++;
-            }
+/* Ends a run's use of served; one that is no longer current is freed. */
+void serve_release(ServedProgram *served) {
+    pthread_mutex_lock(&served_lock);
+    served->busy = 0;
+    if (served->stale) {
+        ServedProgram **link = &served_programs;
+        while (*link != served) link = &(*link)->next;
+        *link = served->next;
+        free_served(served);
+    }
+    pthread_mutex_unlock(&served_lock);
+}
 
-            Token loop_tokens[MAX_TOKENS];
-            size_t loop_token_count = 0;
-            for (size_t j = loop_start; j < loop_end; j++) {
-                loop_tokens[loop_token_count++] = tokens[j];
-            }
-            loop_tokens[loop_token_count].type = TOK_EOF;
+/*
+ * What a --serve worker holds for the request it is running. It lives
+ * outside the stack, so that when a failure unwinds the request, whatever
+ * had been set up by then can still be freed.
+ */
+typedef struct {
+    char *directory;
+    char **args;
+    size_t arg_count;
+    size_t arg_capacity;
+    char *path;
+    const char *source;
+    size_t source_size;
+    ServedProgram *served;
+    int shared;
+} ServeRun;
 
-            counter_var->double_value = 0;
-            
-            while (counter_var->double_value < goal) {
-                push_scope(0);
-                interpret_tokens(loop_tokens, loop_token_count);
-                pop_scope();
-                counter_var->double_value++;
-            }
-            
-            i = loop_end + 1;
-            continue;
+/* Reads a request into run; returns 0 if it is incomplete or malformed. */
+int serve_receive(int client, ServeRun *run) {
+    for (;;) {
+        int kind;
+        size_t size;
+        char *data = receive_frame(client, &kind, &size);
+        if (!data) return 0;
+
+        if (kind == FRAME_RUN) {
+            free(data);
+            return run->directory != NULL;
+        } else if (kind == FRAME_DIRECTORY && !run->directory) {
+            run->directory = data;
+        } else if (kind == FRAME_ARGUMENT) {
+            run->args = grow_array(run->args, &run->arg_capacity, run->arg_count + 1, sizeof(char *));
+            run->args[run->arg_count++] = data;
+        } else {
+            free(data);
+            return 0;
         }
+    }
+}
 
-        if (tokens[i].type == TOK_RETURN) {
-            i++;
-            
-            if (tokens[i].type == TOK_STRING) {
-                return_value.var_type = VAR_STRING;
-                strncpy(return_value.string_value, tokens[i].text, MAX_STRING_LEN - 1);
-                return_value.string_value[MAX_STRING_LEN - 1] = 0;
-                has_return_value = 1;
-                i++;
-            } else {
-                double result = evaluate_expression(tokens, &i);
-                return_value.var_type = VAR_DOUBLE;
-                return_value.double_value = result;
-                has_return_value = 1;
-            }
-            
-            return;
+/* Loads the program the request names, as a command line would, and runs it. */
+void serve_run(ServeRun *run) {
+    const char *file = NULL;
+
+    for (size_t a = 0; a < run->arg_count; a++) {
+        const char *arg = run->args[a];
+        if (strcmp(arg, "--flush=line") == 0) {
+            flush_policy = FLUSH_LINE;
+        } else if (strcmp(arg, "--flush=full") == 0) {
+            flush_policy = FLUSH_FULL;
+        } else if (strcmp(arg, "--flush=exit") == 0) {
+            flush_policy = FLUSH_EXIT;
+        } else if (strncmp(arg, "--", 2) == 0) {
+            fail("%s cannot be used with --connect; pass it to --serve instead\n", arg);
+        } else if (!file) {
+            file = arg;
+        } else {
+            file = NULL;
+            break;
+        }
+    }
+    if (!file) {
+        fail("Usage: kinnie --connect=SOCKET [--flush=line|full|exit] file.kn\n");
+    }
+
+    run->served = calloc(1, sizeof(ServedProgram));
+    if (!run->served) {
+        fail_errno("calloc");
+    }
+
+    if (!has_extension(file, ".kn")) {
+        Token *tokens;
+        program = &run->served->program;
+        size_t token_count = tokenize(file, strlen(file), &tokens);
+        load_program(tokens, token_count);
+    } else {
+        size_t length = strlen(file) + 1;
+        if (file[0] != '/') length += strlen(run->directory) + 1;
+        run->path = malloc(length);
+        if (!run->path) {
+            fail_errno("malloc");
         }
+        if (file[0] == '/') snprintf(run->path, length, "%s", file);
+        else snprintf(run->path, length, "%s/%s", run->directory, file);
 
-        if (tokens[i].type == TOK_END) {
-            return;
+        struct stat st;
+        if (stat(run->path, &st) < 0) {
+            fail_errno("open");
         }
 
-        fprintf(stderr, "Unknown command at position %zu, token type: %d\n", i, tokens[i].type);
-        exit(1);
+        ServedProgram *served = serve_acquire(run->path, &st);
+        if (served) {
+            free(run->served);
+            run->served = served;
+            run->shared = 1;
+        } else {
+            program = &run->served->program;
+            run->source = load_source(run->path, &run->source_size);
+            load_file(run->path, run->source, run->source_size);
+            unload_source(run->source, run->source_size);
+            run->source = NULL;
+
+            run->served->path = run->path;
+            run->served->mtime = st.st_mtim;
+            run->served->inode = st.st_ino;
+            run->served->size = st.st_size;
+            run->served->busy = 1;
+            run->path = NULL;
+            serve_add(run->served);
+            run->shared = 1;
+        }
     }
+
+    program = &run->served->program;
+    interpret();
 }
 
-void parse_functions(Token tokens[], size_t token_count) {
-    size_t i = 0;
+/* Ends a request: sends the rest of its output and its exit status, then frees run. */
+void serve_finish(int client, ServeRun *run, int failed) {
+    fail_target = NULL;
+    if (failed) reset_runtime();
 
-    while (i < token_count && tokens[i].type != TOK_EOF) {
-        if (tokens[i].type == TOK_FUN_START) {
-            i++;
-            
-            if (tokens[i].type != TOK_IDENT) {
-                fprintf(stderr, "Expected function name after 'fun'\n");
-                exit(1);
-            }
+    out_flush();
+    if (failed && !out_client_gone) {
+        size_t length = strlen(fail_message);
+        fail_message[length] = '\n';
+        send_frame(client, FRAME_STDERR, fail_message, length + 1);
+    }
+    if (!out_client_gone) {
+        char status[16];
+        snprintf(status, sizeof(status), "%d", failed);
+        send_frame(client, FRAME_EXIT, status, strlen(status));
+    }
+    out_client = -1;
+    program = NULL;
+    free_arrays(NULL);
+    free_maps(NULL);
 
-            char func_name[MAX_NAME_LEN];
-            strcpy(func_name, tokens[i].text);
-            i++;
+    if (run->source) unload_source(run->source, run->source_size);
+    if (run->served && run->shared) serve_release(run->served);
+    else if (run->served) free_served(run->served);
+    for (size_t a = 0; a < run->arg_count; a++) {
+        free(run->args[a]);
+    }
+    free(run->args);
+    free(run->directory);
+    free(run->path);
+}
 
-            functions[function_count].param_count = 0;
+/* Runs one request from client and sends back its output and exit status. */
+void serve_request(int client) {
+    static _Thread_local ServeRun run;
+    jmp_buf target;
 
-            if (tokens[i].type == TOK_LBRACKET) {
-                i++;
-                
-                while (tokens[i].type != TOK_RBRACKET && tokens[i].type != TOK_EOF) {
-                    if (tokens[i].type == TOK_IDENT) {
-                        strncpy(
-                            functions[function_count].param_names[functions[function_count].param_count],
-                            tokens[i].text,
-                            MAX_NAME_LEN - 1
-                        );
-                        functions[function_count].param_count++;
-                        i++;
-                        
-                        if (tokens[i].type == TOK_COMMA) {
-                            i++;
-                        }
-                    } else {
-                        fprintf(stderr, "Expected parameter name\n");
-                        exit(1);
-                    }
-                }
-                
-                if (tokens[i].type != TOK_RBRACKET) {
-                    fprintf(stderr, "Expected ')' after parameters\n");
-                    exit(1);
-                }
-                i++;
-            }
+    memset(&run, 0, sizeof(run));
+    out_client = client;
+    out_client_gone = 0;
+    flush_policy = FLUSH_FULL;
 
-            if (tokens[i].type != TOK_LBRACE) {
-                fprintf(stderr, "Expected '{' after function signature\n");
-                exit(1);
-            }
-            i++;
+    if (setjmp(target)) {
+        serve_finish(client, &run, 1);
+        return;
+    }
+    fail_target = &target;
 
-            size_t fun_start = i;
-            size_t fun_end = i;
-            int depth = 1;
-            
-            while (depth > 0 && tokens[fun_end].type != TOK_EOF) {
-                if (tokens[fun_end].type == TOK_LBRACE) depth++;
-                if (tokens[fun_end].type == TOK_RBRACE) depth--;
-                if (depth > 0) fun_end++;
-            }
+    if (!serve_receive(client, &run)) {
+        fail("Incomplete request\n");
+    }
+    serve_run(&run);
+    serve_finish(client, &run, 0);
+}
 
-            strncpy(functions[function_count].name, func_name, MAX_NAME_LEN - 1);
-            functions[function_count].token_count = 0;
-            
-            for (size_t j = fun_start; j < fun_end; j++) {
-                functions[function_count].tokens[functions[function_count].token_count++] = tokens[j];
+void *serve_worker(void *arg) {
+    int listener = (int)(size_t)arg;
+
+    for (;;) {
+        int client = accept(listener, NULL, NULL);
+        if (client < 0) {
+            if (errno == EBADF || errno == EINVAL || errno == ENOTSOCK) {
+                fail_errno("accept");
             }
-            functions[function_count].tokens[functions[function_count].token_count].type = TOK_EOF;
-            
-            function_count++;
-            i = fun_end + 1;
             continue;
         }
-        i++;
+        serve_request(client);
+        close(client);
     }
+    return NULL;
 }
 
-void interpret(Token tokens[], size_t token_count) {
-    parse_functions(tokens, token_count);
+/*
+ * --serve: listens on the Unix socket at path and runs the programs that
+ * --connect clients ask for, on one worker thread per CPU. Programs stay
+ * loaded between runs, keyed by path, size and modification time, so a
+ * warm request neither starts a process nor reads the source.
+ */
+_Noreturn void serve(const char *path) {
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        fail("Socket path is too long: %s\n", path);
+    }
+    strcpy(address.sun_path, path);
 
-    Function *main_func = get_function("main");
-    if (!main_func) {
-        fprintf(stderr, "No 'main' function found\n");
-        exit(1);
+    /* A socket left behind by a server that has exited is replaced. */
+    struct stat st;
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+        int probe = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (probe >= 0 && connect(probe, (struct sockaddr *)&address, sizeof(address)) == 0) {
+            fail("A server is already listening on %s\n", path);
+        }
+        if (probe >= 0) close(probe);
+        unlink(path);
     }
 
-    double no_args[1] = {0};
-    call_function("main", no_args, 0);
-}
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener < 0) {
+        fail_errno("socket");
+    }
+    if (bind(listener, (struct sockaddr *)&address, sizeof(address)) < 0) {
+        fail_errno("bind");
+    }
+    if (listen(listener, SOMAXCONN) < 0) {
+        fail_errno("listen");
+    }
+    signal(SIGPIPE, SIG_IGN);
 
-int has_extension(const char *name, const char *ext) {
-    size_t nlen = strlen(name);
-    size_t elen = strlen(ext);
-    if (nlen < elen) return 0;
-    return strcmp(name + nlen - elen, ext) == 0;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    for (long t = 1; t < cpus; t++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, serve_worker, (void *)(size_t)listener) != 0) break;
+        pthread_detach(thread);
+    }
+    serve_worker((void *)(size_t)listener);
+    exit(0);
 }
 
-int main(int argc, char **argv) {
-    if (argc != 2) {
-        fprintf(stderr, "Usage: %s file.kn\n", argv[0]);
-        return 1;
+/*
+ * --connect: has the server at path run this command line and passes its
+ * output through. Returns the exit status of the run.
+ */
+int serve_connect(const char *path, int argc, char **argv) {
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        fail("Socket path is too long: %s\n", path);
     }
+    strcpy(address.sun_path, path);
 
-    Token tokens[MAX_TOKENS];
-    size_t token_count;
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        fail_errno("socket");
+    }
+    if (connect(fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
+        fail("Cannot connect to %s: %s\n", path, strerror(errno));
+    }
+    signal(SIGPIPE, SIG_IGN);
 
-    if (!has_extension(argv[1], ".kn")) {
-        token_count = tokenize(argv[1], tokens);
-        interpret(tokens, token_count);
-        return 0;
+    char directory[FILENAME_MAX];
+    if (!getcwd(directory, sizeof(directory))) {
+        fail_errno("getcwd");
     }
 
-    FILE *f = fopen(argv[1], "rb");
-    if (!f) {
-        perror("fopen");
-        return 1;
+    /* Output reaches a terminal line by line, as it does without a server; later options override this. */
+    int sent = send_frame(fd, FRAME_DIRECTORY, directory, strlen(directory));
+    if (isatty(fileno(stdout))) sent = sent && send_frame(fd, FRAME_ARGUMENT, "--flush=line", 12);
+    for (int a = 1; a < argc; a++) {
+        if (strncmp(argv[a], "--connect=", 10) == 0) continue;
+        sent = sent && send_frame(fd, FRAME_ARGUMENT, argv[a], strlen(argv[a]));
     }
+    sent = sent && send_frame(fd, FRAME_RUN, "", 0);
 
-    fseek(f, 0, SEEK_END);
-    long size = ftell(f);
-    rewind(f);
+    for (;;) {
+        int kind;
+        size_t size;
+        char *data = sent ? receive_frame(fd, &kind, &size) : NULL;
+        if (!data) {
+            fail("Lost the connection to %s\n", path);
+        }
 
-    if (size <= 0) {
-        fprintf(stderr, "The file is empty\n");
-        fclose(f);
-        return 1;
+        if (kind == FRAME_STDOUT) {
+            fwrite(data, 1, size, stdout);
+            fflush(stdout);
+        } else if (kind == FRAME_STDERR) {
+            fwrite(data, 1, size, stderr);
+        } else if (kind == FRAME_EXIT) {
+            int status = atoi(data);
+            free(data);
+            close(fd);
+            return status;
+        }
+        free(data);
     }
+}
+#endif
 
-    char *source = malloc(size + 1);
-    if (!source) {
-        perror("malloc");
-        fclose(f);
+#ifndef KINNIE_LIBRARY
+int main(int argc, char **argv) {
+    const char *path = NULL;
+    const char *serve_path = NULL;
+    Program main_program = {0};
+
+    program = &main_program;
+
+    flush_policy = isatty(fileno(stdout)) ? FLUSH_LINE : FLUSH_FULL;
+
+    for (int a = 1; a < argc; a++) {
+        if (strcmp(argv[a], "--walk") == 0) {
+            use_token_walker = 1;
+        } else if (strcmp(argv[a], "--flush=line") == 0) {
+            flush_policy = FLUSH_LINE;
+        } else if (strcmp(argv[a], "--flush=full") == 0) {
+            flush_policy = FLUSH_FULL;
+        } else if (strcmp(argv[a], "--flush=exit") == 0) {
+            flush_policy = FLUSH_EXIT;
+        } else if (strcmp(argv[a], "--dump-optimized") == 0) {
+            dump_optimized = 1;
+            use_token_walker = 0;
+        } else if (strcmp(argv[a], "--jit") == 0) {
+            use_jit = 1;
+        } else if (strcmp(argv[a], "--jit-check") == 0) {
+            jit_check = 1;
+            use_token_walker = 0;
+        } else if (strcmp(argv[a], "--stats") == 0) {
+            show_stats = count_statements = 1;
+        } else if (strncmp(argv[a], "--threads=", 10) == 0) {
+            prep_threads = strtoul(argv[a] + 10, NULL, 10);
+        } else if (strncmp(argv[a], "--memo-size=", 12) == 0) {
+            size_t entries = strtoul(argv[a] + 12, NULL, 10);
+            memo_size = 1;
+            while (memo_size < entries) memo_size <<= 1;
+        } else if (strncmp(argv[a], "--max-depth=", 12) == 0) {
+            max_call_depth = strtoul(argv[a] + 12, NULL, 10);
+        } else if (strcmp(argv[a], "--no-cache") == 0) {
+            use_cache = 0;
+        } else if (strncmp(argv[a], "--serve=", 8) == 0) {
+            serve_path = argv[a] + 8;
+        } else if (strncmp(argv[a], "--connect=", 10) == 0) {
+#ifdef KINNIE_THREADS
+            return serve_connect(argv[a] + 10, argc, argv);
+#else
+            fail("--connect needs Unix sockets\n");
+#endif
+        } else if (strcmp(argv[a], "--profile") == 0) {
+            profiling = count_statements = 1;
+        } else if (strncmp(argv[a], "--profile=", 10) == 0) {
+            profiling = count_statements = 1;
+            profile_stacks_path = argv[a] + 10;
+        } else if (!path) {
+            path = argv[a];
+        } else {
+            path = NULL;
+            break;
+        }
+    }
+
+    if (serve_path) {
+        if (path || use_jit || jit_check || show_stats || profiling || dump_optimized) {
+            fail("--serve takes only --walk, --threads, --memo-size, --max-depth and --no-cache\n");
+        }
+#ifdef KINNIE_THREADS
+        serve(serve_path);
+#else
+        fail("--serve needs Unix sockets\n");
+#endif
+    }
+
+    if (!path) {
+        fprintf(stderr, "Usage: %s [--walk] [--flush=line|full|exit] [--dump-optimized] [--jit] [--jit-check] [--stats] [--threads=N] [--memo-size=N] [--max-depth=N] [--no-cache] [--profile[=stacks.folded]] [--connect=SOCKET] file.kn\n"
+                        "       %s [--walk] [--threads=N] [--memo-size=N] [--max-depth=N] [--no-cache] --serve=SOCKET\n", argv[0], argv[0]);
         return 1;
     }
 
-    fread(source, 1, size, f);
-    source[size] = '\0';
-    fclose(f);
+#ifndef KINNIE_JIT
+    if (use_jit || jit_check) {
+        fprintf(stderr, "The JIT is only available on x86-64 Linux\n");
+        use_jit = jit_check = 0;
+    }
+#endif
+
+    atexit(out_flush_at_exit);
+
+    Token *tokens;
 
-    token_count = tokenize(source, tokens);
-    interpret(tokens, token_count);
+    if (!has_extension(path, ".kn")) {
+        size_t token_count = tokenize(path, strlen(path), &tokens);
+        load_program(tokens, token_count);
+    } else {
+        size_t size;
+        const char *source = load_source(path, &size);
+        load_file(path, source, size);
+        unload_source(source, size);
+    }
+
+#ifdef KINNIE_JIT
+    if (jit_check)
+        return run_jit_check();
+#endif
 
-    free(source);
+    interpret();
+    profile_report();
+    report_stats(program->token_count);
+
+    free_program(program);
+    free_arrays(NULL);
+    free_maps(NULL);
     return 0;
-}
\ No newline at end of file
+}
+#endif
\ No newline at end of file
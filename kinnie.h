@@ -0,0 +1,35 @@
+#ifndef KINNIE_H
+#define KINNIE_H
+
+#include <stddef.h>
+
+/*
+ * Embedding kinnie. Compile kinnie.c with KINNIE_LIBRARY defined to leave
+ * out main. Every kinnie_ctx holds a program of its own, and different
+ * contexts can run at the same time on different threads; one context is
+ * used by one thread at a time. Output from 'out' goes to stdout and is
+ * written out before each call returns.
+ */
+typedef struct kinnie_ctx kinnie_ctx;
+
+#define KINNIE_OK 0
+#define KINNIE_ERROR -1
+
+/* Returns a new context with no program loaded, or NULL if out of memory. */
+kinnie_ctx *kinnie_create(void);
+
+/* Tokenizes, parses and compiles source. A context loads one program. */
+int kinnie_load(kinnie_ctx *ctx, const char *source, size_t length);
+
+/*
+ * Calls the function name with arg_count numbers. If result is not NULL,
+ * the function has to return a number, which is stored there.
+ */
+int kinnie_call(kinnie_ctx *ctx, const char *name, const double *args, size_t arg_count, double *result);
+
+/* The message of the last call on ctx that returned KINNIE_ERROR. */
+const char *kinnie_error(const kinnie_ctx *ctx);
+
+void kinnie_destroy(kinnie_ctx *ctx);
+
+#endif